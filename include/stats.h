@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+/**
+ * \file
+ * Layout of the statistics dataspace of the NVMe driver.
+ *
+ * The driver publishes the I/O statistics of its clients, namespaces and I/O
+ * submission queues periodically into a dataspace, which monitoring tasks
+ * obtain read-only via the driver's `stats` capability. The dataspace starts
+ * with a Stats_header followed by `num_entries` Stats_entry structures.
+ *
+ * Readers do not take any locks. The driver increments the sequence counter
+ * before and after updating the contents, so a reader copies the dataspace
+ * with stats_snapshot(), which retries until it sees an even sequence
+ * counter that did not change during the copy or gives up after a number of
+ * attempts.
+ */
+
+#include <l4/sys/types.h>
+
+#include <string.h>
+
+namespace Nvme {
+
+/**
+ * Latency histogram with logarithmic buckets.
+ *
+ * Bucket `i` > 0 counts latencies of [2^(i-1), 2^i) cycles, bucket 0 those of
+ * 0 cycles. The last bucket also takes all longer latencies.
+ */
+struct Latency_histogram
+{
+  enum { Buckets = 40 };
+
+  l4_uint64_t counts[Buckets];
+
+  void add(l4_uint64_t cycles)
+  {
+    unsigned b = cycles ? 64 - __builtin_clzll(cycles) : 0;
+    ++counts[b < Buckets ? b : Buckets - 1];
+  }
+
+  void merge(Latency_histogram const &o)
+  {
+    for (unsigned i = 0; i < Buckets; ++i)
+      counts[i] += o.counts[i];
+  }
+
+  l4_uint64_t total() const
+  {
+    l4_uint64_t n = 0;
+    for (unsigned i = 0; i < Buckets; ++i)
+      n += counts[i];
+    return n;
+  }
+
+  /// Exclusive upper bound of bucket `i` [cycles]
+  static l4_uint64_t bound(unsigned i)
+  { return 1ULL << i; }
+
+  /**
+   * Upper bound of the bucket containing the given quantile [cycles].
+   *
+   * \param num, den  Quantile as a fraction, e.g. 999/1000 for p99.9.
+   *
+   * \return Bound or 0 if the histogram is empty.
+   */
+  l4_uint64_t quantile(l4_uint64_t num, l4_uint64_t den) const
+  {
+    l4_uint64_t n = total();
+    if (!n)
+      return 0;
+
+    // Rank of the quantile sample, rounded up
+    l4_uint64_t rank = (n * num + den - 1) / den;
+    l4_uint64_t seen = 0;
+    for (unsigned i = 0; i < Buckets; ++i)
+      if ((seen += counts[i]) >= rank)
+        return bound(i);
+    return bound(Buckets - 1);
+  }
+};
+
+/**
+ * I/O counters shared by clients and submission queues.
+ *
+ * Clients count requests, submission queues count commands. All members are
+ * plain integers so that the statistics can be copied as a whole.
+ */
+struct Io_counters
+{
+  l4_uint64_t reads;
+  l4_uint64_t writes;
+  l4_uint64_t flushes;
+  l4_uint64_t write_zeroes;
+  l4_uint64_t discards;
+  l4_uint64_t read_bytes;
+  l4_uint64_t write_bytes;
+  /// Requests or commands completed with an error
+  l4_uint64_t errors;
+  /// Requests or commands currently in flight
+  l4_uint32_t inflight;
+  /// Maximum of `inflight` so far, or the largest maximum of merged counters
+  l4_uint32_t max_inflight;
+  /// Submission-to-completion latencies
+  Latency_histogram latency;
+
+  void started()
+  {
+    if (++inflight > max_inflight)
+      max_inflight = inflight;
+  }
+
+  void merge(Io_counters const &o)
+  {
+    reads += o.reads;
+    writes += o.writes;
+    flushes += o.flushes;
+    write_zeroes += o.write_zeroes;
+    discards += o.discards;
+    read_bytes += o.read_bytes;
+    write_bytes += o.write_bytes;
+    errors += o.errors;
+    inflight += o.inflight;
+    if (o.max_inflight > max_inflight)
+      max_inflight = o.max_inflight;
+    latency.merge(o.latency);
+  }
+};
+
+/// Statistics of the requests of a client
+struct Client_stats : Io_counters
+{
+  /// Requests rejected with -L4_EBUSY, to be retried by the client later
+  l4_uint64_t busy;
+};
+
+/// Statistics of the commands of an I/O submission queue
+struct Queue_stats : Io_counters
+{
+  /**
+   * Number of requests rejected because neither this queue nor any other
+   * queue of its priority class had enough free entries, request groups, PRP
+   * List pages or Dataset Management range buffers.
+   * Each rejected request counts once, at the queue tried last.
+   */
+  l4_uint64_t full;
+  /// Failed commands per Status Code Type
+  l4_uint64_t sct_errors[8];
+  /// Status Field of the most recent failed command
+  l4_uint16_t last_error;
+
+  void failed(l4_uint16_t sf)
+  {
+    ++errors;
+    ++sct_errors[(sf >> 8) & 0x7];
+    last_error = sf;
+  }
+
+  void merge(Queue_stats const &o)
+  {
+    Io_counters::merge(o);
+    full += o.full;
+    for (unsigned i = 0; i < 8; ++i)
+      sct_errors[i] += o.sct_errors[i];
+    if (o.last_error)
+      last_error = o.last_error;
+  }
+};
+
+/// Header at the start of the statistics dataspace
+struct Stats_header
+{
+  enum
+  {
+    Magic = 0x5453564e, ///< "NVST"
+    Version = 1,
+  };
+
+  l4_uint32_t magic;
+  l4_uint32_t version;
+  /// Size of a Stats_entry, for readers built against other versions [bytes]
+  l4_uint32_t entry_size;
+  /// Number of entries the dataspace has room for
+  l4_uint32_t max_entries;
+  /// Number of valid entries
+  l4_uint32_t num_entries;
+  l4_uint32_t _pad;
+  /// Sequence counter, odd while the driver updates the dataspace
+  l4_uint64_t seq;
+  /// KIP clock at the time of the last update [us]
+  l4_uint64_t timestamp_us;
+  /**
+   * Rate of the cycle counter used for the latency histograms [cycles/ms],
+   * 0 if not known yet
+   */
+  l4_uint64_t cycles_per_ms;
+};
+
+/// Statistics of a client, a namespace or an I/O submission queue
+struct Stats_entry
+{
+  enum Kind : l4_uint8_t
+  {
+    /// Requests of the client of a namespace, including its partitions
+    Client = 1,
+    /// Commands of all I/O queues of a namespace
+    Namespace = 2,
+    /// Commands of a single I/O submission queue of a namespace
+    Queue = 3,
+  };
+
+  l4_uint8_t kind;
+  /// Priority class of the queue (Queue entries only)
+  l4_uint8_t prio;
+  /// I/O queue identifier (Queue entries only)
+  l4_uint16_t qid;
+  l4_uint32_t _pad;
+  /// Hardware ID of the namespace, `<serial number>:n<nsid>`
+  char name[40];
+  union
+  {
+    Client_stats client;  ///< Client entries
+    Queue_stats queue;    ///< Namespace and Queue entries
+  };
+};
+
+/**
+ * Take a consistent snapshot of the statistics dataspace.
+ *
+ * \param src    Statistics dataspace attached read-only.
+ * \param dst    Buffer for the snapshot.
+ * \param size   Size of both `src` and `dst` [bytes].
+ * \param tries  Maximum number of attempts to copy the dataspace.
+ *
+ * \retval true   `dst` holds a consistent copy.
+ * \retval false  The dataspace is not a statistics dataspace of a supported
+ *                version, or the driver was updating it during each attempt,
+ *                e.g. because it stopped in the middle of an update. The
+ *                contents of `dst` are undefined.
+ */
+inline bool
+stats_snapshot(void const *src, void *dst, l4_size_t size,
+               unsigned tries = 1000)
+{
+  auto const *hdr = static_cast<Stats_header const *>(src);
+  if (size < sizeof(Stats_header) || hdr->magic != Stats_header::Magic
+      || hdr->version != Stats_header::Version)
+    return false;
+
+  for (;; --tries)
+    {
+      if (!tries)
+        return false;
+
+      l4_uint64_t seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1)
+        continue;
+
+      memcpy(dst, src, size);
+
+      // Order the copy before the second read of the sequence counter.
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq)
+        break;
+    }
+
+  auto *copy = static_cast<Stats_header *>(dst);
+  l4_size_t max = (size - sizeof(Stats_header)) / sizeof(Stats_entry);
+  if (copy->num_entries > max)
+    copy->num_entries = max;
+  return true;
+}
+
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+/**
+ * \file
+ * Layout of the command trace dataspace of the NVMe driver.
+ *
+ * If tracing is enabled, the driver records the life cycle of each I/O
+ * command in a ring per I/O queue pair. The dataspace is obtained read-only
+ * via the driver's `trace` capability. It starts with a Trace_header followed
+ * by `num_rings` rings of `ring_size` bytes each. A ring consists of a
+ * Trace_ring_header and `ring_entries` Trace_event structures.
+ *
+ * Events are written in the order they happen, except that a Produce event
+ * carries the time stamp of the start of the request and is written when the
+ * command is passed to the queue. The driver overwrites the oldest events
+ * when a ring is full; trace_ring_events() copies the events of a ring that
+ * are still valid.
+ */
+
+#include <l4/sys/types.h>
+
+namespace Nvme {
+
+/// Header at the start of the trace dataspace
+struct Trace_header
+{
+  enum
+  {
+    Magic = 0x5254564e, ///< "NVTR"
+    Version = 1,
+  };
+
+  l4_uint32_t magic;
+  l4_uint32_t version;
+  /// Number of rings in use
+  l4_uint32_t num_rings;
+  /// Number of events per ring, a power of two
+  l4_uint32_t ring_entries;
+  /// Size of a ring including its header [bytes]
+  l4_uint32_t ring_size;
+  /// Size of a Trace_event, for readers built against other versions [bytes]
+  l4_uint32_t entry_size;
+  /**
+   * Rate of the cycle counter used for the time stamps [cycles/ms], 0 if not
+   * known yet
+   */
+  l4_uint64_t cycles_per_ms;
+};
+
+/// Header of the ring of an I/O queue pair
+struct Trace_ring_header
+{
+  /// Number of events recorded so far, including overwritten ones
+  l4_uint64_t pos;
+  l4_uint32_t nsid;
+  /// I/O queue identifier
+  l4_uint16_t qid;
+  /// Priority class of the submission queue
+  l4_uint8_t prio;
+  l4_uint8_t _pad;
+  /// Hardware ID of the namespace, `<serial number>:n<nsid>`
+  char name[48];
+};
+
+/// Event in the life cycle of an I/O command
+struct Trace_event
+{
+  enum Type : l4_uint8_t
+  {
+    /// Command passed to the submission queue. `stamp` is the start of the
+    /// request, which is earlier for commands produced as part of a group.
+    Produce = 1,
+    /// Tail doorbell updated, `len` is the new tail. Covers all commands
+    /// produced on the queue since the previous Doorbell event.
+    Doorbell = 2,
+    /// Completion queue entry observed, `status` is its Status Field
+    Cqe = 3,
+    /// Client callback returned. For a request split into several commands,
+    /// the event is recorded once, with the `group` of all of them.
+    Callback = 4,
+    /// Completion queue drained. The clients are notified of all requests
+    /// whose callback returned since the previous Notify event.
+    Notify = 5,
+  };
+
+  /// Cycle counter [cycles]
+  l4_uint64_t stamp;
+  /// Starting LBA (Produce of reads, writes and write zeroes only)
+  l4_uint64_t slba;
+  /// Number of logical blocks (Produce), or see Type
+  l4_uint32_t len;
+  /// Command identifier (Produce, Cqe, Callback)
+  l4_uint16_t cid;
+  /// Request group of the command plus 1, 0 if it is not part of a group
+  l4_uint16_t group;
+  l4_uint8_t type;
+  /// NVMe opcode (Produce only)
+  l4_uint8_t opc;
+  /// Status Field (Cqe only)
+  l4_uint16_t status;
+  l4_uint32_t _pad;
+};
+
+/**
+ * Copy the valid events of a ring, oldest first.
+ *
+ * \param ring     Ring in the trace dataspace.
+ * \param entries  Number of events per ring, `ring_entries` of the header.
+ * \param dst      Buffer for at least `entries` events.
+ *
+ * \return Number of events copied.
+ */
+inline unsigned
+trace_ring_events(Trace_ring_header const *ring, unsigned entries,
+                  Trace_event *dst)
+{
+  auto const *ev = reinterpret_cast<Trace_event const *>(ring + 1);
+
+  l4_uint64_t end = __atomic_load_n(&ring->pos, __ATOMIC_ACQUIRE);
+  l4_uint64_t start = end > entries ? end - entries : 0;
+  for (l4_uint64_t i = start; i < end; ++i)
+    dst[i - start] = ev[i & (entries - 1)];
+
+  // Drop the events the driver overwrote meanwhile, including the one it may
+  // be writing right now.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  l4_uint64_t now = __atomic_load_n(&ring->pos, __ATOMIC_RELAXED) + 1;
+  l4_uint64_t valid = now > entries ? now - entries : 0;
+  if (valid <= start)
+    return end - start;
+  if (valid >= end)
+    return 0;
+
+  for (l4_uint64_t i = valid; i < end; ++i)
+    dst[i - valid] = dst[i - start];
+  return end - valid;
+}
+
+}
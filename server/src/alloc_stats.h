@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+namespace Nvme {
+
+/**
+ * Heap allocation accounting.
+ *
+ * The I/O submission and completion paths are bracketed by Alloc_probe
+ * objects. If the driver is built with NVME_ALLOC_STATS defined, as the host
+ * tests in test/host do, a replacement of the global operator new counts the
+ * heap allocations and any allocation happening within a probe is accounted
+ * in `io_path_allocs`, which is expected to stay zero. Otherwise the probes
+ * are empty.
+ */
+struct Alloc_stats
+{
+  /// Total number of heap allocations done by the driver
+  static unsigned long long allocs;
+  /// Number of heap allocations done on the I/O submit/complete path
+  static unsigned long long io_path_allocs;
+
+  /// Called when an allocation on the I/O path has been detected.
+  static void io_path_alloc_detected(unsigned long long n);
+};
+
+#ifdef NVME_ALLOC_STATS
+/**
+ * Account heap allocations done during the lifetime of the probe to the I/O
+ * path.
+ */
+class Alloc_probe
+{
+public:
+  Alloc_probe() : _start(Alloc_stats::allocs) {}
+
+  ~Alloc_probe()
+  {
+    unsigned long long n = Alloc_stats::allocs - _start;
+    if (n)
+      Alloc_stats::io_path_alloc_detected(n);
+  }
+
+  Alloc_probe(Alloc_probe const &) = delete;
+  Alloc_probe &operator=(Alloc_probe const &) = delete;
+
+private:
+  unsigned long long _start;
+};
+#else
+class Alloc_probe
+{
+public:
+  Alloc_probe() {}
+
+  Alloc_probe(Alloc_probe const &) = delete;
+  Alloc_probe &operator=(Alloc_probe const &) = delete;
+};
+#endif
+
+}
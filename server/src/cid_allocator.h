@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+
+#include <cassert>
+#include <vector>
+
+namespace Nvme {
+namespace Queue {
+
+/**
+ * Allocator of Command Identifiers for a submission queue.
+ *
+ * The free CIDs are kept on a stack, so allocating and releasing a CID are
+ * constant-time operations regardless of the order in which the controller
+ * completes the commands. Recently released CIDs are handed out first, which
+ * keeps the per-CID SGL and PRP list memory that is actually in use small.
+ */
+class Cid_allocator
+{
+public:
+  explicit Cid_allocator(l4_uint16_t size)
+  : _free(size), _top(size)
+  {
+    // Start with CID 0 on top of the stack.
+    for (unsigned i = 0; i < size; i++)
+      _free[i] = size - 1 - i;
+  }
+
+  /// Returns true if there is no free CID left.
+  bool empty() const
+  { return _top == 0; }
+
+  /// Number of CIDs currently available.
+  unsigned available() const
+  { return _top; }
+
+  /// Number of CIDs managed by the allocator.
+  unsigned size() const
+  { return _free.size(); }
+
+  /**
+   * Allocate a CID.
+   *
+   * \pre The allocator is not empty.
+   */
+  l4_uint16_t alloc()
+  {
+    assert(_top > 0);
+    return _free[--_top];
+  }
+
+  /**
+   * Release a previously allocated CID.
+   */
+  void free(l4_uint16_t cid)
+  {
+    assert(_top < _free.size());
+    assert(cid < _free.size());
+    _free[_top++] = cid;
+  }
+
+private:
+  std::vector<l4_uint16_t> _free;
+  unsigned _top;
+};
+
+}
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/re/dataspace>
+
+#include <vector>
+
+#include "iomem.h"
+
+namespace Nvme {
+
+/**
+ * Controller Memory Buffer.
+ *
+ * Maps the CMB of a controller and hands out page-aligned chunks of it for
+ * queues placed in controller memory.
+ */
+class Cmb
+{
+public:
+  /**
+   * Map the controller memory buffer.
+   *
+   * \param paddr  Bus address of the buffer.
+   * \param size   Size of the buffer in bytes.
+   * \param iocap  Dataspace giving access to the I/O memory of the device.
+   */
+  Cmb(l4_uint64_t paddr, l4_size_t size, L4::Cap<L4Re::Dataspace> iocap)
+  : _mem(paddr, size, iocap), _paddr(paddr), _size(l4_trunc_page(size))
+  {
+    _free.push_back(Range{0, _size});
+  }
+
+  Cmb(Cmb const &) = delete;
+  Cmb &operator=(Cmb const &) = delete;
+
+  /**
+   * Allocate a chunk of the buffer.
+   *
+   * \param      size    Size of the chunk, rounded up to whole pages.
+   * \param[out] offset  Offset of the chunk within the buffer.
+   *
+   * \return True on success, false if the buffer has no free chunk of the
+   *         requested size.
+   */
+  bool alloc(l4_size_t size, l4_size_t *offset)
+  {
+    size = l4_round_page(size);
+    for (auto it = _free.begin(); it != _free.end(); ++it)
+      {
+        if (it->size < size)
+          continue;
+
+        *offset = it->offset;
+        it->offset += size;
+        it->size -= size;
+        if (!it->size)
+          _free.erase(it);
+        return true;
+      }
+
+    return false;
+  }
+
+  /// Return a chunk allocated with alloc() to the buffer.
+  void free(l4_size_t offset, l4_size_t size)
+  {
+    size = l4_round_page(size);
+
+    // Keep the free list sorted and merge adjacent chunks.
+    auto it = _free.begin();
+    while (it != _free.end() && it->offset < offset)
+      ++it;
+
+    it = _free.insert(it, Range{offset, size});
+    auto next = it + 1;
+    if (next != _free.end() && it->offset + it->size == next->offset)
+      {
+        it->size += next->size;
+        _free.erase(next);
+      }
+    if (it != _free.begin())
+      {
+        auto prev = it - 1;
+        if (prev->offset + prev->size == it->offset)
+          {
+            prev->size += it->size;
+            _free.erase(it);
+          }
+      }
+  }
+
+  l4_addr_t vaddr(l4_size_t offset) const
+  { return _mem.vaddr.get() + offset; }
+
+  l4_uint64_t paddr(l4_size_t offset) const
+  { return _paddr + offset; }
+
+  l4_size_t size() const
+  { return _size; }
+
+private:
+  struct Range
+  {
+    l4_size_t offset;
+    l4_size_t size;
+  };
+
+  Iomem _mem;
+  l4_uint64_t _paddr;
+  l4_size_t _size;
+  /// Free chunks sorted by offset
+  std::vector<Range> _free;
+};
+
+}
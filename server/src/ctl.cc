@@ -10,6 +10,7 @@
 #include <l4/re/dataspace>
 #include <l4/re/error_helper>
 #include <l4/re/util/cap_alloc>
+#include <l4/cxx/minmax>
 
 #include <string>
 
@@ -27,16 +28,27 @@
 #include "pci.h"
 #include "icu.h"
 
-#include <l4/util/util.h>
+#include <l4/libblock-device/errand.h>
 
 static Dbg trace(Dbg::Trace, "ctl");
 static Dbg warn(Dbg::Warn, "ctl");
 
 namespace Nvme {
 
+unsigned Ctl::ioqs = 4;
+unsigned Ctl::ioq_size_cfg = 0;
+unsigned Ctl::cq_db_interval = 32;
+unsigned Ctl::poll_us = 0;
+unsigned Ctl::irq_coalesce_thr = 0;
+unsigned Ctl::irq_coalesce_time = 0;
+unsigned Ctl::wrr_weights[3] = { 16, 4, 1 };
 bool Ctl::use_sgls = true;
 bool Ctl::use_msis = true;
 bool Ctl::use_msixs = true;
+bool Ctl::use_wcache = true;
+bool Ctl::use_cmb = false;
+bool Ctl::use_dbbuf = true;
+bool Ctl::use_wrr = false;
 
 Ctl::Ctl(L4vbus::Pci_dev const &dev, cxx::Ref_ptr<Icu> icu,
          L4Re::Util::Object_registry *registry,
@@ -51,7 +63,20 @@ Ctl::Ctl(L4vbus::Pci_dev const &dev, cxx::Ref_ptr<Icu> icu,
   _regs(new L4drivers::Mmio_register_block<32>(_iomem.vaddr.get())),
   _cap(_regs.r<32>(Regs::Ctl::Cap).read()
        | ((l4_uint64_t)_regs.r<32>(Regs::Ctl::Cap + 4).read() << 32)),
-  _sgls(false)
+  _sgls(false),
+  _wrr(use_wrr && (_cap.ams() & Regs::Ctl::Cc::Ams_wrr)),
+  _rab(0),
+  _vwc(false),
+  _oacs(0),
+  _oncs(0),
+  _wzsl(0),
+  _dmrl(0),
+  _dmrsl(0),
+  _dmsl(0),
+  _nioqs(0),
+  _next_qid(Ioq_id),
+  _next_nsid(0),
+  _nss_busy(0)
 {
   trace.printf("Device registers 0%llx @ 0%lx, CAP=%llx, VS=%x\n",
                cfg_read_bar(), _iomem.vaddr.get(), _cap.raw,
@@ -76,47 +101,98 @@ Ctl::Ctl(L4vbus::Pci_dev const &dev, cxx::Ref_ptr<Icu> icu,
         _pci_dev->enable_msi_pci();
     }
 
+  Ctl_cc cc(0);
+  cc.mps() = L4_PAGESHIFT - Mps_base;
+  if ((_cap.mpsmin() > cc.mps()) || (_cap.mpsmax() < cc.mps()))
+    L4Re::chksys(-L4_ENOSYS, "Controller does not support the architectural page size");
+}
+
+void
+Ctl::wait_ready(bool rdy, std::function<void(bool)> callback)
+{
+  // CAP.TO is the worst case time for CSTS.RDY to change [500 ms]
+  int retries = cxx::max(1U, (unsigned)_cap.to()) * 500 / Rdy_poll_ms;
+  Block_device::Errand::poll(
+    retries, Rdy_poll_ms,
+    [=]() { return Ctl_csts(_regs.r<32>(Regs::Ctl::Csts).read()).rdy() == rdy; },
+    callback);
+}
+
+void
+Ctl::enable(std::function<void(bool)> callback)
+{
   // Start by resetting the controller, mostly to get the admin queue doorbell
   // registers to a known state.
-  Ctl_cc cc(0);
-  if (Ctl_csts(_regs.r<32>(Regs::Ctl::Csts).read()).rdy())
+  if (!Ctl_csts(_regs.r<32>(Regs::Ctl::Csts).read()).rdy())
     {
-      cc.raw = _regs.r<32>(Regs::Ctl::Cc).read();
-      cc.en() = 0;
-      _regs.r<32>(Regs::Ctl::Cc).write(cc.raw);
-      (void) _regs.r<32>(Regs::Ctl::Cc).read(); // flush
+      trace.printf("The controller was not enabled, not disabling.\n");
+      configure_and_enable(callback);
+      return;
+    }
 
-      cc.raw = 0;
+  Ctl_cc cc(_regs.r<32>(Regs::Ctl::Cc).read());
+  cc.en() = 0;
+  _regs.r<32>(Regs::Ctl::Cc).write(cc.raw);
+  (void) _regs.r<32>(Regs::Ctl::Cc).read(); // flush
 
-      trace.printf("Waiting for the controller to become disabled...\n");
-      while (Ctl_csts(_regs.r<32>(Regs::Ctl::Csts).read()).rdy())
-        ;
-      trace.printf("done.\n");
+  trace.printf("Waiting for the controller to become disabled...\n");
+  wait_ready(false, [=](bool disabled) {
+    if (!disabled)
+      {
+        warn.printf("Timeout while waiting for the controller to become "
+                    "disabled\n");
+        callback(false);
+        return;
+      }
+    trace.printf("Controller disabled.\n");
 
-      // A short delay seems to be necessary for some controllers
-      if (_quirks.delay_after_disable())
-        l4_sleep(3);
+    // A short delay seems to be necessary for some controllers
+    if (_quirks.delay_after_disable())
+      Block_device::Errand::schedule([=]() { configure_and_enable(callback); },
+                                     3);
+    else
+      configure_and_enable(callback);
+  });
+}
+
+void
+Ctl::configure_and_enable(std::function<void(bool)> callback)
+{
+  try
+    {
+      if (use_cmb)
+        setup_cmb();
+
+      // Set the admin queues' sizes, CAP.MQES and both fields are 0's based
+      unsigned aq_size = cxx::min<unsigned>(Queue::Aq_size, _cap.mqes() + 1);
+      Ctl_aqa aqa(0);
+      aqa.acqs() = aq_size - 1;
+      aqa.asqs() = aq_size - 1;
+      _regs.r<32>(Regs::Ctl::Aqa).write(aqa.raw);
+
+      // Allocate the admin queues
+      _acq = cxx::make_unique<Queue::Completion_queue>(aqa.acqs() + 1, Aq_id,
+                                                       _cap.dstrd(), _regs,
+                                                       _dma);
+      _asq = cxx::make_unique<Queue::Submission_queue>(aqa.asqs() + 1, Aq_id,
+                                                       _cap.dstrd(), _regs,
+                                                       _dma);
     }
-  else
-    trace.printf("The controller was not enabled, not disabling.\n");
-
-  // Set the admin queues' sizes
-  Ctl_aqa aqa(0);
-  aqa.acqs() = 1; // 2 entries
-  aqa.asqs() = 1; // 2 entries
-  _regs.r<32>(Regs::Ctl::Aqa).write(aqa.raw);
-
-  // Allocate the admin queues
-  _acq = cxx::make_unique<Queue::Completion_queue>(aqa.acqs() + 1, Aq_id,
-                                                   _cap.dstrd(), _regs, _dma);
-  _asq = cxx::make_unique<Queue::Submission_queue>(aqa.asqs() + 1, Aq_id,
-                                                   _cap.dstrd(), _regs, _dma);
+  catch (L4::Runtime_error const &e)
+    {
+      warn.printf("%s: %s\n", e.str(), e.extra_str());
+      callback(false);
+      return;
+    }
+
   // Write the queues' addresses to the controller
   _regs.r<32>(Regs::Ctl::Acq).write(_acq->phys_base() & 0xffffffffUL);
   _regs.r<32>(Regs::Ctl::Acq + 4).write((l4_uint64_t)_acq->phys_base() >> 32U);
   _regs.r<32>(Regs::Ctl::Asq).write(_asq->phys_base() & 0xffffffffUL);
   _regs.r<32>(Regs::Ctl::Asq + 4).write((l4_uint64_t)_asq->phys_base() >> 32U);
 
+  Ctl_cc cc(0);
+
   // Configure the IO queue entry sizes
   //
   // The specification says these must be set before creating IO queues, so not
@@ -126,30 +202,43 @@ Ctl::Ctl(L4vbus::Pci_dev const &dev, cxx::Ref_ptr<Icu> icu,
   cc.iocqes() = 4; // 16 bytes
   cc.iosqes() = 6; // 64 bytes
 
-  cc.ams() = Regs::Ctl::Cc::Ams_rr;
+  cc.ams() = _wrr ? Regs::Ctl::Cc::Ams_wrr : Regs::Ctl::Cc::Ams_rr;
   cc.mps() = L4_PAGESHIFT - Mps_base;
-  if ((_cap.mpsmin() > cc.mps()) || (_cap.mpsmax() < cc.mps()))
-    L4Re::chksys(-L4_ENOSYS, "Controller does not support the architectural page size");
-
   cc.css() = Regs::Ctl::Cc::Css_nvm;
   cc.en() = 1;
   _regs.r<32>(Regs::Ctl::Cc).write(cc.raw);
 
   trace.printf("Waiting for the controller to become ready...\n");
-  while (!Ctl_csts(_regs.r<32>(Regs::Ctl::Csts).read()).rdy())
-    ;
-  trace.printf("done.\n");
+  wait_ready(true, [=](bool ready) {
+    if (!ready)
+      {
+        warn.printf("Timeout while waiting for the controller to become "
+                    "ready\n");
+        callback(false);
+        return;
+      }
+    trace.printf("Controller ready.\n");
 
-  // Some controllers need a delay after the controller becomes ready
-  if (_quirks.delay_after_enable())
-    l4_sleep(_quirks.delay_after_enable_ms);
+    // Some controllers need a delay after the controller becomes ready
+    if (_quirks.delay_after_enable())
+      Block_device::Errand::schedule([=]() { enable_done(callback); },
+                                     _quirks.delay_after_enable_ms);
+    else
+      enable_done(callback);
+  });
+}
 
+void
+Ctl::enable_done(std::function<void(bool)> callback)
+{
   l4_uint16_t cmd = cfg_read_16(0x04);
   if (!(cmd & 4))
     {
       trace.printf("Enabling PCI bus master\n");
       cfg_write_16(0x04, cmd | 4);
     }
+
+  callback(true);
 }
 
 void
@@ -159,8 +248,8 @@ Ctl::handle_irq()
     {
       assert(cqe->sqid() == Aq_id);
       _asq->complete(cqe);
-      _acq->complete();
     }
+  _acq->complete();
 
   for (auto &ns: _nss)
     ns->handle_irq();
@@ -262,6 +351,8 @@ Ctl::create_iocq(l4_uint16_t id, l4_size_t size, unsigned iv, Callback cb)
 {
   auto cq = cxx::make_unique<Queue::Completion_queue>(size, id, _cap.dstrd(),
                                                       _regs, _dma);
+  if (_dbbuf)
+    cq->set_shadow_doorbell(*_dbbuf, *_eibuf, cq->hdbl() - Regs::Ctl::Sq0tdbl);
 
   auto *sqe = _asq->produce(std::move(cb));
   sqe->opc() = Acs::Create_iocq;
@@ -279,14 +370,26 @@ Ctl::create_iocq(l4_uint16_t id, l4_size_t size, unsigned iv, Callback cb)
   return cq;
 }
 
-unsigned Ctl::allocate_msi(Nvme::Namespace *ns)
+unsigned
+Ctl::max_vectors() const
+{
+  if (use_msixs && _pci_dev->msixs_supported())
+    return _pci_dev->msixs_supported();
+  if (use_msis && _pci_dev->msis_supported())
+    return _pci_dev->msis_supported();
+  return 1;
+}
+
+unsigned Ctl::allocate_msi(L4::Epiface *obj)
 {
   // Default case for when MSI/X are not supported or none can be allocated.
-  // In this case the namespace will use vector 0 and the same handler as
+  // In this case the queue pair will use vector 0 and the same handler as
   // the controller uses for handling the admin queues.
   unsigned iv = 0;
 
-  if (msis_enabled())
+  // Each I/O queue pair consumes one controller-local vector, make sure we do
+  // not run past what the device supports.
+  if (msis_enabled() && _pci_dev->vectors_used() < max_vectors())
     {
       long msi = _icu->alloc_msi();
       if (msi >= 0)
@@ -294,7 +397,7 @@ unsigned Ctl::allocate_msi(Nvme::Namespace *ns)
           iv = msi;
           msi |= L4::Icu::F_msi;
 
-          auto cap = L4Re::chkcap(_registry->register_irq_obj(ns),
+          auto cap = L4Re::chkcap(_registry->register_irq_obj(obj),
                                   "Registering IRQ server object.");
 
           L4Re::chksys(l4_error(_icu->icu()->bind(msi, cap)),
@@ -319,23 +422,30 @@ unsigned Ctl::allocate_msi(Nvme::Namespace *ns)
   return iv;
 }
 
-void Ctl::free_msi(unsigned iv, Nvme::Namespace *ns)
+void Ctl::free_msi(unsigned iv, L4::Epiface *obj)
 {
   if (iv == 0)
     return;
 
   // We need to delete the IRQ object created in register_irq_obj() ourselves
   L4::Cap<L4::Task>(L4Re::This_task)
-    ->unmap(ns->obj_cap().fpage(), L4_FP_ALL_SPACES | L4_FP_DELETE_OBJ);
-  _registry->unregister_obj(ns);
+    ->unmap(obj->obj_cap().fpage(), L4_FP_ALL_SPACES | L4_FP_DELETE_OBJ);
+  _registry->unregister_obj(obj);
   _icu->free_msi(iv);
 }
 
 cxx::unique_ptr<Queue::Submission_queue>
-Ctl::create_iosq(l4_uint16_t id, l4_size_t size, l4_size_t sgls, Callback cb)
+Ctl::create_iosq(l4_uint16_t id, l4_size_t size, l4_size_t sgls,
+                 l4_size_t dsm_ranges, Qprio prio, Callback cb)
 {
   auto sq = cxx::make_unique<Queue::Submission_queue>(size, id, _cap.dstrd(),
-                                                      _regs, _dma, sgls);
+                                                      _regs, _dma, sgls,
+                                                      dsm_ranges, _cmb.get());
+  if (_cmb)
+    trace.printf("I/O submission queue %u in %s memory\n", id,
+                 sq->in_cmb() ? "controller" : "host");
+  if (_dbbuf)
+    sq->set_shadow_doorbell(*_dbbuf, *_eibuf, sq->tdbl() - Regs::Ctl::Sq0tdbl);
 
   auto *sqe = _asq->produce(std::move(cb));
   sqe->opc() = Acs::Create_iosq;
@@ -346,6 +456,7 @@ Ctl::create_iosq(l4_uint16_t id, l4_size_t size, l4_size_t sgls, Callback cb)
   sqe->qid() = id;
   sqe->qsize() = sq->size() - 1;
   sqe->pc() = 1;
+  sqe->qprio() = prio;
   sqe->cqid() = id;
   sqe->cdw12 = 0;
   _asq->submit();
@@ -354,23 +465,59 @@ Ctl::create_iosq(l4_uint16_t id, l4_size_t size, l4_size_t sgls, Callback cb)
 }
 
 void
-Ctl::identify_namespace(l4_uint32_t nn, l4_uint32_t n,
+Ctl::delete_iocq(l4_uint16_t id, Callback cb)
+{
+  auto *sqe = _asq->produce(std::move(cb));
+  sqe->opc() = Acs::Delete_iocq;
+  sqe->nsid = 0;
+  sqe->psdt() = Psdt::Use_prps;
+  sqe->prp.prp1 = 0;
+  sqe->prp.prp2 = 0;
+  sqe->qid() = id;
+  _asq->submit();
+}
+
+void
+Ctl::identify_next_namespace(
+  std::function<void(cxx::unique_ptr<Namespace>)> callback)
+{
+  if (_next_nsid < _nsids.size())
+    {
+      ++_nss_busy;
+      identify_namespace(_nsids[_next_nsid++], callback);
+    }
+  else if (!_nss_busy && _identify_done)
+    {
+      std::function<void()> done;
+      done.swap(_identify_done);
+      done();
+    }
+}
+
+void
+Ctl::namespace_done(std::function<void(cxx::unique_ptr<Namespace>)> callback)
+{
+  --_nss_busy;
+  identify_next_namespace(callback);
+}
+
+void
+Ctl::identify_namespace(l4_uint32_t n,
                         std::function<void(cxx::unique_ptr<Namespace>)> callback)
 {
   auto in =
     cxx::make_ref_obj<Inout_buffer>(4096, _dma,
                                     L4Re::Dma_space::Direction::From_device);
 
-  // Note that the admin queues have the smallest possible size, so that at any
-  // one time, there can be at most one admin queue command in progress. This
-  // prevents us from using a for-loop for identifying possibly many
-  // namespaces.  We workaround that by implementing the for-loop within the
-  // nesting structure of the callbacks.
-
+  // Each namespace has at most one admin command in flight while it is being
+  // identified and its I/O queues are created. Once it is done or skipped,
+  // the next namespace takes its place.
   auto cb = [=](l4_uint16_t status) {
     if (status)
       {
         printf("Namespace Identify command failed with status %u\n", status);
+        in->unmap();
+        namespace_done(callback);
         return;
       }
 
@@ -400,7 +547,7 @@ Ctl::identify_namespace(l4_uint32_t nn, l4_uint32_t n,
                 skipped = false;
                 auto ns =
                   cxx::make_unique<Nvme::Namespace>(*this, n, lba_sz, in);
-                ns.release()->async_loop_init(nn, callback);
+                ns.release()->async_loop_init(callback);
               }
             else
               trace.printf("LBAF uses metadata, skipping namespace %u\n", n);
@@ -413,8 +560,8 @@ Ctl::identify_namespace(l4_uint32_t nn, l4_uint32_t n,
 
     in->unmap();
 
-    if (skipped && n + 1 < nn)
-      identify_namespace(nn, n + 1, callback);
+    if (skipped)
+      namespace_done(callback);
   };
 
   auto *sqe = _asq->produce(cb);
@@ -430,8 +577,11 @@ Ctl::identify_namespace(l4_uint32_t nn, l4_uint32_t n,
 }
 
 void
-Ctl::identify(std::function<void(cxx::unique_ptr<Namespace>)> callback)
+Ctl::identify(std::function<void(cxx::unique_ptr<Namespace>)> callback,
+              std::function<void()> done)
 {
+  _identify_done = done;
+
   auto ic =
     cxx::make_ref_obj<Inout_buffer>(4096, _dma,
                                     L4Re::Dma_space::Direction::From_device);
@@ -440,6 +590,7 @@ Ctl::identify(std::function<void(cxx::unique_ptr<Namespace>)> callback)
     if (status)
       {
         trace.printf("Identify_controller command failed with status=%u\n", status);
+        _identify_done();
         return;
       }
 
@@ -452,6 +603,7 @@ Ctl::identify(std::function<void(cxx::unique_ptr<Namespace>)> callback)
     printf("Model Number: %.40s\n", ic->get<char>(Cns_ic::Mn));
     printf("Firmware Revision: %.8s\n", ic->get<char>(Cns_ic::Fr));
 
+    _rab = *ic->get<l4_uint8_t>(Cns_ic::Rab) & 0x7;
     _mdts = *ic->get<l4_uint8_t>(Cns_ic::Mdts);
     printf("Maximum Transfer Data Size: %u\n", _mdts);
     printf("Controller ID: %x\n", *ic->get<l4_uint16_t>(Cns_ic::Cntlid));
@@ -459,17 +611,97 @@ Ctl::identify(std::function<void(cxx::unique_ptr<Namespace>)> callback)
     _sgls = (*ic->get<l4_uint32_t>(Cns_ic::Sgls) & 0x3) != 0;
     printf("SGL Support: %s\n", _sgls ? "yes" : "no");
 
+    _oacs = *ic->get<l4_uint16_t>(Cns_ic::Oacs);
+    _oncs = *ic->get<l4_uint16_t>(Cns_ic::Oncs);
+    printf("Dataset Management: %s\n", supports_dsm() ? "yes" : "no");
+
+    _vwc = *ic->get<l4_uint8_t>(Cns_ic::Vwc) & 1;
+    printf("Volatile Write Cache: %s\n", _vwc ? "present" : "not present");
+
     l4_uint32_t nn = *ic->get<l4_uint32_t>(Cns_ic::Nn);
 
     printf("Number of Namespaces: %d\n", nn);
+    printf("I/O queue size: %u (MQES=%u)\n", ioq_size(),
+           (unsigned)_cap.mqes());
 
     ic->unmap();
 
-    // Identify all namespaces
-    //
-    // Note this is done as an asynchronous for-loop because we keep the
-    // size of the admin queue as small as possible.
-    identify_namespace(nn, 1, callback);
+    // The number of I/O queues must be negotiated before any I/O queue is
+    // created.
+    set_num_queues(nn, [=](l4_uint16_t status) {
+      if (status)
+        {
+          trace.printf("Set Features (Number of Queues) failed with "
+                       "status=%u\n", status);
+          // Assume the controller supports one I/O queue pair per namespace,
+          // like the driver used to.
+          _nioqs = nn < 0xffffu ? nn : 0xffffu;
+        }
+
+      set_irq_coalescing([=](l4_uint16_t status) {
+        if (status)
+          trace.printf("Set Features (Interrupt Coalescing) failed with "
+                       "status=%u\n", status);
+
+        set_write_cache([=](l4_uint16_t status) {
+          if (status)
+            trace.printf("Set Features (Volatile Write Cache) failed with "
+                         "status=%u\n", status);
+
+          identify_iocs([=](l4_uint16_t status) {
+            if (status)
+              trace.printf("Identify I/O Command Set specific controller "
+                           "failed with status=%u\n", status);
+
+            set_arbitration([=](l4_uint16_t status) {
+              if (status)
+                trace.printf("Set Features (Arbitration) failed with "
+                             "status=%u\n", status);
+
+              // The shadow doorbell buffer must be known before the I/O
+              // queues are created.
+              set_doorbell_buffer([=](l4_uint16_t status) {
+                if (status)
+                  trace.printf("Doorbell Buffer Config failed with "
+                               "status=%u\n", status);
+
+                identify_active_nsids(nn, 0, [=](l4_uint16_t status) {
+                  if (status)
+                    {
+                      // Controllers prior to NVMe 1.1 do not know the list,
+                      // try the namespace identifiers up to NN. NN is
+                      // untrusted and may be as large as 2^32 - 1.
+                      trace.printf("Identify Active Namespace ID list failed "
+                                   "with status=%u\n", status);
+                      l4_uint32_t probe =
+                        cxx::min<l4_uint32_t>(nn, Max_probed_nsids);
+                      if (probe < nn)
+                        warn.printf("Trying only the first %u of %u "
+                                    "namespaces.\n", probe, nn);
+                      _nsids.clear();
+                      for (l4_uint32_t n = 1; n <= probe; ++n)
+                        _nsids.push_back(n);
+                    }
+
+                  printf("Active namespaces: %zu\n", _nsids.size());
+
+                  // Identify the namespaces and create their I/O queues in
+                  // parallel, as many as fit into the admin queue.
+                  unsigned parallel =
+                    cxx::min<l4_size_t>(_nsids.size(), _asq->size() - 1);
+                  for (unsigned i = 0; i < parallel; ++i)
+                    identify_next_namespace(callback);
+
+                  // Without any active namespace, report completion at once.
+                  if (!parallel)
+                    identify_next_namespace(callback);
+                });
+              });
+            });
+          });
+        });
+      });
+    });
   };
 
   auto *sqe = _asq->produce(cb);
@@ -483,6 +715,262 @@ Ctl::identify(std::function<void(cxx::unique_ptr<Namespace>)> callback)
   _asq->submit();
 }
 
+void
+Ctl::set_num_queues(l4_uint32_t nn, Callback cb)
+{
+  // Ask for enough I/O queue pairs to give each namespace the configured
+  // number of them, plus one for each priority class other than the default
+  // one with weighted round robin arbitration. The controller may grant fewer.
+  unsigned per_ns = cxx::max(1U, ioqs) + (_wrr ? Num_qprios - 1 : 0);
+  l4_uint64_t req = cxx::max(1ULL, (l4_uint64_t)nn * per_ns);
+  if (req > 0xffffu)
+    req = 0xffffu;
+
+  auto *sqe = _asq->produce([this, cb](l4_uint16_t status) {
+    if (!status)
+      {
+        // Both values are 0's based
+        l4_uint32_t dw0 = _asq->cmd_specific();
+        l4_uint32_t nsqa = (dw0 & 0xffffu) + 1;
+        l4_uint32_t ncqa = (dw0 >> 16) + 1;
+        _nioqs = cxx::min(cxx::min(nsqa, ncqa), 0xffffU);
+        printf("Number of I/O queues: %u SQs, %u CQs\n", nsqa, ncqa);
+      }
+    cb(status);
+  });
+  sqe->opc() = Acs::Set_features;
+  sqe->nsid = 0;
+  sqe->psdt() = Psdt::Use_prps;
+  sqe->fid() = Fid::Number_of_queues;
+  sqe->nsqr() = req - 1;
+  sqe->ncqr() = req - 1;
+  _asq->submit();
+}
+
+void
+Ctl::set_arbitration(Callback cb)
+{
+  if (!_wrr)
+    {
+      cb(0);
+      return;
+    }
+
+  // The urgent priority class is always served first, the weights of the
+  // other classes determine how many arbitration bursts each of them gets per
+  // round. Weights are 0's based.
+  printf("Weighted round robin arbitration: weights %u/%u/%u, burst %u\n",
+         wrr_weights[0], wrr_weights[1], wrr_weights[2], 1U << _rab);
+
+  auto *sqe = _asq->produce(std::move(cb));
+  sqe->opc() = Acs::Set_features;
+  sqe->nsid = 0;
+  sqe->psdt() = Psdt::Use_prps;
+  sqe->fid() = Fid::Arbitration;
+  sqe->ab() = _rab;
+  sqe->hpw() = wrr_weights[0] - 1;
+  sqe->mpw() = wrr_weights[1] - 1;
+  sqe->lpw() = wrr_weights[2] - 1;
+  _asq->submit();
+}
+
+void
+Ctl::set_irq_coalescing(Callback cb)
+{
+  if (!irq_coalescing())
+    {
+      cb(0);
+      return;
+    }
+
+  // The aggregation threshold is 0's based
+  unsigned thr = cxx::min(cxx::max(irq_coalesce_thr, 1U), 256U) - 1;
+  unsigned time = cxx::min(irq_coalesce_time, 255U);
+
+  printf("Interrupt coalescing: threshold %u, time %u us\n", thr + 1,
+         time * 100);
+
+  auto *sqe = _asq->produce(std::move(cb));
+  sqe->opc() = Acs::Set_features;
+  sqe->nsid = 0;
+  sqe->psdt() = Psdt::Use_prps;
+  sqe->fid() = Fid::Interrupt_coalescing;
+  sqe->thr() = thr;
+  sqe->time() = time;
+  _asq->submit();
+}
+
+void
+Ctl::set_write_cache(Callback cb)
+{
+  if (!_vwc)
+    {
+      cb(0);
+      return;
+    }
+
+  // The state of the cache after a reset is implementation specific, so set
+  // it explicitly either way. Flush commands are issued whenever a cache is
+  // present, so data is safe even if this command fails.
+  printf("%s volatile write cache\n", use_wcache ? "Enabling" : "Disabling");
+
+  auto *sqe = _asq->produce(std::move(cb));
+  sqe->opc() = Acs::Set_features;
+  sqe->nsid = 0;
+  sqe->psdt() = Psdt::Use_prps;
+  sqe->fid() = Fid::Volatile_write_cache;
+  sqe->wce() = use_wcache;
+  _asq->submit();
+}
+
+void
+Ctl::set_doorbell_buffer(Callback cb)
+{
+  if (!use_dbbuf || !(_oacs & Oacs_dbbuf))
+    {
+      cb(0);
+      return;
+    }
+
+  // Emulated controllers announce this command: instead of trapping on each
+  // doorbell register write, they read the doorbell values from host memory
+  // and only ask for register writes via EventIdx when they stopped polling.
+  // Both buffers hold an entry for each queue at the offset of its doorbell
+  // register. The admin queues keep using the doorbell registers.
+  l4_size_t sz = (_nioqs + 1) * 2 * (4 << _cap.dstrd());
+  // The command takes a single PRP entry per buffer, so each buffer must fit
+  // into one memory page. Otherwise keep using the doorbell registers.
+  if (sz > L4_PAGESIZE)
+    {
+      trace.printf("Doorbell buffers of %zu bytes exceed a page, "
+                   "not using shadow doorbells\n", sz);
+      cb(0);
+      return;
+    }
+  sz = L4_PAGESIZE;
+  auto db =
+    cxx::make_ref_obj<Inout_buffer>(sz, _dma,
+                                    L4Re::Dma_space::Direction::To_device,
+                                    L4Re::Rm::F::Cache_uncached);
+  auto ei =
+    cxx::make_ref_obj<Inout_buffer>(sz, _dma,
+                                    L4Re::Dma_space::Direction::From_device,
+                                    L4Re::Rm::F::Cache_uncached);
+  memset(db->get<void>(), 0, sz);
+  memset(ei->get<void>(), 0, sz);
+
+  auto *sqe = _asq->produce([=](l4_uint16_t status) {
+    if (!status)
+      {
+        _dbbuf = db;
+        _eibuf = ei;
+        printf("Using shadow doorbells\n");
+      }
+    cb(status);
+  });
+  sqe->opc() = Acs::Doorbell_buffer_config;
+  sqe->nsid = 0;
+  sqe->psdt() = Psdt::Use_prps;
+  sqe->prp.prp1 = db->pget();
+  sqe->prp.prp2 = ei->pget();
+  _asq->submit();
+}
+
+void
+Ctl::identify_active_nsids(l4_uint32_t nn, l4_uint32_t start, Callback cb)
+{
+  enum { Nsids_per_list = 4096 / sizeof(l4_uint32_t) };
+
+  auto list =
+    cxx::make_ref_obj<Inout_buffer>(4096, _dma,
+                                    L4Re::Dma_space::Direction::From_device);
+
+  auto *sqe = _asq->produce([=](l4_uint16_t status) {
+    if (status)
+      {
+        list->unmap();
+        cb(status);
+        return;
+      }
+
+    // The list holds the active NSIDs greater than `start` in increasing
+    // order and ends with the first zero entry unless it is full.
+    l4_uint32_t const *nsids = list->get<l4_uint32_t>();
+    unsigned i;
+    for (i = 0; i < Nsids_per_list && nsids[i]; ++i)
+      _nsids.push_back(nsids[i]);
+    l4_uint32_t last = i ? nsids[i - 1] : 0;
+    list->unmap();
+
+    if (i == Nsids_per_list && last < nn)
+      identify_active_nsids(nn, last, cb);
+    else
+      cb(0);
+  });
+  sqe->opc() = Acs::Identify;
+  sqe->nsid = start;
+  sqe->psdt() = Psdt::Use_prps;
+  sqe->prp.prp1 = list->pget();
+  sqe->prp.prp2 = 0;
+  sqe->cntid() = 0;
+  sqe->cns() = Cns::Active_nsid_list;
+  _asq->submit();
+}
+
+void
+Ctl::identify_iocs(Callback cb)
+{
+  // The NVM Command Set specific Identify Controller data structure holds the
+  // Write Zeroes and Dataset Management limits. Controllers that predate it
+  // fail the command, in which case the limits of the commands apply.
+  auto ic =
+    cxx::make_ref_obj<Inout_buffer>(4096, _dma,
+                                    L4Re::Dma_space::Direction::From_device);
+
+  auto *sqe = _asq->produce([=](l4_uint16_t status) {
+    if (!status)
+      {
+        _wzsl = *ic->get<l4_uint8_t>(Cns_iocs_ic::Wzsl);
+        _dmrl = *ic->get<l4_uint8_t>(Cns_iocs_ic::Dmrl);
+        _dmrsl = *ic->get<l4_uint32_t>(Cns_iocs_ic::Dmrsl);
+        _dmsl = *ic->get<l4_uint64_t>(Cns_iocs_ic::Dmsl);
+        trace.printf("WZSL=%u, DMRL=%u, DMRSL=%u, DMSL=%llu\n",
+                     (unsigned)_wzsl, (unsigned)_dmrl, _dmrsl, _dmsl);
+      }
+    ic->unmap();
+    cb(status);
+  });
+  sqe->opc() = Acs::Identify;
+  sqe->psdt() = Psdt::Use_prps;
+  sqe->prp.prp1 = ic->pget();
+  sqe->prp.prp2 = 0;
+  sqe->cntid() = 0;
+  sqe->cns() = Cns::Identify_iocs_controller;
+  sqe->csi() = 0; // NVM Command Set
+  _asq->submit();
+}
+
+void
+Ctl::configure_irq_vector(unsigned iv, Callback cb)
+{
+  // Interrupt coalescing does not apply to the admin completion queue and the
+  // vector it uses. Queue pairs without their own vector share that vector.
+  if (!irq_coalescing() || !iv)
+    {
+      cb(0);
+      return;
+    }
+
+  auto *sqe = _asq->produce(std::move(cb));
+  sqe->opc() = Acs::Set_features;
+  sqe->nsid = 0;
+  sqe->psdt() = Psdt::Use_prps;
+  sqe->fid() = Fid::Interrupt_vector_configuration;
+  sqe->ivc_iv() = _pci_dev->get_local_vector(iv);
+  sqe->cd() = 0;
+  _asq->submit();
+}
+
 bool
 Ctl::is_nvme_ctl(L4vbus::Device const &dev, l4vbus_device_t const &dev_info)
 {
@@ -506,6 +994,58 @@ Ctl::is_nvme_ctl(L4vbus::Device const &dev, l4vbus_device_t const &dev_info)
   return (class_code == 0x10802);
 }
 
+void
+Ctl::setup_cmb()
+{
+  // Since NVMe 1.4, CMBLOC and CMBSZ are only valid once enabled in CMBMSC.
+  if (_cap.cmbs())
+    _regs.r<32>(Regs::Ctl::Cmbmsc).write(Regs::Ctl::Cmbmsc_cre);
+
+  Ctl_cmbsz sz(_regs.r<32>(Regs::Ctl::Cmbsz).read());
+  if (!sz.sz() || !sz.sqs())
+    {
+      trace.printf("No Controller Memory Buffer for submission queues.\n");
+      return;
+    }
+
+  Ctl_cmbloc loc(_regs.r<32>(Regs::Ctl::Cmbloc).read());
+  l4_uint64_t bar = cfg_read_bar(loc.bir());
+  if (!bar)
+    {
+      warn.printf("Controller Memory Buffer BAR%u not assigned.\n",
+                  (unsigned)loc.bir());
+      return;
+    }
+
+  l4_uint64_t addr = bar + loc.ofst() * sz.unit();
+  // The submission queues take only a small part of large buffers.
+  l4_uint64_t size = cxx::min<l4_uint64_t>(sz.sz() * sz.unit(), 4 << 20);
+
+  // Make the controller accept the bus addresses of the buffer in queue
+  // creation commands. CBA is the address of the buffer itself, which the
+  // size unit keeps 4 KiB aligned. The low dword enables the memory space,
+  // so write it last, once the whole address is in place.
+  if (_cap.cmbs())
+    {
+      l4_uint64_t msc = addr | Regs::Ctl::Cmbmsc_cre | Regs::Ctl::Cmbmsc_cmse;
+      _regs.r<32>(Regs::Ctl::Cmbmsc + 4).write(msc >> 32);
+      _regs.r<32>(Regs::Ctl::Cmbmsc).write(msc & 0xffffffffU);
+    }
+
+  try
+    {
+      _cmb = cxx::make_unique<Cmb>(
+        addr, size, L4::cap_reinterpret_cast<L4Re::Dataspace>(_dev.bus_cap()));
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      warn.printf("Cannot map Controller Memory Buffer: %s\n", e.str());
+      return;
+    }
+
+  printf("Controller Memory Buffer: %llu KiB at 0x%llx\n", size >> 10, addr);
+}
+
 void
 Ctl::enable_quirks()
 {
@@ -14,6 +14,7 @@
 #include <l4/vbus/vbus>
 #include <l4/vbus/vbus_pci>
 #include <l4/cxx/bitfield>
+#include <l4/cxx/minmax>
 #include <l4/drivers/hw_mmio_register_block>
 
 #include <list>
@@ -27,6 +28,7 @@
 #include "ns.h"
 #include "inout_buffer.h"
 #include "iomem.h"
+#include "cmb.h"
 
 #include "pci.h"
 #include "icu.h"
@@ -45,6 +47,8 @@ class Ctl : public L4::Irqep_t<Ctl>
 public:
   /**
    * Create a new NVMe controller from a vbus PCI device.
+   *
+   * The controller is not enabled yet, see enable().
    */
   Ctl(L4vbus::Pci_dev const &dev, cxx::Ref_ptr<Icu> icu,
       L4Re::Util::Object_registry *registry,
@@ -66,13 +70,28 @@ public:
   void register_interrupt_handler();
 
 
+  /**
+   * Reset the controller, set up the admin queues and enable it.
+   *
+   * The controller is polled from the server loop while its ready state
+   * changes, so that several controllers can be brought up at the same time.
+   *
+   * \param callback  Function called with true once the controller is ready or
+   *                  with false if it failed to become ready within the time
+   *                  reported by CAP.TO.
+   */
+  void enable(std::function<void(bool)> callback);
+
   /**
    * Identify the controller and the namespaces and initialize the ones that are
    * found.
    *
    * \param callback Function called for each active namespace.
+   * \param done     Function called once all namespaces have been taken care
+   *                 of, after the last call of `callback`.
    */
-  void identify(std::function<void(cxx::unique_ptr<Namespace>)> callback);
+  void identify(std::function<void(cxx::unique_ptr<Namespace>)> callback,
+                std::function<void()> done);
 
   /**
    * Test if a VBUS device is a NVMe controller.
@@ -112,8 +131,42 @@ public:
     return true;
   }
 
-  unsigned allocate_msi(Nvme::Namespace *ns);
-  void free_msi(unsigned iv, Nvme::Namespace *ns);
+  /**
+   * Allocate an MSI/MSI-X vector and bind it to the given IRQ handler.
+   *
+   * \return Controller-local interrupt vector or 0 in case no separate vector
+   *         could be allocated. Vector 0 is served by the controller's own
+   *         interrupt handler.
+   */
+  unsigned allocate_msi(L4::Epiface *obj);
+  void free_msi(unsigned iv, L4::Epiface *obj);
+
+  /**
+   * Allocate an I/O queue identifier.
+   *
+   * \return The allocated queue identifier or 0 if all I/O queues granted by
+   *         the controller are in use.
+   */
+  l4_uint16_t alloc_qid()
+  {
+    if (!_free_qids.empty())
+      {
+        l4_uint16_t qid = _free_qids.back();
+        _free_qids.pop_back();
+        return qid;
+      }
+    if (_next_qid > _nioqs)
+      return 0;
+    return _next_qid++;
+  }
+
+  /**
+   * Return an I/O queue identifier for reuse.
+   *
+   * The controller must not have queues with this identifier anymore.
+   */
+  void free_qid(l4_uint16_t qid)
+  { _free_qids.push_back(qid); }
 
   Ctl_cap const &cap() const
   { return _cap; }
@@ -124,13 +177,114 @@ public:
   l4_uint8_t mdts() const
   { return _mdts; }
 
+  /// Whether the controller supports the Dataset Management command
+  bool supports_dsm() const
+  { return _oncs & Oncs_dsm; }
+
+  /**
+   * Maximum number of ranges in a Dataset Management command, as advertised
+   * to clients and allocated per range buffer
+   */
+  l4_size_t dsm_ranges() const
+  {
+    // DMRL of 0 means no limit beyond the one of the command
+    l4_uint64_t n = cxx::min<l4_uint64_t>(_dmrl ? _dmrl : 256,
+                                          Queue::Dsm_ranges);
+    // Each range covers at least one logical block of the overall limit.
+    if (_dmsl)
+      n = cxx::max(1ULL, cxx::min<l4_uint64_t>(n, _dmsl));
+    return n;
+  }
+
+  /// Maximum number of logical blocks in a single Dataset Management range
+  l4_uint32_t dsm_range_lbs() const
+  { return _dmrsl ? _dmrsl : 0xffffffffU; }
+
+  /// Maximum number of logical blocks in all ranges, 0 if not limited
+  l4_uint64_t dsm_lbs() const
+  { return _dmsl; }
+
+  /**
+   * Write Zeroes Size Limit as a power of two in units of the minimum memory
+   * page size, 0 if not limited.
+   */
+  l4_uint8_t wzsl() const
+  { return _wzsl; }
+
+  /// Whether the controller has a volatile write cache
+  bool vwc() const
+  { return _vwc; }
+
+  /**
+   * Whether weighted round robin arbitration is used.
+   *
+   * If so, the I/O submission queues of different priority classes are served
+   * according to the configured weights, otherwise their priority is ignored.
+   */
+  bool wrr() const
+  { return _wrr; }
+
+  /**
+   * Number of entries of each I/O queue.
+   *
+   * This is the configured queue size (`Ctl::ioq_size`) or the default,
+   * limited by the Maximum Queue Entries Supported by the controller.
+   */
+  l4_uint16_t ioq_size() const
+  {
+    // CAP.MQES is 0's based
+    unsigned max = cxx::min<unsigned>(_cap.mqes() + 1, Queue::Ioq_size_max);
+    unsigned size =
+      ioq_size_cfg ? ioq_size_cfg : (unsigned)Queue::Ioq_size_default;
+    return cxx::max(2U, cxx::min(size, max));
+  }
+
+  /// Whether interrupt coalescing has been configured
+  static bool irq_coalescing()
+  { return irq_coalesce_thr > 1 || irq_coalesce_time > 0; }
+
+  /**
+   * Enable interrupt coalescing for an interrupt vector.
+   *
+   * Must be called after the completion queue using the vector has been
+   * created.
+   *
+   * \param iv  Interrupt vector as returned by allocate_msi().
+   * \param cb  Callback invoked with the status of the Set Features command.
+   */
+  void configure_irq_vector(unsigned iv, Callback cb);
+
   cxx::unique_ptr<Queue::Completion_queue>
   create_iocq(l4_uint16_t id, l4_size_t size, unsigned iv, Callback cb);
   cxx::unique_ptr<Queue::Submission_queue>
-  create_iosq(l4_uint16_t id, l4_size_t size, l4_size_t sgls, Callback cb);
-  void
-  identify_namespace(l4_uint32_t n, l4_uint32_t nn,
-                     std::function<void(cxx::unique_ptr<Namespace>)> callback);
+  create_iosq(l4_uint16_t id, l4_size_t size, l4_size_t sgls,
+              l4_size_t dsm_ranges, Qprio prio, Callback cb);
+  /**
+   * Delete an I/O completion queue.
+   *
+   * The memory of the queue may only be freed once the command succeeded.
+   */
+  void delete_iocq(l4_uint16_t id, Callback cb);
+
+  /**
+   * Identify and initialize the next active namespace that has not been
+   * taken care of yet, if any.
+   *
+   * Called once the initialization of a namespace is complete, so that the
+   * number of namespaces being initialized at once stays constant.
+   *
+   * \param callback  Function called for each usable namespace.
+   */
+  void identify_next_namespace(
+    std::function<void(cxx::unique_ptr<Namespace>)> callback);
+
+  /**
+   * Mark the initialization of a namespace as complete, successful or not, and
+   * continue with the next one.
+   *
+   * \param callback  Function called for each usable namespace.
+   */
+  void namespace_done(std::function<void(cxx::unique_ptr<Namespace>)> callback);
 
 private:
   l4_uint32_t cfg_read(l4_uint32_t reg) const
@@ -148,13 +302,32 @@ private:
     _pci_dev->cfg_write_16(reg, val);
   }
 
-  l4_uint64_t cfg_read_bar() const
+  l4_uint64_t cfg_read_bar(unsigned bir = 0) const
   {
-    return (((l4_uint64_t)cfg_read(0x14) << 32) | cfg_read(0x10))
-           & 0xFFFFFFFFFFFFF000UL;
+    l4_uint32_t lo = cfg_read(0x10 + 4 * bir);
+    l4_uint64_t bar = lo;
+    // 64-bit memory BAR
+    if (((lo >> 1) & 0x3) == 2)
+      bar |= (l4_uint64_t)cfg_read(0x14 + 4 * bir) << 32;
+    return bar & 0xFFFFFFFFFFFFF000UL;
   }
 
   void enable_quirks();
+  void wait_ready(bool rdy, std::function<void(bool)> callback);
+  void configure_and_enable(std::function<void(bool)> callback);
+  void enable_done(std::function<void(bool)> callback);
+  void setup_cmb();
+  void set_num_queues(l4_uint32_t nn, Callback cb);
+  void set_arbitration(Callback cb);
+  void set_irq_coalescing(Callback cb);
+  void set_write_cache(Callback cb);
+  void set_doorbell_buffer(Callback cb);
+  void identify_iocs(Callback cb);
+  void identify_active_nsids(l4_uint32_t nn, l4_uint32_t start, Callback cb);
+  void
+  identify_namespace(l4_uint32_t n,
+                     std::function<void(cxx::unique_ptr<Namespace>)> callback);
+  unsigned max_vectors() const;
 
   L4vbus::Pci_dev _dev;
   cxx::unique_ptr<Pci_dev> _pci_dev;
@@ -163,17 +336,60 @@ private:
   L4Re::Util::Shared_cap<L4Re::Dma_space> _dma;
   Iomem _iomem;
   L4drivers::Register_block<32> _regs;
+  /// Controller Memory Buffer, if used for I/O submission queues
+  cxx::unique_ptr<Cmb> _cmb;
   unsigned char _irq_trigger_type;
   std::list<cxx::unique_ptr<Namespace>> _nss;
 
   Ctl_cap _cap;
 
   bool _sgls;
+  /// Weighted round robin arbitration enabled
+  bool _wrr;
 
   /// Serial number
   std::string _sn;
 
   l4_uint8_t _mdts;
+  /// Recommended Arbitration Burst
+  l4_uint8_t _rab;
+
+  /// Volatile write cache present
+  bool _vwc;
+
+  /// Optional Admin Command Support
+  l4_uint16_t _oacs;
+  /// Optional NVM Command Support
+  l4_uint16_t _oncs;
+  /// Write Zeroes Size Limit
+  l4_uint8_t _wzsl;
+  /// Dataset Management Ranges Limit
+  l4_uint8_t _dmrl;
+  /// Dataset Management Range Size Limit [logical blocks]
+  l4_uint32_t _dmrsl;
+  /// Dataset Management Size Limit [logical blocks]
+  l4_uint64_t _dmsl;
+
+  /// Number of I/O queue pairs granted by the controller
+  l4_uint16_t _nioqs;
+  /// Next never allocated I/O queue identifier
+  l4_uint16_t _next_qid;
+  /// I/O queue identifiers freed again
+  std::vector<l4_uint16_t> _free_qids;
+
+  /// Active namespace identifiers
+  std::vector<l4_uint32_t> _nsids;
+  /// Index of the next namespace in `_nsids` to identify
+  unsigned _next_nsid;
+  /// Number of namespaces being identified and initialized
+  unsigned _nss_busy;
+  /// Called once all namespaces have been identified
+  std::function<void()> _identify_done;
+
+  /// Shadow doorbell buffer, if used for the I/O queues
+  cxx::Ref_ptr<Inout_buffer> _dbbuf;
+  /// EventIdx buffer belonging to the shadow doorbell buffer
+  cxx::Ref_ptr<Inout_buffer> _eibuf;
 
   // Admin Completion Queue
   cxx::unique_ptr<Queue::Completion_queue> _acq;
@@ -197,10 +413,38 @@ public:
   enum
   {
     Mps_base = 12,  ///< Base page width supported by NVMe
+    Rdy_poll_ms = 1, ///< Interval of polling for CSTS.RDY changes
+    /// Namespace identifiers tried without an Active Namespace ID list
+    Max_probed_nsids = 1024,
   };
 
+  /// Number of I/O queue pairs to create per namespace
+  static unsigned ioqs;
+  /// Configured number of entries per I/O queue, 0 to use the default
+  static unsigned ioq_size_cfg;
+  /**
+   * Number of completions consumed between two CQ head doorbell writes while
+   * draining a completion queue
+   */
+  static unsigned cq_db_interval;
+  /**
+   * Default time to poll for I/O completions after a submission [us], 0 to
+   * disable. Clients can override it per namespace.
+   */
+  static unsigned poll_us;
+  /// Interrupt aggregation threshold [completions], 0 or 1 to disable
+  static unsigned irq_coalesce_thr;
+  /// Interrupt aggregation time [100 us], 0 to disable
+  static unsigned irq_coalesce_time;
+  /// Weights of the high, medium and low priority classes
+  static unsigned wrr_weights[3];
+
   static bool use_sgls;
   static bool use_msis;
   static bool use_msixs;
+  static bool use_wcache;
+  static bool use_cmb;
+  static bool use_dbbuf;
+  static bool use_wrr;
 };
 }
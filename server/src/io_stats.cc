@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <cstdio>
+
+#include "io_stats.h"
+
+namespace Nvme {
+
+l4_uint64_t Cycle_clock::_start_cycles = 0;
+l4_cpu_time_t Cycle_clock::_start_us = 0;
+
+double
+Cycle_clock::us_per_cycle()
+{
+  l4_uint64_t us = l4_kip_clock(l4re_kip()) - _start_us;
+  l4_uint64_t elapsed = now() - _start_cycles;
+  // Without a reference yet, assume the cycle counter to count microseconds
+  // like the fallback does.
+  if (!_start_us || !us || !elapsed)
+    return 1.0;
+  return (double)us / elapsed;
+}
+
+void
+print_stats(char const *name, Io_counters const &c)
+{
+  printf("%s: reads %llu (%llu KiB), writes %llu (%llu KiB), flushes %llu, "
+         "write zeroes %llu, discards %llu, errors %llu, in flight %u "
+         "(max %u)\n", name, c.reads, c.read_bytes >> 10, c.writes,
+         c.write_bytes >> 10, c.flushes, c.write_zeroes, c.discards, c.errors,
+         c.inflight, c.max_inflight);
+
+  auto const &h = c.latency;
+  if (!h.total())
+    return;
+
+  double us = Cycle_clock::us_per_cycle();
+  printf("%s: latency [us] p50 < %.1f, p99 < %.1f, p99.9 < %.1f\n", name,
+         h.quantile(1, 2) * us, h.quantile(99, 100) * us,
+         h.quantile(999, 1000) * us);
+
+  // Only the non-empty buckets, given by their upper bound
+  printf("%s: histogram [us]", name);
+  for (unsigned i = 0; i < Latency_histogram::Buckets; ++i)
+    if (h.counts[i])
+      printf(" <%.1f:%llu", Latency_histogram::bound(i) * us, h.counts[i]);
+  printf("\n");
+}
+
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+#include <l4/sys/kip>
+#include <l4/re/env>
+#include <l4/nvme-driver/stats.h>
+
+namespace Nvme {
+
+/**
+ * Cheap time stamps for latency measurements.
+ *
+ * Reads the CPU's cycle counter where user space can access it and falls back
+ * to the KIP clock elsewhere. Cycles are converted to microseconds only for
+ * reports, using the rate observed against the KIP clock since init().
+ */
+class Cycle_clock
+{
+public:
+  static l4_uint64_t now()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    l4_uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((l4_uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+    l4_uint64_t v;
+    asm volatile ("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return l4_kip_clock(l4re_kip());
+#endif
+  }
+
+  /// Take the reference point of the conversion, unless already done.
+  static void init()
+  {
+    if (_start_us)
+      return;
+    _start_cycles = now();
+    _start_us = l4_kip_clock(l4re_kip());
+  }
+
+  /// Microseconds per cycle, as observed since init()
+  static double us_per_cycle();
+
+private:
+  static l4_uint64_t _start_cycles;
+  static l4_cpu_time_t _start_us;
+};
+
+/**
+ * Print the counters and the latency distribution.
+ *
+ * \param name  Prefix of the lines printed.
+ */
+void print_stats(char const *name, Io_counters const &c);
+
+}
@@ -7,6 +7,7 @@
  * License: see LICENSE.spdx (in this directory or the directories above)
  */
 
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <unistd.h>
@@ -25,6 +26,8 @@
 #include <terminate_handler-l4>
 
 #include "nvme_device.h"
+#include "stats_ds.h"
+#include "trace_ds.h"
 #include "ctl.h"
 #include "icu.h"
 
@@ -33,7 +36,12 @@
 #include <l4/libblock-device/virtio_client.h>
 
 static char const *const usage_str =
-"Usage: %s [-vq] [--client CAP --device UUID [--ds-max NUM] [--readonly]] [--nosgl] [--nomsi] [--nomsix]\n\n"
+"Usage: %s [-vq] [--client CAP --device UUID [--ds-max NUM] [--readonly]\n"
+"          [--prio PRIO] [--iops NUM] [--bps NUM] [--poll NUM]] [--nosgl]\n"
+"          [--nomsi] [--nomsix] [--nowcache] [--cmb] [--nodbbuf] [--wrr]\n"
+"          [--ioqs NUM] [--ioq-size NUM] [--cq-db-interval NUM] [--poll-us NUM]\n"
+"          [--irq-coalesce-thr NUM] [--irq-coalesce-time NUM]\n"
+"          [--wrr-weights HIGH,MEDIUM,LOW] [--stats-interval NUM] [--trace NUM]\n\n"
 "Options:\n"
 " -v                 Verbose mode.\n"
 " -q                 Quiet mode (do not print any warnings).\n"
@@ -41,9 +49,29 @@ static char const *const usage_str =
 " --device UUID      Specify the UUID of the device or partition\n"
 " --ds-max NUM       Specify maximum number of dataspaces the client can register\n"
 " --readonly         Only allow readonly access to the device\n"
+" --prio PRIO        Priority class of the client: urgent, high, medium, low\n"
+" --iops NUM         Limit the client to NUM requests per second\n"
+" --bps NUM          Limit the client to NUM bytes per second (suffixes K, M, G)\n"
+" --poll NUM         Poll for the client's completions for NUM us after\n"
+"                    submission (default: value of --poll-us)\n"
 " --nosgl            Disable support for SGLs\n"
 " --nomsi            Disable support for MSI interrupts\n"
 " --nomsix           Disable support for MSI-X interrupts\n"
+" --nowcache         Disable the volatile write cache of the controller\n"
+" --cmb              Place I/O submission queues in the Controller Memory Buffer\n"
+" --nodbbuf          Do not use shadow doorbell buffers\n"
+" --wrr              Use weighted round robin arbitration\n"
+" --ioqs NUM         Number of I/O queue pairs per namespace (default: 4)\n"
+" --ioq-size NUM     Number of entries per I/O queue (default: 256)\n"
+" --cq-db-interval NUM  Completions consumed per CQ head doorbell write\n"
+"                    while draining (default: 32)\n"
+" --poll-us NUM      Poll for I/O completions for NUM us after submission,\n"
+"                    unless set per client\n"
+" --irq-coalesce-thr NUM   Completions aggregated per interrupt (1-256)\n"
+" --irq-coalesce-time NUM  Maximum interrupt delay in 100 us units (0-255)\n"
+" --wrr-weights HIGH,MEDIUM,LOW  Weights of the priority classes (1-256)\n"
+" --stats-interval NUM  Print I/O statistics every NUM seconds\n"
+" --trace NUM        Record the last NUM command events per I/O queue pair\n"
 " --register-ds CAP  Register a trusted dataspace capability\n";
 
 using Base_device_mgr = Block_device::Device_mgr<
@@ -53,6 +81,92 @@ using Base_device_mgr = Block_device::Device_mgr<
 using Ds_vector = std::vector<L4::Cap<L4Re::Dataspace>>;
 static std::shared_ptr<Ds_vector> trusted_dataspaces;
 
+/**
+ * Parse the name of an I/O queue priority class.
+ *
+ * \return False if the name is unknown, true otherwise.
+ */
+static bool
+parse_prio(char const *name, Nvme::Qprio *prio)
+{
+  static struct
+  {
+    char const *name;
+    Nvme::Qprio prio;
+  } const prios[] = {
+    { "urgent", Nvme::Qprio_urgent },
+    { "high",   Nvme::Qprio_high },
+    { "medium", Nvme::Qprio_medium },
+    { "low",    Nvme::Qprio_low },
+  };
+
+  for (auto const &p : prios)
+    if (strcmp(name, p.name) == 0)
+      {
+        *prio = p.prio;
+        return true;
+      }
+
+  return false;
+}
+
+/**
+ * Parse a rate limit, optionally followed by a binary unit suffix (K, M, G).
+ *
+ * \return False if the value is malformed or exceeds the highest rate the
+ *         token buckets support, true otherwise.
+ */
+static bool
+parse_limit(char const *str, l4_uint64_t *limit)
+{
+  char *endp;
+  errno = 0;
+  unsigned long long v = strtoull(str, &endp, 10);
+  if (endp == str || errno || *str == '-')
+    return false;
+
+  unsigned shift = 0;
+  switch (*endp)
+    {
+    case 'K': shift = 10; ++endp; break;
+    case 'M': shift = 20; ++endp; break;
+    case 'G': shift = 30; ++endp; break;
+    default: break;
+    }
+
+  if (*endp != '\0' || v > (Nvme::Token_bucket::Max_rate >> shift))
+    return false;
+
+  *limit = v << shift;
+  return true;
+}
+
+/**
+ * Create the callback that configures the device of a client once the client
+ * is connected.
+ *
+ * \param prio  Priority class of the client's I/O queues.
+ * \param iops  Request rate limit, 0 for no limit.
+ * \param bps   Bandwidth limit [bytes/s], 0 for no limit.
+ * \param poll  Time to poll for completions after submission [us], -1 to use
+ *              the value of `--poll-us`.
+ */
+static auto
+client_cb(Nvme::Qprio prio, l4_uint64_t iops, l4_uint64_t bps, int poll)
+{
+  return [prio, iops, bps, poll](Nvme::Nvme_base_device *dev) {
+    if (!dev->set_priority(prio) && prio != Nvme::Qprio_medium)
+      Dbg::warn().printf("Priorities are not supported for partitions, "
+                         "using medium priority.\n");
+    if (!dev->set_limits(iops, bps) && (iops || bps))
+      Dbg::warn().printf("Rate limits are not supported for partitions.\n");
+    unsigned poll_us = poll < 0 ? Nvme::Ctl::poll_us : poll;
+    if (!dev->set_poll(poll_us) && poll >= 0)
+      Dbg::warn().printf("Polling times are not supported for partitions, "
+                         "using the time of the namespace.\n");
+  };
+}
+
 class Blk_mgr
 : public Base_device_mgr,
   public L4::Epiface_t<Blk_mgr, L4::Factory>
@@ -89,6 +203,10 @@ public:
     std::string device;
     int num_ds = 2;
     bool readonly = false;
+    Nvme::Qprio prio = Nvme::Qprio_medium;
+    l4_uint64_t iops = 0;
+    l4_uint64_t bps = 0;
+    int poll = -1;
 
     for (L4::Ipc::Varg p: valist)
       {
@@ -118,6 +236,50 @@ public:
             continue;
           }
 
+        std::string prio_param;
+        if (parse_string_param(p, "prio=", &prio_param))
+          {
+            if (!parse_prio(prio_param.c_str(), &prio))
+              {
+                Dbg::warn().printf("Invalid value for parameter 'prio'. "
+                                   "Must be urgent, high, medium or low.\n");
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
+        std::string limit_param;
+        if (parse_string_param(p, "iops=", &limit_param))
+          {
+            if (!parse_limit(limit_param.c_str(), &iops))
+              {
+                Dbg::warn().printf("Invalid value for parameter 'iops'.\n");
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
+        if (parse_string_param(p, "bps=", &limit_param))
+          {
+            if (!parse_limit(limit_param.c_str(), &bps))
+              {
+                Dbg::warn().printf("Invalid value for parameter 'bps'.\n");
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
+        if (parse_int_param(p, "poll=", &poll))
+          {
+            if (poll < 0 || poll > 1000) // sanity check with arbitrary limit
+              {
+                Dbg::warn().printf("Invalid range for parameter 'poll'. "
+                                   "Number must be between 0 and 1000.\n");
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
         if (strncmp(p.value<char const *>(), "read-only", p.length()) == 0)
           readonly = true;
       }
@@ -131,7 +293,7 @@ public:
 
     L4::Cap<void> cap;
     int ret = create_dynamic_client(device, -1, num_ds, &cap, readonly,
-                                    [](Nvme::Nvme_base_device *) {},
+                                    client_cb(prio, iops, bps, poll),
                                     !trusted_dataspaces->empty(),
                                     trusted_dataspaces);
     if (ret >= 0)
@@ -198,6 +360,36 @@ private:
   bool _scan_in_progress = true;
 };
 
+/**
+ * Hands out a dataspace to monitoring tasks.
+ *
+ * Monitoring tasks create an object from the `stats` or `trace` capability
+ * and get the statistics or trace dataspace with read-only rights.
+ */
+class Ds_server : public L4::Epiface_t<Ds_server, L4::Factory>
+{
+public:
+  explicit Ds_server(char const *name) : _name(name) {}
+
+  long op_create(L4::Factory::Rights, L4::Ipc::Cap<void> &res,
+                 l4_umword_t type, L4::Ipc::Varg_list_ref)
+  {
+    if (type != 0 && type != L4Re::Dataspace::Protocol)
+      return -L4_ENODEV;
+
+    Dbg::trace().printf("Monitor requests %s dataspace.\n", _name);
+    res = L4::Ipc::make_cap(_ds, L4_CAP_FPAGE_RO);
+    return L4_EOK;
+  }
+
+  void set_ds(L4::Cap<L4Re::Dataspace> ds)
+  { _ds = ds; }
+
+private:
+  char const *_name;
+  L4::Cap<L4Re::Dataspace> _ds;
+};
+
 struct Client_opts
 {
   bool add_client(Blk_mgr *blk_mgr)
@@ -219,7 +411,7 @@ struct Client_opts
           }
 
         blk_mgr->add_static_client(cap, device.c_str(), -1, ds_max, readonly,
-                                   [](Nvme::Nvme_base_device *) {},
+                                   client_cb(prio, iops, bps, poll),
                                    !trusted_dataspaces->empty(),
                                    trusted_dataspaces);
       }
@@ -231,10 +423,20 @@ struct Client_opts
   std::string device;
   int ds_max = 2;
   bool readonly = false;
+  Nvme::Qprio prio = Nvme::Qprio_medium;
+  l4_uint64_t iops = 0;
+  l4_uint64_t bps = 0;
+  int poll = -1;
 };
 
 static Block_device::Errand::Errand_server server;
 static Blk_mgr drv(server.registry());
+static Ds_server stats_svr("statistics");
+static cxx::unique_ptr<Nvme::Stats_ds> stats_ds;
+static Ds_server trace_svr("trace");
+static cxx::unique_ptr<Nvme::Trace_ds> trace_ds;
+/// Number of trace events per I/O queue pair, 0 if tracing is disabled
+static unsigned trace_entries = 0;
 std::vector<cxx::unique_ptr<Nvme::Ctl>> _ctls;
 unsigned static devices_in_scan = 0;
 
@@ -249,9 +451,26 @@ parse_args(int argc, char *const *argv)
     OPT_DEVICE,
     OPT_DS_MAX,
     OPT_READONLY,
+    OPT_PRIO,
+    OPT_IOPS,
+    OPT_BPS,
+    OPT_POLL,
     OPT_NOSGL,
     OPT_NOMSI,
-    OPT_NOMSIX
+    OPT_NOMSIX,
+    OPT_NOWCACHE,
+    OPT_CMB,
+    OPT_NODBBUF,
+    OPT_WRR,
+    OPT_IOQS,
+    OPT_IOQ_SIZE,
+    OPT_CQ_DB_INTERVAL,
+    OPT_POLL_US,
+    OPT_IRQ_COALESCE_THR,
+    OPT_IRQ_COALESCE_TIME,
+    OPT_WRR_WEIGHTS,
+    OPT_STATS_INTERVAL,
+    OPT_TRACE
   };
 
   struct option const loptions[] =
@@ -262,9 +481,26 @@ parse_args(int argc, char *const *argv)
     { "device",        required_argument, NULL,  OPT_DEVICE },
     { "ds-max",        required_argument, NULL,  OPT_DS_MAX },
     { "readonly",      no_argument,       NULL,  OPT_READONLY },
+    { "prio",          required_argument, NULL,  OPT_PRIO },
+    { "iops",          required_argument, NULL,  OPT_IOPS },
+    { "bps",           required_argument, NULL,  OPT_BPS },
+    { "poll",          required_argument, NULL,  OPT_POLL },
     { "nosgl",         no_argument,       NULL,  OPT_NOSGL },
     { "nomsi",         no_argument,       NULL,  OPT_NOMSI },
     { "nomsix",        no_argument,       NULL,  OPT_NOMSIX },
+    { "nowcache",      no_argument,       NULL,  OPT_NOWCACHE },
+    { "cmb",           no_argument,       NULL,  OPT_CMB },
+    { "nodbbuf",       no_argument,       NULL,  OPT_NODBBUF },
+    { "wrr",           no_argument,       NULL,  OPT_WRR },
+    { "ioqs",          required_argument, NULL,  OPT_IOQS },
+    { "ioq-size",      required_argument, NULL,  OPT_IOQ_SIZE },
+    { "cq-db-interval", required_argument, NULL, OPT_CQ_DB_INTERVAL },
+    { "poll-us",       required_argument, NULL,  OPT_POLL_US },
+    { "irq-coalesce-thr",  required_argument, NULL, OPT_IRQ_COALESCE_THR },
+    { "irq-coalesce-time", required_argument, NULL, OPT_IRQ_COALESCE_TIME },
+    { "wrr-weights",   required_argument, NULL,  OPT_WRR_WEIGHTS },
+    { "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+    { "trace",         required_argument, NULL,  OPT_TRACE },
     { "register-ds",   required_argument, NULL, 'd'},
   };
 
@@ -303,6 +539,37 @@ parse_args(int argc, char *const *argv)
         case OPT_READONLY:
           opts.readonly = true;
           break;
+        case OPT_PRIO:
+          if (!parse_prio(optarg, &opts.prio))
+            {
+              Dbg::warn().printf("Invalid priority class. "
+                                 "Must be urgent, high, medium or low.\n");
+              return -1;
+            }
+          break;
+        case OPT_IOPS:
+          if (!parse_limit(optarg, &opts.iops))
+            {
+              Dbg::warn().printf("Invalid request rate limit.\n");
+              return -1;
+            }
+          break;
+        case OPT_BPS:
+          if (!parse_limit(optarg, &opts.bps))
+            {
+              Dbg::warn().printf("Invalid bandwidth limit.\n");
+              return -1;
+            }
+          break;
+        case OPT_POLL:
+          opts.poll = atoi(optarg);
+          if (opts.poll < 0 || opts.poll > 1000)
+            {
+              Dbg::warn().printf("Invalid polling time. "
+                                 "Number must be between 0 and 1000.\n");
+              return -1;
+            }
+          break;
         case OPT_NOSGL:
           Nvme::Ctl::use_sgls = false;
           break;
@@ -312,6 +579,134 @@ parse_args(int argc, char *const *argv)
         case OPT_NOMSIX:
           Nvme::Ctl::use_msixs = false;
           break;
+        case OPT_NOWCACHE:
+          Nvme::Ctl::use_wcache = false;
+          break;
+        case OPT_CMB:
+          Nvme::Ctl::use_cmb = true;
+          break;
+        case OPT_NODBBUF:
+          Nvme::Ctl::use_dbbuf = false;
+          break;
+        case OPT_WRR:
+          Nvme::Ctl::use_wrr = true;
+          break;
+        case OPT_IOQS:
+          {
+            int n = atoi(optarg);
+            if (n < 1 || n > 64) // sanity check with arbitrary limit
+              {
+                Dbg::warn().printf("Invalid number of I/O queues. "
+                                   "Number must be between 1 and 64.\n");
+                return -1;
+              }
+            Nvme::Ctl::ioqs = n;
+            break;
+          }
+        case OPT_IOQ_SIZE:
+          {
+            int n = atoi(optarg);
+            if (n < 2 || n > Nvme::Queue::Ioq_size_max)
+              {
+                Dbg::warn().printf("Invalid I/O queue size. "
+                                   "Number must be between 2 and %u.\n",
+                                   (unsigned)Nvme::Queue::Ioq_size_max);
+                return -1;
+              }
+            Nvme::Ctl::ioq_size_cfg = n;
+            break;
+          }
+        case OPT_CQ_DB_INTERVAL:
+          {
+            int n = atoi(optarg);
+            if (n < 1)
+              {
+                Dbg::warn().printf("Invalid completion doorbell interval. "
+                                   "Number must be at least 1.\n");
+                return -1;
+              }
+            Nvme::Ctl::cq_db_interval = n;
+            break;
+          }
+        case OPT_POLL_US:
+          {
+            int n = atoi(optarg);
+            if (n < 0 || n > 1000) // sanity check with arbitrary limit
+              {
+                Dbg::warn().printf("Invalid polling time. "
+                                   "Number must be between 0 and 1000.\n");
+                return -1;
+              }
+            Nvme::Ctl::poll_us = n;
+            break;
+          }
+        case OPT_IRQ_COALESCE_THR:
+          {
+            int n = atoi(optarg);
+            if (n < 1 || n > 256)
+              {
+                Dbg::warn().printf("Invalid interrupt aggregation threshold. "
+                                   "Number must be between 1 and 256.\n");
+                return -1;
+              }
+            Nvme::Ctl::irq_coalesce_thr = n;
+            break;
+          }
+        case OPT_IRQ_COALESCE_TIME:
+          {
+            int n = atoi(optarg);
+            if (n < 0 || n > 255)
+              {
+                Dbg::warn().printf("Invalid interrupt aggregation time. "
+                                   "Number must be between 0 and 255.\n");
+                return -1;
+              }
+            Nvme::Ctl::irq_coalesce_time = n;
+            break;
+          }
+        case OPT_WRR_WEIGHTS:
+          {
+            unsigned w[3];
+            char end;
+            if (sscanf(optarg, "%u,%u,%u%c", &w[0], &w[1], &w[2], &end) != 3
+                || w[0] < 1 || w[0] > 256 || w[1] < 1 || w[1] > 256
+                || w[2] < 1 || w[2] > 256)
+              {
+                Dbg::warn().printf("Invalid arbitration weights. Three numbers "
+                                   "between 1 and 256 required.\n");
+                return -1;
+              }
+            for (unsigned i = 0; i < 3; ++i)
+              Nvme::Ctl::wrr_weights[i] = w[i];
+            break;
+          }
+        case OPT_STATS_INTERVAL:
+          {
+            int n = atoi(optarg);
+            if (n < 0 || n > 86400) // sanity check with arbitrary limit
+              {
+                Dbg::warn().printf("Invalid statistics interval. "
+                                   "Number must be between 0 and 86400.\n");
+                return -1;
+              }
+            Nvme::Nvme_device::stats_interval = n;
+            break;
+          }
+        case OPT_TRACE:
+          {
+            int n = atoi(optarg);
+            if (n < Nvme::Trace_ds::Min_entries
+                || n > Nvme::Trace_ds::Max_entries || (n & (n - 1)))
+              {
+                Dbg::warn().printf("Invalid number of trace events. Number "
+                                   "must be a power of two between %d and "
+                                   "%d.\n", Nvme::Trace_ds::Min_entries,
+                                   Nvme::Trace_ds::Max_entries);
+                return -1;
+              }
+            trace_entries = n;
+            break;
+          }
         case 'd':
           {
             L4::Cap<L4Re::Dataspace> ds =
@@ -404,12 +799,13 @@ device_discovery(L4::Cap<L4vbus::Vbus> bus, cxx::Ref_ptr<Nvme::Icu> icu)
           if (id == -1UL)
             Dbg::trace().printf("Using VBUS global DMA domain.\n");
 
+          Nvme::Ctl *ct;
           try
             {
               auto ctl =
                 cxx::make_unique<Nvme::Ctl>(child, icu, server.registry(),
                                             create_dma_space(bus, id));
-              ctl->register_interrupt_handler();
+              ct = ctl.get();
               _ctls.push_back(cxx::move(ctl));
             }
           catch (L4::Runtime_error const &e)
@@ -418,16 +814,49 @@ device_discovery(L4::Cap<L4vbus::Vbus> bus, cxx::Ref_ptr<Nvme::Icu> icu)
               continue;
             }
 
+          // The scan is finished once the controller has either failed or
+          // identified all its namespaces. Each namespace adds its own
+          // partition scan.
           ++devices_in_scan;
 
-          auto ct = _ctls.back().get();
-          ct->identify(
-            [=](cxx::unique_ptr<Nvme::Namespace> ns)
+          // All controllers are brought up concurrently, the device scan
+          // continues without waiting for them to become ready.
+          ct->enable(
+            [=](bool ready)
               {
-                printf("Making NSID %u visible to clients\n", ns->nsid());
-                drv.add_disk(cxx::make_ref_obj<Nvme::Nvme_device>(ns.get()),
-                             device_scan_finished);
-                ct->add_ns(cxx::move(ns));
+                if (!ready)
+                  {
+                    Err().printf("Controller did not become ready.\n");
+                    device_scan_finished();
+                    return;
+                  }
+
+                try
+                  {
+                    ct->register_interrupt_handler();
+                  }
+                catch (L4::Runtime_error const &e)
+                  {
+                    Err().printf("%s: %s\n", e.str(), e.extra_str());
+                    device_scan_finished();
+                    return;
+                  }
+
+                ct->identify(
+                  [=](cxx::unique_ptr<Nvme::Namespace> ns)
+                    {
+                      printf("Making NSID %u visible to clients\n",
+                             ns->nsid());
+                      ++devices_in_scan;
+                      auto dev = cxx::make_ref_obj<Nvme::Nvme_device>(ns.get());
+                      if (stats_ds)
+                        stats_ds->add(dev);
+                      if (trace_ds)
+                        trace_ds->add(ns.get());
+                      drv.add_disk(dev, device_scan_finished);
+                      ct->add_ns(cxx::move(ns));
+                    },
+                  device_scan_finished);
               });
         }
     }
@@ -438,6 +867,40 @@ device_discovery(L4::Cap<L4vbus::Vbus> bus, cxx::Ref_ptr<Nvme::Icu> icu)
   Dbg::info().printf("All devices scanned.\n");
 }
 
+static void
+setup_stats()
+{
+  if (!L4Re::Env::env()->get_cap<L4::Factory>("stats").is_valid())
+    {
+      Dbg::trace().printf("Capability 'stats' not found. Statistics are not "
+                          "published.\n");
+      return;
+    }
+
+  stats_ds = cxx::make_unique<Nvme::Stats_ds>(&server);
+  stats_svr.set_ds(stats_ds->ds());
+  L4Re::chkcap(server.registry()->register_obj(&stats_svr, "stats"),
+               "Register statistics server.");
+}
+
+static void
+setup_trace()
+{
+  if (!trace_entries)
+    return;
+
+  if (!L4Re::Env::env()->get_cap<L4::Factory>("trace").is_valid())
+    {
+      Dbg::warn().printf("Capability 'trace' not found. Tracing disabled.\n");
+      return;
+    }
+
+  trace_ds = cxx::make_unique<Nvme::Trace_ds>(trace_entries, &server);
+  trace_svr.set_ds(trace_ds->ds());
+  L4Re::chkcap(server.registry()->register_obj(&trace_svr, "trace"),
+               "Register trace server.");
+}
+
 static void
 setup_hardware()
 {
@@ -470,6 +933,9 @@ main(int argc, char *const *argv)
   Dbg::info().printf("NVMe driver says hello.\n");
 
   Block_device::Errand::set_server_iface(&server);
+  Nvme::Nvme_device::set_server_iface(&server);
+  setup_stats();
+  setup_trace();
   setup_hardware();
 
   Dbg::info().printf("Beginning server loop...\n");
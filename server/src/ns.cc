@@ -15,11 +15,48 @@ static Dbg trace(Dbg::Trace, "nvme-ns");
 
 namespace Nvme {
 
+Queue_pair::Queue_pair(Ctl &ctl, l4_uint16_t qid, Qprio prio)
+: _ctl(ctl), _qid(qid), _prio(prio), _msi(0), _trace(nullptr)
+{
+  _msi = _ctl.allocate_msi(this);
+}
+
+Queue_pair::~Queue_pair()
+{
+  _ctl.free_msi(_msi, this);
+}
+
+void
+Queue_pair::handle_irq()
+{
+  unsigned n = 0;
+  unsigned drained = 0;
+  while (auto *cqe = cq->consume())
+    {
+      assert(cqe->sqid() == _qid);
+      sq->complete(cqe);
+      ++drained;
+      if (++n >= Ctl::cq_db_interval)
+        {
+          cq->complete();
+          n = 0;
+        }
+    }
+  cq->complete();
+
+  // libblock-device notifies the clients of the requests completed above from
+  // their callbacks or, if it batches notifications, right after this
+  // handler returns.
+  if (_trace && drained)
+    _trace->add(Trace_event::Notify, 0, 0, drained);
+}
+
 Namespace::Namespace(Ctl &ctl, l4_uint32_t nsid, l4_size_t lba_sz,
                      cxx::Ref_ptr<Inout_buffer> const &in)
 : _callback(nullptr),
   _ctl(ctl),
-  _msi(0),
+  _nqps(),
+  _next_qp(),
   _nsid(nsid),
   _lba_sz(lba_sz),
   _dlfeat(0)
@@ -27,143 +64,301 @@ Namespace::Namespace(Ctl &ctl, l4_uint32_t nsid, l4_size_t lba_sz,
   _nsze = *in->get<l4_uint64_t>(Cns_in::Nsze);
   _ro = *in->get<l4_uint8_t>(Cns_in::Nsattr) & Nsattr::Wp;
   _dlfeat.raw = *in->get<l4_uint8_t>(Cns_in::Dlfeat);
-}
 
-Namespace::~Namespace()
-{
-  _ctl.free_msi(_msi, this);
+  // NLB is a 16-bit 0's based field. WZSL may restrict it further.
+  _wz_max = 0x10000;
+  if (_ctl.wzsl())
+    {
+      l4_uint64_t ps = 1ULL << (Ctl::Mps_base + _ctl.cap().mpsmin());
+      l4_uint64_t lbs = (ps << _ctl.wzsl()) / _lba_sz;
+      _wz_max = cxx::max(1ULL, cxx::min<l4_uint64_t>(lbs, _wz_max));
+    }
 }
 
 void
 Namespace::async_loop_init(
-  l4_uint32_t nsids, std::function<void(cxx::unique_ptr<Namespace>)> callback)
+  std::function<void(cxx::unique_ptr<Namespace>)> callback)
 {
   _callback = callback;
+  create_queue_pair(0, callback);
+}
 
-  _msi = _ctl.allocate_msi(this);
+void
+Namespace::create_queue_pair(
+  unsigned i, std::function<void(cxx::unique_ptr<Namespace>)> callback)
+{
+  // The first queue pairs serve the default medium priority class. With
+  // weighted round robin arbitration, there is one more for each of the other
+  // classes.
+  static Qprio const extra_prios[] = { Qprio_urgent, Qprio_high, Qprio_low };
+  unsigned num = Ctl::ioqs + (_ctl.wrr() ? Num_qprios - 1 : 0);
+
+  l4_uint16_t qid = 0;
+  if (i < num)
+    qid = _ctl.alloc_qid();
+
+  if (!qid)
+    {
+      // Either all requested queue pairs are created or the controller ran
+      // out of I/O queues.
+      init_done(callback);
+      return;
+    }
 
-  _iocq = _ctl.create_iocq(
-    qid(), Queue::Ioq_size, _msi,
-    [this, nsids, callback](l4_uint16_t status) {
+  Qprio prio = i < Ctl::ioqs ? Qprio_medium : extra_prios[i - Ctl::ioqs];
+  auto qp = cxx::make_unique<Queue_pair>(_ctl, qid, prio);
+  auto *q = qp.get();
+  _qps.push_back(cxx::move(qp));
+
+  q->cq = _ctl.create_iocq(
+    qid, _ctl.ioq_size(), q->msi(),
+    [this, q, i, callback](l4_uint16_t status) {
       if (status)
         {
           trace.printf(
             "Create I/O Completion Queue command failed with status=%u\n",
             status);
-
-          // Start identifying the next NSID
-          if (_nsid + 1 < nsids)
-            _ctl.identify_namespace(nsids, _nsid + 1, callback);
-
-          // Self-destruct
-          auto del = cxx::unique_ptr<Namespace>(this);
-
+          _qps.pop_back();
+          _ctl.free_qid(q->qid());
+          init_done(callback);
           return;
         }
-      _iosq = _ctl.create_iosq(
-        qid(), Queue::Ioq_size, _ctl.supports_sgl() ? Queue::Ioq_sgls : 0,
-        [this, nsids, callback](l4_uint16_t status) {
-
-          // Start identifying the next NSID
-          if (_nsid + 1 < nsids)
-            _ctl.identify_namespace(nsids, _nsid + 1, callback);
-
+      q->sq = _ctl.create_iosq(
+        q->qid(), _ctl.ioq_size(), _ctl.supports_sgl() ? Queue::Ioq_sgls : 0,
+        _ctl.supports_dsm() ? _ctl.dsm_ranges() : 0, q->prio(),
+        [this, q, i, callback](l4_uint16_t status) {
           if (status)
             {
               trace.printf(
                 "Create I/O Submission Queue command failed with status=%u\n",
                 status);
-              // Self-destruct
-              auto del = cxx::unique_ptr<Namespace>(this);
+              // The controller still owns the memory of the completion
+              // queue until it is deleted.
+              _ctl.delete_iocq(
+                q->qid(), [this, q, callback](l4_uint16_t status) {
+                  if (status)
+                    {
+                      trace.printf("Delete I/O Completion Queue command "
+                                   "failed with status=%u\n", status);
+                      // Leak the queue pair and its identifier rather than
+                      // letting the controller write into freed memory.
+                      _qps.back().release();
+                    }
+                  else
+                    _ctl.free_qid(q->qid());
+                  _qps.pop_back();
+                  init_done(callback);
+                });
               return;
             }
 
-          _callback(cxx::unique_ptr<Namespace>(this));
+          ++_nqps[q->prio()];
+          _ctl.configure_irq_vector(
+            _qps.back()->msi(), [this, i, callback](l4_uint16_t status) {
+              // Not fatal, the queue pair just raises more interrupts.
+              if (status)
+                trace.printf("Interrupt vector configuration failed with "
+                             "status=%u\n", status);
+              create_queue_pair(i + 1, callback);
+            });
         });
     });
 }
 
-Queue::Sqe volatile *
-Namespace::readwrite_prepare_prp(bool read, l4_uint64_t slba, l4_uint64_t paddr,
-                                 l4_size_t sz, Prp_list_entry **prpp, Callback cb) const
+void
+Namespace::init_done(std::function<void(cxx::unique_ptr<Namespace>)> callback)
 {
-  auto *sqe = _iosq->produce(std::move(cb));
-  if (!sqe)
-    return 0;
+  if (_qps.empty())
+    {
+      trace.printf("No I/O queues available for namespace %u\n", _nsid);
+      // Start identifying the next NSID
+      _ctl.namespace_done(callback);
+      // Self-destruct
+      auto del = cxx::unique_ptr<Namespace>(this);
+      return;
+    }
+
+  trace.printf("Namespace %u uses %zu I/O queue pair(s)\n", _nsid,
+               _qps.size());
+  // Hand over the namespace before starting the next NSID, so that the
+  // controller does not report completion before the namespace is known.
+  Ctl &ctl = _ctl;
+  _callback(cxx::unique_ptr<Namespace>(this));
+  ctl.namespace_done(callback);
+}
 
-  auto prp_list_start =
-    sqe->cid() * Queue::Prp_list_entries * sizeof(Prp_list_entry);
+Queue::Submission_queue *
+Namespace::io_queue(unsigned entries, Qprio prio, unsigned prp_pages,
+                    unsigned dsm_slots)
+{
+  if (!_nqps[prio])
+    prio = Qprio_medium;
+
+  unsigned &next = _next_qp[prio];
+  Queue_pair *skipped = nullptr;
+  for (unsigned i = 0; i < _qps.size(); i++)
+    {
+      auto *qp = _qps[next].get();
+      next = (next + 1) % _qps.size();
+      if (qp->prio() != prio)
+        continue;
+      if (qp->sq->free_entries() >= entries
+          && qp->sq->prp_pages_available() >= prp_pages
+          && qp->sq->dsm_slots_available() >= dsm_slots)
+        return qp->sq.get();
+      skipped = qp;
+    }
 
-  l4_uint64_t prp2 = l4_trunc_page(paddr + sz - 1);
-  if (l4_trunc_page(paddr) == prp2)
-    prp2 = 0; // reserved: set to 0
-  else if (l4_trunc_page(paddr) != prp2 - L4_PAGESIZE)
-    prp2 = _iosq->_prps->pget(prp_list_start);
+  // Count the rejected request once, not once per queue of the class.
+  if (skipped)
+    ++skipped->sq->stats().full;
+  return nullptr;
+}
+
+/**
+ * Prepare a read or write command that uses PRPs.
+ *
+ * PRP1 is set to `paddr`. If `list_pages` is not zero, the PRP List pages are
+ * allocated from the pool of the submission queue and PRP2 points to the first
+ * one. Otherwise PRP2 is 0. The caller fills in the PRP List or replaces PRP2
+ * by the second data page.
+ */
+Queue::Sqe volatile *
+Namespace::readwrite_prepare_prp(Queue::Submission_queue *sq,
+                                 Queue::Request_group *group, bool read,
+                                 l4_uint64_t slba, l4_uint64_t paddr,
+                                 unsigned list_pages, l4_uint16_t *pages) const
+{
+  auto *sqe = sq->produce_grouped(group);
+  sq->alloc_prp_pages(sqe->cid(), list_pages, pages);
 
   sqe->opc() = (read ? Iocs::Read : Iocs::Write);
   sqe->nsid = _nsid;
   sqe->psdt() = Psdt::Use_prps;
   sqe->prp.prp1 = paddr;
-  sqe->prp.prp2 = prp2;
+  sqe->prp.prp2 = list_pages ? sq->prp_page_paddr(pages[0]) : 0;
   sqe->cdw10 = slba & 0xfffffffful;
   sqe->cdw11 = slba >> 32;
   sqe->cdw13 = 0;
   sqe->cdw14 = 0;
   sqe->cdw15 = 0;
-  if (_iosq->_prps)
-    *prpp = _iosq->_prps->get<Prp_list_entry>(prp_list_start);
   return sqe;
 }
 
 Queue::Sqe volatile *
-Namespace::readwrite_prepare_sgl(bool read, l4_uint64_t slba,
-                                 Sgl_desc **sglp, Callback cb) const
+Namespace::readwrite_prepare_sgl(Queue::Submission_queue *sq,
+                                 Queue::Request_group *group, bool read,
+                                 l4_uint64_t slba, Sgl_desc **sglp) const
 {
-  auto *sqe = _iosq->produce(std::move(cb));
-  if (!sqe)
-    return 0;
+  auto *sqe = sq->produce_grouped(group);
 
   sqe->opc() = (read ? Iocs::Read : Iocs::Write);
   sqe->nsid = _nsid;
   sqe->psdt() = Psdt::Use_sgls;
   sqe->sgl1.sgl_id = Sgl_id::Last_segment_addr;
-  sqe->sgl1.addr = _iosq->sgls_paddr(sqe->cid());
+  sqe->sgl1.addr = sq->sgls_paddr(sqe->cid());
   sqe->cdw10 = slba & 0xfffffffful;
   sqe->cdw11 = slba >> 32;
   sqe->cdw13 = 0;
   sqe->cdw14 = 0;
   sqe->cdw15 = 0;
-  *sglp = _iosq->sgls_desc(sqe->cid());
+  *sglp = sq->sgls_desc(sqe->cid());
   return sqe;
 }
 
 void
-Namespace::readwrite_submit(Queue::Sqe volatile *sqe, l4_uint16_t nlb,
+Namespace::readwrite_submit(Queue::Submission_queue *sq,
+                            Queue::Sqe volatile *sqe, bool read,
+                            l4_uint64_t slba, l4_uint16_t nlb,
                             l4_size_t blocks) const
 {
-  if (sqe->psdt() == Psdt::Use_sgls)
+  // Only commands using SGLs have descriptor blocks.
+  if (blocks)
     sqe->sgl1.len = blocks * sizeof(Sgl_desc);
   sqe->nlb() = nlb;
-  _iosq->submit();
+
+  auto &st = sq->stats();
+  if (read)
+    {
+      ++st.reads;
+      st.read_bytes += (nlb + 1ULL) * _lba_sz;
+    }
+  else
+    {
+      ++st.writes;
+      st.write_bytes += (nlb + 1ULL) * _lba_sz;
+    }
+
+  sq->submit_io(read ? Iocs::Read : Iocs::Write, slba, nlb + 1U);
 }
 
-bool
-Namespace::write_zeroes(l4_uint64_t slba, l4_uint16_t nlb, bool dealloc,
-                        Callback cb) const
+void
+Namespace::write_zeroes(Queue::Submission_queue *sq,
+                        Queue::Request_group *group, l4_uint64_t slba,
+                        l4_uint32_t nlb, bool dealloc) const
 {
-  auto *sqe = _iosq->produce(std::move(cb));
-  if (!sqe)
-    return false;
+  assert(nlb > 0 && nlb <= _wz_max);
 
+  auto *sqe = sq->produce_grouped(group);
   sqe->opc() = Iocs::Write_zeroes;
   sqe->nsid = _nsid;
   sqe->cdw10 = slba & 0xfffffffful;
   sqe->cdw11 = slba >> 32;
-  sqe->nlb() = nlb;
+  sqe->nlb() = nlb - 1;
   sqe->deac() = dealloc;
-  sqe->cdw14 = 0;
-  sqe->cdw15 = 0;
-  _iosq->submit();
+  ++sq->stats().write_zeroes;
+  sq->submit_io(Iocs::Write_zeroes, slba, nlb);
+}
+
+Queue::Sqe volatile *
+Namespace::deallocate_prepare(Queue::Submission_queue *sq, Dsm_range **rangesp,
+                              Block_device::Inout_callback const &cb,
+                              Client_stats *client) const
+{
+  if (!sq->dsm_slots_available())
+    return 0;
+
+  auto *sqe = sq->produce_io(cb, 0, client);
+  if (!sqe)
+    return 0;
+
+  l4_uint16_t slot = sq->alloc_dsm_slot(sqe->cid());
+  sqe->opc() = Iocs::Dataset_management;
+  sqe->nsid = _nsid;
+  sqe->psdt() = Psdt::Use_prps;
+  sqe->prp.prp1 = sq->dsm_paddr(slot);
+  sqe->prp.prp2 = 0;
+  sqe->ad() = 1;
+  *rangesp = sq->dsm_range(slot);
+  return sqe;
+}
+
+void
+Namespace::deallocate_submit(Queue::Submission_queue *sq,
+                             Queue::Sqe volatile *sqe, l4_size_t ranges) const
+{
+  assert(ranges > 0 && ranges <= sq->dsm_ranges());
+  sqe->nr() = ranges - 1;
+  ++sq->stats().discards;
+  sq->submit_io(Iocs::Dataset_management, 0, ranges);
+}
+
+bool
+Namespace::flush(Block_device::Inout_callback const &cb, Qprio prio,
+                 Client_stats *client)
+{
+  auto *sq = io_queue(1, prio);
+  if (!sq)
+    return false;
+
+  auto *sqe = sq->produce_io(cb, 0, client);
+  if (!sqe)
+    return false;
+
+  sqe->opc() = Iocs::Flush;
+  sqe->nsid = _nsid;
+  ++sq->stats().flushes;
+  sq->submit_io(Iocs::Flush);
   return true;
 }
 
@@ -9,6 +9,8 @@
 
 #include <l4/cxx/bitfield>
 
+#include <vector>
+
 #include "nvme_types.h"
 #include "queue.h"
 #include "inout_buffer.h"
@@ -17,17 +19,75 @@ namespace Nvme {
 
 class Ctl;
 
-class Namespace : public L4::Irqep_t<Namespace>
+/**
+ * A pair of an I/O Completion Queue and an I/O Submission Queue.
+ *
+ * Each queue pair has its own interrupt vector if the controller and the ICU
+ * provide enough MSI/MSI-X vectors. Otherwise it shares vector 0 with the
+ * admin queues and its completions are handled from Ctl::handle_irq().
+ */
+class Queue_pair : public L4::Irqep_t<Queue_pair>
+{
+public:
+  Queue_pair(Ctl &ctl, l4_uint16_t qid, Qprio prio);
+  ~Queue_pair();
+
+  Queue_pair(Queue_pair const &) = delete;
+  Queue_pair(Queue_pair &&) = delete;
+
+  /**
+   * Drain the completion queue.
+   *
+   * All available entries are consumed. The head doorbell is written at the
+   * end of the drain and, during long drains, every `Ctl::cq_db_interval`
+   * entries to bound the time the controller has to wait for free completion
+   * queue entries.
+   */
+  void handle_irq();
+
+  /// Returns the I/O queue identifier shared by both queues of the pair
+  l4_uint16_t qid() const
+  { return _qid; }
+
+  /// Returns the interrupt vector used by the completion queue
+  unsigned msi() const
+  { return _msi; }
+
+  /// Returns the priority class of the submission queue
+  Qprio prio() const
+  { return _prio; }
+
+  /**
+   * Record the life cycle of the commands of both queues in `trace`, nullptr
+   * to stop.
+   */
+  void set_trace(Trace_ring *trace)
+  {
+    _trace = trace;
+    sq->set_trace(trace);
+    cq->set_trace(trace);
+  }
+
+  cxx::unique_ptr<Queue::Completion_queue> cq;
+  cxx::unique_ptr<Queue::Submission_queue> sq;
+
+private:
+  Ctl &_ctl;
+  l4_uint16_t _qid;
+  Qprio _prio;
+  unsigned _msi;
+  /// Trace ring, nullptr if tracing is disabled
+  Trace_ring *_trace;
+};
+
+class Namespace
 {
 public:
   Namespace(Ctl &ctl, l4_uint32_t nsid, l4_size_t lba_sz,
             cxx::Ref_ptr<Inout_buffer> const &in);
 
-  ~Namespace();
-
   void
-  async_loop_init(l4_uint32_t nsids,
-                  std::function<void(cxx::unique_ptr<Namespace>)> callback);
+  async_loop_init(std::function<void(cxx::unique_ptr<Namespace>)> callback);
 
   Ctl const &ctl() const
   { return _ctl; }
@@ -47,55 +107,174 @@ public:
   Ns_dlfeat dlfeat() const
   { return _dlfeat; }
 
+  /// Number of I/O queue pairs in use by this namespace
+  unsigned num_queues() const
+  { return _qps.size(); }
 
+  /**
+   * Handle completions on all I/O queue pairs of the namespace.
+   *
+   * Queue pairs with their own interrupt vector are normally served by their
+   * own interrupt handler, draining them here as well is harmless.
+   */
   void handle_irq()
   {
-    while (auto *cqe = _iocq->consume())
+    for (auto &qp : _qps)
+      qp->handle_irq();
+  }
+
+  /// Number of commands in flight on all I/O queue pairs of the namespace.
+  unsigned inflight() const
+  {
+    unsigned n = 0;
+    for (auto &qp : _qps)
+      n += qp->sq->inflight();
+    return n;
+  }
+
+  /// Defer the tail doorbell writes of all I/O submission queues.
+  void plug()
+  {
+    for (auto &qp : _qps)
+      qp->sq->plug();
+  }
+
+  /// Write the tail doorbells of all I/O submission queues with new entries.
+  void unplug()
+  {
+    for (auto &qp : _qps)
+      qp->sq->unplug();
+  }
+
+  /**
+   * Sum up the number of commands and tail doorbell writes of all I/O
+   * submission queues.
+   */
+  void doorbell_stats(unsigned long long *cmds,
+                      unsigned long long *doorbells) const
+  {
+    *cmds = *doorbells = 0;
+    for (auto &qp : _qps)
       {
-        assert(cqe->sqid() == qid());
-        _iosq->complete(cqe);
-        _iocq->complete();
+        *cmds += qp->sq->cmds();
+        *doorbells += qp->sq->doorbells();
       }
   }
 
-  Queue::Sqe volatile *readwrite_prepare_sgl(bool read, l4_uint64_t slba,
-                                             Sgl_desc **sglp, Callback cb) const;
-  Queue::Sqe volatile *readwrite_prepare_prp(bool read, l4_uint64_t slba,
-                                             l4_uint64_t paddr, l4_size_t sz,
-                                             Prp_list_entry **prpp, Callback cb) const;
-  void readwrite_submit(Queue::Sqe volatile *sqe, l4_uint16_t nlb,
+  /// Sum up the statistics of all I/O submission queues.
+  Queue_stats stats() const
+  {
+    Queue_stats st = Queue_stats();
+    for (auto &qp : _qps)
+      st.merge(qp->sq->stats());
+    return st;
+  }
+
+  /// The I/O queue pairs of the namespace.
+  std::vector<cxx::unique_ptr<Queue_pair>> const &queue_pairs() const
+  { return _qps; }
+
+  /**
+   * Select an I/O submission queue for the next command.
+   *
+   * The queues of the priority class are used in a round-robin fashion so
+   * that independent requests, e.g. from different clients or partitions, are
+   * spread over all of them. Queues without enough free entries, PRP List
+   * pages or Dataset Management range buffers are skipped. If all of them are
+   * skipped, the request counts as full in the statistics of the queue tried
+   * last.
+   * If the namespace has no queue of the priority class, the queues of the
+   * medium priority class are used.
+   *
+   * \param entries    Number of commands the caller is going to produce.
+   * \param prio       Priority class of the requester.
+   * \param prp_pages  Number of PRP List pages the commands need.
+   * \param dsm_slots  Number of range buffers the commands need.
+   *
+   * \return Submission queue with at least `entries` free entries,
+   *         `prp_pages` free PRP List pages and `dsm_slots` free range
+   *         buffers or nullptr if there is no such queue.
+   */
+  Queue::Submission_queue *io_queue(unsigned entries = 1,
+                                    Qprio prio = Qprio_medium,
+                                    unsigned prp_pages = 0,
+                                    unsigned dsm_slots = 0);
+
+  Queue::Sqe volatile *
+  readwrite_prepare_sgl(Queue::Submission_queue *sq,
+                        Queue::Request_group *group, bool read,
+                        l4_uint64_t slba, Sgl_desc **sglp) const;
+  Queue::Sqe volatile *
+  readwrite_prepare_prp(Queue::Submission_queue *sq,
+                        Queue::Request_group *group, bool read,
+                        l4_uint64_t slba, l4_uint64_t paddr,
+                        unsigned list_pages, l4_uint16_t *pages) const;
+  void readwrite_submit(Queue::Submission_queue *sq, Queue::Sqe volatile *sqe,
+                        bool read, l4_uint64_t slba, l4_uint16_t nlb,
                         l4_size_t blocks) const;
 
-  bool write_zeroes(l4_uint64_t slba, l4_uint16_t nlb, bool dealloc, Callback cb) const;
+  /// Maximum number of logical blocks of a single Write Zeroes command
+  l4_uint32_t write_zeroes_max() const
+  { return _wz_max; }
+
+  /**
+   * Produce and submit a Write Zeroes command as part of a request group.
+   *
+   * \param nlb  Number of logical blocks, at most write_zeroes_max().
+   */
+  void write_zeroes(Queue::Submission_queue *sq, Queue::Request_group *group,
+                    l4_uint64_t slba, l4_uint32_t nlb, bool dealloc) const;
+
+  /**
+   * Prepare a Dataset Management command that deallocates logical blocks.
+   *
+   * \param      sq      Submission queue to use.
+   * \param[out] rangesp Range list of the command. The caller fills in up to
+   *                     `sq->dsm_ranges()` entries.
+   * \param      cb      Client callback invoked on completion.
+   * \param      client  Statistics of the client, updated on completion.
+   *
+   * \return Submission queue entry or nullptr if the queue is full or has no
+   *         free range buffer.
+   */
+  Queue::Sqe volatile *
+  deallocate_prepare(Queue::Submission_queue *sq, Dsm_range **rangesp,
+                     Block_device::Inout_callback const &cb,
+                     Client_stats *client = nullptr) const;
+  void deallocate_submit(Queue::Submission_queue *sq, Queue::Sqe volatile *sqe,
+                         l4_size_t ranges) const;
+
+  /**
+   * Commit the contents of the volatile write cache to non-volatile media.
+   *
+   * \return False if no I/O queue entry is available, true otherwise.
+   */
+  bool flush(Block_device::Inout_callback const &cb,
+             Qprio prio = Qprio_medium, Client_stats *client = nullptr);
 
 private:
-  /// Returns the I/O queue identifier for this namespace
-  l4_uint16_t qid() const
-  {
-    // For simplicity, we reuse the namespace identifier as the I/O queue
-    // identifier. Valid namespace identifiers start counting from 1, just as
-    // valid I/O queue identifiers do. One drawback of this approach is that it
-    // only works for namespace identifiers below the 64K limit. For now we
-    // assert that the namespace identifier is below this limit.
-    l4_assert(_nsid < 65536);
-    return _nsid;
-  }
+  void create_queue_pair(unsigned i,
+                         std::function<void(cxx::unique_ptr<Namespace>)> callback);
+  void init_done(std::function<void(cxx::unique_ptr<Namespace>)> callback);
 
   /// Callback to be called when the initialization of the namespace is complete
   std::function<void(cxx::unique_ptr<Namespace>)> _callback;
 
   Ctl &_ctl;
 
-  unsigned _msi;
-
-  cxx::unique_ptr<Queue::Completion_queue> _iocq;
-  cxx::unique_ptr<Queue::Submission_queue> _iosq;
+  std::vector<cxx::unique_ptr<Queue_pair>> _qps;
+  /// Number of queue pairs per priority class
+  unsigned _nqps[Num_qprios];
+  /// Index of the queue pair to try first for the next command, per priority
+  /// class
+  unsigned _next_qp[Num_qprios];
 
   l4_uint32_t _nsid; ///< Namespace Identifier
   l4_uint64_t _nsze; ///< Namespace Size [number of LBAs]
   l4_size_t _lba_sz; ///< LBA size [bytes]
   bool _ro;          ///< Read-only
   Ns_dlfeat _dlfeat; ///< Deallocate Logical Block Features
+  l4_uint32_t _wz_max; ///< Write Zeroes limit [number of LBAs]
 };
 
 }
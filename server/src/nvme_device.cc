@@ -7,11 +7,145 @@
 
 #include <algorithm>
 
+#include <l4/re/env>
+#include <l4/sys/kip>
+
 #include "debug.h"
 #include "nvme_device.h"
 #include "nvme_types.h"
 #include "ctl.h"
 #include "queue.h"
+#include "alloc_stats.h"
+
+static Dbg trace(Dbg::Trace, "nvme-dev");
+
+L4::Ipc_svr::Server_iface *Nvme::Nvme_device::_sif = nullptr;
+unsigned Nvme::Nvme_device::stats_interval = 0;
+
+void
+Nvme::Nvme_device::batch_start()
+{
+  if (_batching || _polling || !_sif)
+    return;
+
+  plug();
+  _batching = true;
+  _sif->add_timeout(&_unplug_timeout, l4_kip_clock(l4re_kip()));
+}
+
+void
+Nvme::Nvme_device::batch_done()
+{
+  _batching = false;
+  unplug();
+
+  if (_poll_us)
+    poll();
+
+  unsigned long long cmds, doorbells;
+  _ns->doorbell_stats(&cmds, &doorbells);
+  // Report the ratio every 64K commands
+  if (cmds >= _report_at)
+    {
+      _report_at = cmds + 0x10000;
+      trace.printf("Namespace %u: %llu commands, %llu SQ doorbell writes "
+                   "(%llu.%02llu per command)\n", _ns->nsid(), cmds, doorbells,
+                   doorbells / cmds, (doorbells * 100 / cmds) % 100);
+    }
+}
+
+/**
+ * Busy-wait for the completion of the commands in flight.
+ *
+ * Polls the completion queues of the namespace for at most the polling time
+ * of the device's client after the doorbells have been written. Completions
+ * that arrive later are handled by the interrupt handlers as usual, which also remain
+ * responsible for any completion that races with the end of the polling
+ * period.
+ *
+ * The queues stay unplugged while polling, so that commands the client
+ * submits from its completion callbacks reach the controller right away
+ * instead of waiting for a doorbell batch that can only end after polling.
+ */
+void
+Nvme::Nvme_device::poll()
+{
+  // Commands held back by an explicit plug have not reached the controller,
+  // there is nothing to wait for.
+  if (_plugged)
+    return;
+
+  l4_cpu_time_t end = l4_kip_clock(l4re_kip()) + _poll_us;
+
+  _polling = true;
+  while (_ns->inflight())
+    {
+      _ns->handle_irq();
+      if (l4_kip_clock(l4re_kip()) >= end)
+        break;
+    }
+  _polling = false;
+}
+
+void
+Nvme::Nvme_device::arm_stats_timeout()
+{
+  if (!_sif || !stats_interval)
+    return;
+
+  _sif->add_timeout(&_stats_timeout, l4_kip_clock(l4re_kip())
+                                       + stats_interval * 1000000ULL);
+}
+
+void
+Nvme::Nvme_device::stats_expired()
+{
+  report_stats();
+  arm_stats_timeout();
+}
+
+void
+Nvme::Nvme_device::report_stats() const
+{
+  char const *name = _hid.c_str();
+  print_stats(name, _stats);
+  printf("%s: busy %llu\n", name, _stats.busy);
+
+  std::string ns = _hid + " queues";
+  Queue_stats all = _ns->stats();
+  print_stats(ns.c_str(), all);
+
+  for (auto const &qp : _ns->queue_pairs())
+    {
+      auto const &st = qp->sq->stats();
+      printf("%s: queue %u prio %u: commands %llu, doorbells %llu, "
+             "full %llu, in flight %u (max %u), errors %llu",
+             name, qp->qid(), qp->prio(), qp->sq->cmds(),
+             qp->sq->doorbells(), st.full, st.inflight, st.max_inflight,
+             st.errors);
+      if (st.errors)
+        printf(" (last status 0x%x)", st.last_error);
+      printf("\n");
+    }
+}
+
+bool
+Nvme::Nvme_device::set_limits(l4_uint64_t iops, l4_uint64_t bps)
+{
+  l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+  _iops.set_rate(iops, now);
+  _bps.set_rate(bps, now);
+
+  // Allocate the deferred requests up front, the submission path must not
+  // allocate.
+  if (throttled() && _deferred.empty())
+    _deferred.resize(Deferred_max);
+
+  if (throttled())
+    trace.printf("%s: limited to %llu requests/s, %llu bytes/s (0 = no "
+                 "limit)\n", _hid.c_str(), iops, bps);
+  return true;
+}
 
 int
 Nvme::Nvme_device::inout_data(l4_uint64_t sector,
@@ -19,92 +153,363 @@ Nvme::Nvme_device::inout_data(l4_uint64_t sector,
                               Block_device::Inout_callback const &cb,
                               L4Re::Dma_space::Direction dir)
 {
-  Queue::Sqe volatile *sqe;
-  l4_size_t sectors = 0;
-  l4_size_t blocks = 0;
-  bool read = (dir == L4Re::Dma_space::Direction::From_device ? true : false);
-  Block_device::Inout_callback callback = cb; // capture a copy
+  if (!throttled())
+    return count_busy(submit_inout_data(sector, block, cb, dir));
+
+  l4_size_t bytes = 0;
+  for (auto *b = &block; b; b = b->next.get())
+    bytes += b->num_sectors * sector_size();
 
-  if (_ns->ctl().supports_sgl())
+  return count_busy(throttle({false, false, dir, sector, &block, cb, bytes}));
+}
+
+int
+Nvme::Nvme_device::discard(l4_uint64_t offset,
+                           Block_device::Inout_block const &block,
+                           Block_device::Inout_callback const &cb, bool discard)
+{
+  if (!throttled())
+    return count_busy(submit_discard(offset, block, cb, discard));
+
+  // No data is transferred, only the request rate limit applies.
+  return count_busy(throttle({true, discard, L4Re::Dma_space::Direction::None,
+                              offset, &block, cb, 0}));
+}
+
+int
+Nvme::Nvme_device::submit(Deferred_request const &req)
+{
+  if (req.discard_req)
+    return submit_discard(req.sector, *req.block, req.cb, req.discard);
+  return submit_inout_data(req.sector, *req.block, req.cb, req.dir);
+}
+
+int
+Nvme::Nvme_device::throttle(Deferred_request const &req)
+{
+  if (!_sif)
+    return submit(req);
+
+  l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+  _iops.refill(now);
+  _bps.refill(now);
+
+  if (!_deferred_count && _iops.available() && _bps.available())
     {
-      // Determine request size
-      auto *b = &block;
-      for (auto i = 0u; b && i < Queue::Ioq_sgls; i++, b = b->next.get())
+      int ret = submit(req);
+      if (ret == L4_EOK)
         {
-          sectors += b->num_sectors;
-          ++blocks;
+          _iops.consume(1);
+          _bps.consume(req.bytes);
         }
-      l4_size_t sz = sectors * sector_size();
+      return ret;
+    }
 
-      auto sgl_cb = [callback, sz](l4_uint16_t status) {
-        callback(status ? -L4_EIO : L4_EOK, status ? 0 : sz);
-      };
-      Sgl_desc *sgls;
-      sqe = _ns->readwrite_prepare_sgl(read, sector, &sgls, sgl_cb);
+  // The client retries the request once one of its other requests completes,
+  // the deferred ones will.
+  if (_deferred_count == _deferred.size())
+    return -L4_EBUSY;
 
-      if (!sqe)
-        return -L4_EBUSY;
+  // The block list of a request stays valid until its callback is invoked,
+  // only the reference to it is kept.
+  Alloc_probe probe;
+  _deferred[(_deferred_head + _deferred_count++) % _deferred.size()] = req;
+  arm_throttle_timeout(cxx::max(_iops.wait_us(), _bps.wait_us()));
+  return L4_EOK;
+}
+
+void
+Nvme::Nvme_device::arm_throttle_timeout(l4_uint64_t delay_us)
+{
+  if (_throttle_armed)
+    return;
+
+  _throttle_armed = true;
+  _sif->add_timeout(&_throttle_timeout,
+                    l4_kip_clock(l4re_kip()) + cxx::max(delay_us, 1ULL));
+}
+
+void
+Nvme::Nvme_device::resume_deferred()
+{
+  _throttle_armed = false;
+
+  l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+  _iops.refill(now);
+  _bps.refill(now);
+
+  bool busy = false;
+  while (_deferred_count && _iops.available() && _bps.available())
+    {
+      auto &req = _deferred[_deferred_head];
+      int ret = submit(req);
+      if (ret == -L4_EBUSY)
+        {
+          // The I/O queues are full, try again a bit later.
+          busy = true;
+          break;
+        }
+
+      if (ret == L4_EOK)
+        {
+          _iops.consume(1);
+          _bps.consume(req.bytes);
+        }
+      else
+        req.cb(ret, 0);
+
+      req.cb = nullptr;
+      _deferred_head = (_deferred_head + 1) % _deferred.size();
+      --_deferred_count;
+    }
+
+  if (_deferred_count)
+    arm_throttle_timeout(busy ? (l4_uint64_t)Throttle_retry_us
+                              : cxx::max(_iops.wait_us(), _bps.wait_us()));
+}
+
+void
+Nvme::Nvme_device::reset()
+{
+  if (_throttle_armed)
+    {
+      _sif->remove_timeout(&_throttle_timeout);
+      _throttle_armed = false;
+    }
+
+  // Only fail the requests deferred so far, the callbacks may already pass
+  // new ones.
+  for (unsigned n = _deferred_count; n; --n)
+    {
+      auto cb = std::move(_deferred[_deferred_head].cb);
+      _deferred[_deferred_head].cb = nullptr;
+      _deferred_head = (_deferred_head + 1) % _deferred.size();
+      --_deferred_count;
+      cb(-L4_EIO, 0);
+    }
+}
+
+int
+Nvme::Nvme_device::submit_inout_data(l4_uint64_t sector,
+                                     Block_device::Inout_block const &block,
+                                     Block_device::Inout_callback const &cb,
+                                     L4Re::Dma_space::Direction dir)
+{
+  bool read = (dir == L4Re::Dma_space::Direction::From_device ? true : false);
+
+  // The submission path must not allocate, the client callback is stored in
+  // the preallocated request slot of the command.
+  Alloc_probe probe;
+
+  if (!_ns->ctl().supports_sgl())
+    return inout_data_prp(sector, block, cb, read);
+
+  // A segment must not exceed the transfer limit of a single command.
+  l4_size_t bytes = 0;
+  for (auto *b = &block; b; b = b->next.get())
+    {
+      if (b->num_sectors * sector_size() > max_transfer())
+        return -L4_EINVAL;
+      bytes += b->num_sectors * sector_size();
+    }
+
+  // The request is only split into several commands if it exceeds MDTS or
+  // has more segments than fit into the SGL of a command.
+  unsigned cmds = 0;
+  for (auto *b = &block; b; b = sgl_run_end(b))
+    ++cmds;
+
+  auto *sq = _ns->io_queue(cmds, _prio);
+  if (!sq)
+    return -L4_EBUSY;
+
+  auto *group = sq->alloc_group(cb, bytes, cmds, &_stats);
+  if (!group)
+    return -L4_EBUSY;
+
+  count_inout(read, bytes);
+  batch_start();
+
+  for (auto *b = &block; b;)
+    {
+      auto *end = sgl_run_end(b);
+
+      Sgl_desc *sgls;
+      auto *sqe = _ns->readwrite_prepare_sgl(sq, group, read, sector, &sgls);
 
       // Construct the SGL
-      b = &block;
-      for (l4_size_t i = 0; i < blocks; i++, b = b->next.get())
+      l4_size_t sectors = 0;
+      l4_size_t blocks = 0;
+      for (; b != end; b = b->next.get(), ++blocks)
         {
-          sgls[i].sgl_id = Sgl_id::Data;
-          sgls[i].addr = b->dma_addr;
-          sgls[i].len = b->num_sectors * sector_size();
+          sgls[blocks].sgl_id = Sgl_id::Data;
+          sgls[blocks].addr = b->dma_addr;
+          sgls[blocks].len = b->num_sectors * sector_size();
+          sectors += b->num_sectors;
         }
+
+      // XXX: defer running of the callback to an Errand like the ahci-driver
+      // does?
+      _ns->readwrite_submit(sq, sqe, read, sector, sectors - 1, blocks);
+      sector += sectors;
+    }
+
+  return L4_EOK;
+}
+
+Block_device::Inout_block const *
+Nvme::Nvme_device::sgl_run_end(Block_device::Inout_block const *b) const
+{
+  l4_size_t bytes = 0;
+
+  for (unsigned i = 0; b; b = b->next.get(), ++i)
+    {
+      l4_size_t sz = b->num_sectors * sector_size();
+      if (i == Queue::Ioq_sgls || bytes + sz > max_transfer())
+        break;
+      bytes += sz;
     }
-  else
+
+  return b;
+}
+
+Block_device::Inout_block const *
+Nvme::Nvme_device::prp_run_end(Block_device::Inout_block const *b,
+                               unsigned *list_pages) const
+{
+  l4_size_t pages = 0;
+  l4_size_t bytes = 0;
+  l4_uint64_t end = 0;
+
+  for (; b; b = b->next.get())
     {
-      // Fallback to using PRPs
+      l4_size_t sz = b->num_sectors * sector_size();
+      l4_size_t p =
+        (l4_round_page(b->dma_addr + sz) - l4_trunc_page(b->dma_addr))
+        / L4_PAGESIZE;
 
-      Prp_list_entry *prps;
+      // A segment continues the PRP list of the command only if both meet at
+      // a page boundary.
+      if (bytes
+          && (l4_trunc_page(end) != end
+              || l4_trunc_page(b->dma_addr) != b->dma_addr
+              || pages + p > prp_data_entries()
+              || bytes + sz > max_transfer()))
+        break;
 
-      l4_assert(!block.next);
+      pages += p;
+      bytes += sz;
+      end = b->dma_addr + sz;
+    }
 
-      sectors =
-        std::min((l4_size_t)block.num_sectors, max_size() / sector_size());
-      ++blocks;
-      l4_size_t sz = sectors * sector_size();
-      auto prp_cb = [callback, sz](l4_uint16_t status) {
-        callback(status ? -L4_EIO : L4_EOK, status ? 0 : sz);
-      };
-      sqe = _ns->readwrite_prepare_prp(read, sector, block.dma_addr, sz, &prps, prp_cb);
-      if (!sqe)
-        return -L4_EBUSY;
+  // PRP1 and PRP2 cover up to two pages. Beyond that, PRP2 points to a PRP
+  // List whose pages each link to the next one in their last entry.
+  *list_pages = 0;
+  if (pages > Queue::Prp_command_entries)
+    *list_pages = (pages - 2 + Queue::Prp_list_entries_per_page - 2)
+                  / (Queue::Prp_list_entries_per_page - 1);
+
+  return b;
+}
+
+int
+Nvme::Nvme_device::inout_data_prp(l4_uint64_t sector,
+                                  Block_device::Inout_block const &block,
+                                  Block_device::Inout_callback const &cb,
+                                  bool read)
+{
+  // A segment must fit into the PRP List of a single command.
+  l4_size_t bytes = 0;
+  for (auto *b = &block; b; b = b->next.get())
+    {
+      if (b->num_sectors * sector_size() > max_size())
+        return -L4_EINVAL;
+      bytes += b->num_sectors * sector_size();
+    }
 
-      // figure out what is covered by PRP0
-      l4_uint64_t paddr = l4_trunc_page(block.dma_addr + L4_PAGESIZE);
-      l4_size_t remains = 0;
-      if (sz >= (paddr - block.dma_addr))
-        remains = sz - (paddr - block.dma_addr);
+  // Segments that meet at page boundaries are merged into a single PRP list,
+  // otherwise the request is split into several commands that form a request
+  // group.
+  unsigned cmds = 0;
+  unsigned list_pages = 0;
+  for (auto *b = &block; b; ++cmds)
+    {
+      unsigned lp;
+      b = prp_run_end(b, &lp);
+      list_pages += lp;
+    }
 
-      // covered already by PRP1?
-      if (remains <= L4_PAGESIZE)
-        remains = 0;
+  // A request needing more PRP List pages than a queue has would never fit.
+  if (list_pages > Queue::Prp_pool_pages)
+    return -L4_EINVAL;
 
-      // Construct the PRP List
-      for (auto i = 0u, p = 0u; remains && i < Queue::Prp_list_entries; i++)
+  auto *sq = _ns->io_queue(cmds, _prio, list_pages);
+  if (!sq)
+    return -L4_EBUSY;
+
+  auto *group = sq->alloc_group(cb, bytes, cmds, &_stats);
+  if (!group)
+    return -L4_EBUSY;
+
+  count_inout(read, bytes);
+  batch_start();
+
+  for (auto *b = &block; b;)
+    {
+      unsigned lp;
+      auto *end = prp_run_end(b, &lp);
+
+      l4_uint16_t pages[Queue::Prp_pool_pages];
+      auto *sqe = _ns->readwrite_prepare_prp(sq, group, read, sector,
+                                             b->dma_addr, lp, pages);
+
+      // Entry `i` of the PRP List of the command
+      auto prp = [&](unsigned i) -> Prp_list_entry &
+        {
+          return sq->prp_page(pages[i / Queue::Prp_list_entries_per_page])
+                   [i % Queue::Prp_list_entries_per_page];
+        };
+
+      // PRP1 covers the first page, the PRP List all further pages.
+      unsigned n = 0;
+      l4_uint64_t prp2 = 0;
+      l4_size_t sectors = 0;
+      for (bool first = true; b != end; b = b->next.get(), first = false)
         {
-          // Check for the last entry in a page and link it to the next page.
-          if ((i % Queue::Prp_list_entries_per_page
-               == Queue::Prp_list_entries_per_page - 1)
-              && (remains > L4_PAGESIZE))
+          l4_uint64_t paddr = first ? l4_trunc_page(b->dma_addr) + L4_PAGESIZE
+                                    : b->dma_addr;
+          l4_uint64_t seg_end = b->dma_addr + b->num_sectors * sector_size();
+          for (; paddr < seg_end; paddr += L4_PAGESIZE, ++n)
             {
-              p++;
-              prps[i].addr = sqe->prp.prp2 + p * L4_PAGESIZE;
-              continue;
+              if (!lp)
+                {
+                  // Without a PRP List, PRP2 points to the second page.
+                  l4_assert(n == 0);
+                  prp2 = paddr;
+                  continue;
+                }
+
+              if (n % Queue::Prp_list_entries_per_page == 0 && n > 0)
+                {
+                  // Move the last entry of the full page to the next one and
+                  // put the link in its place.
+                  unsigned page = n / Queue::Prp_list_entries_per_page;
+                  prp(n) = prp(n - 1);
+                  prp(n - 1).addr = sq->prp_page_paddr(pages[page]);
+                  ++n;
+                }
+              l4_assert(n < lp * Queue::Prp_list_entries_per_page);
+              prp(n).addr = paddr;
             }
-          prps[i].addr = paddr;
-          paddr += L4_PAGESIZE;
-          remains -= cxx::min<l4_size_t>(remains, L4_PAGESIZE);
+          sectors += b->num_sectors;
         }
 
-      l4_assert(remains == 0);
-    }
+      if (!lp)
+        sqe->prp.prp2 = prp2;
 
-  // XXX: defer running of the callback to an Errand like the ahci-driver does?
-  _ns->readwrite_submit(sqe, sectors - 1, blocks);
+      _ns->readwrite_submit(sq, sqe, read, sector, sectors - 1, 0);
+      sector += sectors;
+    }
 
   return L4_EOK;
 }
@@ -112,30 +517,111 @@ Nvme::Nvme_device::inout_data(l4_uint64_t sector,
 int
 Nvme::Nvme_device::flush(Block_device::Inout_callback const &cb)
 {
-  // The NVMe driver does not enable the Volatile Write Cache in the controller
-  // (if present) and neither it nor libblock-device implements a software block
-  // cache, so there is nothing to flush at this point.
-  cb(0, 0);
+  // Without a volatile write cache in the controller, writes are on
+  // non-volatile media on completion. Neither the NVMe driver nor
+  // libblock-device implements a software block cache.
+  if (!_ns->ctl().vwc())
+    {
+      ++_stats.flushes;
+      cb(0, 0);
+      return L4_EOK;
+    }
+
+  Alloc_probe probe;
+  batch_start();
+  if (!_ns->flush(cb, _prio, &_stats))
+    return count_busy(-L4_EBUSY);
+
+  ++_stats.flushes;
   return L4_EOK;
 }
 
 int
-Nvme::Nvme_device::discard(l4_uint64_t offset,
-                           Block_device::Inout_block const &block,
-                           Block_device::Inout_callback const &cb, bool discard)
+Nvme::Nvme_device::submit_discard(l4_uint64_t offset,
+                                  Block_device::Inout_block const &block,
+                                  Block_device::Inout_callback const &cb,
+                                  bool discard)
 {
-  l4_assert(!discard);
-  l4_assert(!block.next.get());
-  (void)discard;
-
-  Block_device::Inout_callback callback = cb; // capture a copy
-  bool sub = _ns->write_zeroes(offset + block.sector, block.num_sectors - 1,
-                               block.flags & Block_device::Inout_f_unmap,
-                               [callback](l4_uint16_t status) {
-                                 callback(status ? -L4_EIO : L4_EOK, 0);
-                               });
-  if (!sub)
+  Alloc_probe probe;
+
+  // Requests beyond the advertised limits would never fit into a queue,
+  // reject them instead of letting the client retry forever.
+  Discard_info di = discard_info();
+  unsigned max_seg = discard ? di.max_discard_seg : di.max_write_zeroes_seg;
+  l4_uint64_t max_sectors = discard ? di.max_discard_sectors
+                                    : di.max_write_zeroes_sectors;
+  l4_size_t n = 0;
+  for (auto *b = &block; b; b = b->next.get(), ++n)
+    if (b->num_sectors > max_sectors)
+      return -L4_EINVAL;
+  if (n > max_seg)
+    return -L4_EINVAL;
+
+  if (discard)
+    {
+      if (!_ns->ctl().supports_dsm())
+        return -L4_EINVAL;
+
+      auto *sq = _ns->io_queue(1, _prio, 0, 1);
+      if (!sq)
+        return -L4_EBUSY;
+
+      batch_start();
+
+      Dsm_range *ranges;
+      auto *sqe = _ns->deallocate_prepare(sq, &ranges, cb, &_stats);
+      if (!sqe)
+        return -L4_EBUSY;
+      ++_stats.discards;
+
+      n = 0;
+      for (auto *b = &block; b; b = b->next.get(), ++n)
+        {
+          ranges[n].cattr = 0;
+          ranges[n].nlb = b->num_sectors;
+          ranges[n].slba = offset + b->sector;
+        }
+
+      _ns->deallocate_submit(sq, sqe, n);
+      return L4_EOK;
+    }
+
+  // Split the segments into commands of at most the controller's limit and
+  // complete the request once all of them finished.
+  l4_uint32_t wz_max = _ns->write_zeroes_max();
+  unsigned cmds = 0;
+  for (auto *b = &block; b; b = b->next.get())
+    cmds += (b->num_sectors + wz_max - 1) / wz_max;
+
+  if (!cmds)
+    {
+      cb(L4_EOK, 0);
+      return L4_EOK;
+    }
+
+  auto *sq = _ns->io_queue(cmds, _prio);
+  if (!sq)
+    return -L4_EBUSY;
+
+  auto *group = sq->alloc_group(cb, 0, cmds, &_stats);
+  if (!group)
     return -L4_EBUSY;
 
+  ++_stats.write_zeroes;
+  batch_start();
+  for (auto *b = &block; b; b = b->next.get())
+    {
+      l4_uint64_t slba = offset + b->sector;
+      l4_uint64_t remains = b->num_sectors;
+      bool dealloc = b->flags & Block_device::Inout_f_unmap;
+      while (remains)
+        {
+          l4_uint32_t nlb = cxx::min<l4_uint64_t>(remains, wz_max);
+          _ns->write_zeroes(sq, group, slba, nlb, dealloc);
+          slba += nlb;
+          remains -= nlb;
+        }
+    }
+
   return L4_EOK;
 }
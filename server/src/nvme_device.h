@@ -9,9 +9,13 @@
 #include <l4/cxx/string>
 
 #include <string>
+#include <vector>
 
 #include "ctl.h"
 #include "ns.h"
+#include "timeout.h"
+#include "token_bucket.h"
+#include "io_stats.h"
 
 #include <l4/libblock-device/device.h>
 
@@ -21,17 +25,155 @@ class Nvme_base_device
 : public Block_device::Device,
   public Block_device::Device_discard_feature
 {
+public:
+  /**
+   * Set the priority class of the I/O submission queues used for the
+   * requests of the device's client.
+   *
+   * \retval true   The priority class is used.
+   * \retval false  The device does not support priorities, i.e. it is a
+   *                partition. Its requests use the medium priority class.
+   */
+  virtual bool set_priority(Qprio)
+  { return false; }
+
+  /**
+   * Limit the rate of the requests of the device's client.
+   *
+   * \param iops  Maximum number of requests per second, 0 for no limit.
+   * \param bps   Maximum number of bytes per second, 0 for no limit.
+   *
+   * \retval true   The limits are enforced.
+   * \retval false  The device does not support limits, i.e. it is a
+   *                partition.
+   */
+  virtual bool set_limits(l4_uint64_t, l4_uint64_t)
+  { return false; }
+
+  /**
+   * Set the time to poll for I/O completions after the requests of the
+   * device's client have been submitted.
+   *
+   * \param us  Polling time [us], 0 to rely on interrupts only.
+   *
+   * \retval true   The polling time is used.
+   * \retval false  The device does not support polling settings, i.e. it is
+   *                a partition. Its requests use the polling time of the
+   *                namespace.
+   */
+  virtual bool set_poll(unsigned)
+  { return false; }
 };
 
 class Nvme_device
 : public Block_device::Device_with_notification_domain<Nvme_base_device>
 {
+  enum
+  {
+    /// Maximum number of requests deferred by the rate limits
+    Deferred_max = 256,
+    /// Delay before deferred requests are retried if the I/O queues are full
+    Throttle_retry_us = 100,
+  };
+
+  /// A request deferred by the rate limits
+  struct Deferred_request
+  {
+    bool discard_req;  ///< Discard or write zeroes instead of read or write
+    bool discard;      ///< Discard rather than write zeroes
+    L4Re::Dma_space::Direction dir;
+    l4_uint64_t sector;
+    Block_device::Inout_block const *block;
+    Block_device::Inout_callback cb;
+    l4_size_t bytes;
+  };
+
 public:
-  Nvme_device(Namespace *ns) : _ns(cxx::move(ns))
+  Nvme_device(Namespace *ns)
+  : _ns(cxx::move(ns)), _prio(Qprio_medium), _poll_us(Ctl::poll_us),
+    _plugged(0), _batching(false), _polling(false), _unplug_timeout(this),
+    _report_at(1), _throttle_timeout(this), _throttle_armed(false),
+    _deferred_head(0), _deferred_count(0), _stats(), _stats_timeout(this)
   {
     _hid = _ns->ctl().sn() + ":n" + std::to_string(_ns->nsid());
+    Cycle_clock::init();
+    arm_stats_timeout();
   }
 
+  /**
+   * Start deferring doorbell writes.
+   *
+   * Commands issued until the matching unplug() are passed to the controller
+   * with one doorbell write per submission queue. Calls can be nested.
+   */
+  void plug()
+  {
+    if (_plugged++ == 0)
+      _ns->plug();
+  }
+
+  /**
+   * Stop deferring doorbell writes and ring the doorbells of all submission
+   * queues with pending commands.
+   */
+  void unplug()
+  {
+    assert(_plugged);
+    if (--_plugged == 0)
+      _ns->unplug();
+  }
+
+  /**
+   * Set the server interface used to queue the timeouts which end automatic
+   * doorbell batches. Without it, each command rings its doorbell immediately.
+   */
+  static void set_server_iface(L4::Ipc_svr::Server_iface *sif)
+  { _sif = sif; }
+
+  bool set_priority(Qprio prio) override
+  {
+    _prio = prio;
+    return true;
+  }
+
+  bool set_limits(l4_uint64_t iops, l4_uint64_t bps) override;
+
+  bool set_poll(unsigned us) override
+  {
+    _poll_us = us;
+    return true;
+  }
+
+  /**
+   * Statistics of the requests of the device's client.
+   *
+   * Requests of clients of partitions of the namespace are accounted here as
+   * well.
+   */
+  Client_stats const &stats() const
+  { return _stats; }
+
+  /// Hardware ID of the device, `<serial number>:n<nsid>`
+  std::string const &hid() const
+  { return _hid; }
+
+  /// Namespace the device gives access to
+  Namespace const &ns() const
+  { return *_ns; }
+
+  Namespace &ns()
+  { return *_ns; }
+
+  /// Statistics of the commands of all I/O queues of the namespace.
+  Queue_stats ns_stats() const
+  { return _ns->stats(); }
+
+  /**
+   * Print the statistics of the client, the namespace and each of its I/O
+   * submission queues.
+   */
+  void report_stats() const;
+
   bool is_read_only() const override
   { return _ns->ro(); }
 
@@ -49,34 +191,36 @@ public:
   l4_size_t max_size() const override
   {
     l4_size_t max_size;
-    l4_size_t ps = 1UL << (Ctl::Mps_base + _ns->ctl().cap().mpsmin());
 
     if (_ns->ctl().supports_sgl())
       {
-        max_size = 4 * 1024 * 1024;
-        if (_ns->ctl().mdts())
-          {
-            // Spread the MDTS limit evenly over all allowed VIRTIO blk segments
-            max_size =
-              cxx::min(max_size, (ps << _ns->ctl().mdts()) / Queue::Ioq_sgls);
-          }
+        // Requests that exceed the transfer limit of a command in total are
+        // split at segment boundaries, so only a segment must fit.
+        max_size = max_transfer();
       }
     else
       {
+        // A request with the maximum number of segments must not need more
+        // PRP List pages than the pool of an I/O queue has.
+        l4_size_t list_pages = Queue::Prp_pool_pages / max_segments();
+        l4_size_t pages =
+          cxx::min<l4_size_t>(list_pages
+                                * (Queue::Prp_list_entries_per_page - 1),
+                              prp_data_entries());
         // Account for the possibility of data starting at non-zero page offset.
-        max_size = (Queue::Prp_data_entries - 1) * L4_PAGESIZE;
-        if (_ns->ctl().mdts())
-          max_size = cxx::min(max_size, ps << _ns->ctl().mdts());
+        max_size = cxx::min((pages - 1) * L4_PAGESIZE, max_transfer());
       }
     return max_size;
   }
 
   unsigned max_segments() const override
   {
-    // When SGLs are not available, the max number of segments must be one
-    // because it is generally not possible to account for the page-unaligned
-    // start of a segment in the middle of a PRP List.
-    return _ns->ctl().supports_sgl() ? Queue::Ioq_sgls : 1;
+    // In the worst case, each segment needs a command of its own: with SGLs
+    // if every segment has the maximum size, without SGLs if segments do not
+    // meet at page boundaries. All commands of a request must fit into an I/O
+    // queue at once, use at most half of it.
+    return cxx::min<unsigned>(Queue::Ioq_sgls,
+                              cxx::max(1U, _ns->ctl().ioq_size() / 2U));
   }
 
   Discard_info discard_info() const override
@@ -86,15 +230,40 @@ public:
     di.max_discard_sectors = 0;
     di.max_discard_seg = 0;
     di.discard_sector_alignment = 0;
-    di.max_write_zeroes_sectors = 65536;
-    di.max_write_zeroes_seg = 1;
+
+    Ctl const &ctl = _ns->ctl();
+    if (ctl.supports_dsm())
+      {
+        l4_uint64_t seg = ctl.dsm_ranges();
+        l4_uint64_t sectors = ctl.dsm_range_lbs();
+        // Make sure that a request with the maximum number of segments of
+        // maximum size does not exceed the overall limit.
+        if (ctl.dsm_lbs())
+          sectors = cxx::min(sectors, ctl.dsm_lbs() / seg);
+        di.max_discard_sectors = sectors;
+        di.max_discard_seg = seg;
+        di.discard_sector_alignment = 1;
+      }
+
+    // Large requests are split into several Write Zeroes commands. All of
+    // them must fit into an I/O queue at once, use at most half of it.
+    l4_uint64_t cmds = cxx::max(1U, _ns->ctl().ioq_size() / 2U);
+    l4_uint64_t seg = cxx::min<l4_uint64_t>(Queue::Wz_segs, cmds);
+    di.max_write_zeroes_sectors =
+      cxx::min<l4_uint64_t>((cmds / seg) * _ns->write_zeroes_max(),
+                            0xffffffffU);
+    di.max_write_zeroes_seg = seg;
     di.write_zeroes_may_unmap = _ns->dlfeat().deallocwz();
 
     return di;
   }
 
-  void reset() override
-  {} // TODO
+  /**
+   * Fail the requests deferred by the rate limits.
+   *
+   * Commands already passed to the controller complete as usual.
+   */
+  void reset() override;
 
   int dma_map(Block_device::Mem_region *region, l4_addr_t offset,
               l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
@@ -130,8 +299,162 @@ public:
   };
 
 private:
+  /**
+   * Start a doorbell batch for the IPC that is currently being handled,
+   * unless one is already active.
+   */
+  void batch_start();
+  void batch_done();
+  void poll();
+  void arm_stats_timeout();
+  /// Print the statistics and queue the next report.
+  void stats_expired();
+
+  /// Account a read or write request passed to the controller.
+  void count_inout(bool read, l4_size_t bytes)
+  {
+    if (read)
+      {
+        ++_stats.reads;
+        _stats.read_bytes += bytes;
+      }
+    else
+      {
+        ++_stats.writes;
+        _stats.write_bytes += bytes;
+      }
+  }
+
+  /// Account a request the client has to retry later.
+  int count_busy(int ret)
+  {
+    if (ret == -L4_EBUSY)
+      ++_stats.busy;
+    return ret;
+  }
+
+  /// Whether requests are subject to rate limits
+  bool throttled() const
+  { return _iops.limited() || _bps.limited(); }
+
+  /**
+   * Pass a request to the controller or defer it if the rate limits are
+   * exhausted.
+   *
+   * Requests are deferred in order, so while there are deferred requests,
+   * new ones are deferred as well.
+   */
+  int throttle(Deferred_request const &req);
+  int submit(Deferred_request const &req);
+  void resume_deferred();
+  void arm_throttle_timeout(l4_uint64_t delay_us);
+
+  int submit_inout_data(l4_uint64_t sector,
+                        Block_device::Inout_block const &blocks,
+                        Block_device::Inout_callback const &cb,
+                        L4Re::Dma_space::Direction dir);
+  int submit_discard(l4_uint64_t offset, Block_device::Inout_block const &block,
+                     Block_device::Inout_callback const &cb, bool discard);
+
+  /**
+   * Maximum number of bytes transferred by a single command.
+   *
+   * Limited by MDTS and the 16-bit Number of Logical Blocks field.
+   */
+  l4_size_t max_transfer() const
+  {
+    l4_size_t max = 0x10000UL * sector_size();
+    l4_size_t ps = 1UL << (Ctl::Mps_base + _ns->ctl().cap().mpsmin());
+    if (_ns->ctl().mdts())
+      max = cxx::min(max, ps << _ns->ctl().mdts());
+    return max;
+  }
+
+  /**
+   * Maximum number of data pages of a command with PRPs.
+   *
+   * A transfer of max_transfer() bytes not starting at a page boundary spans
+   * one more page. The PRP List of a single command may take the whole pool
+   * of its queue.
+   */
+  l4_size_t prp_data_entries() const
+  {
+    return cxx::min<l4_size_t>(max_transfer() / L4_PAGESIZE + 1,
+                               Queue::prp_data_entries(Queue::Prp_pool_pages));
+  }
+
+  /**
+   * Determine the segments that can be transferred by a single command with
+   * an SGL.
+   *
+   * None of the segments may exceed max_transfer().
+   *
+   * \return First segment that needs a new command or nullptr.
+   */
+  Block_device::Inout_block const *
+  sgl_run_end(Block_device::Inout_block const *b) const;
+
+  /**
+   * Determine the segments that can be transferred by a single command with a
+   * PRP List.
+   *
+   * \param      b           First segment of the command.
+   * \param[out] list_pages  Number of PRP List pages the command needs.
+   *
+   * \return First segment that needs a new command or nullptr.
+   */
+  Block_device::Inout_block const *
+  prp_run_end(Block_device::Inout_block const *b, unsigned *list_pages) const;
+
+  int inout_data_prp(l4_uint64_t sector, Block_device::Inout_block const &block,
+                     Block_device::Inout_callback const &cb, bool read);
+
   Namespace *_ns;
   std::string _hid;
+  /// Priority class of the client's requests
+  Qprio _prio;
+  /// Time to poll for completions after submission [us], 0 to disable
+  unsigned _poll_us;
+
+  unsigned _plugged;
+  bool _batching;
+  /// Polling for completions, submissions do not start a doorbell batch
+  bool _polling;
+  /**
+   * Timeout that ends an automatic doorbell batch.
+   *
+   * The timeout is queued to expire immediately, so the server loop handles
+   * it right after the current IPC, i.e. after all descriptors of a virtio
+   * notification have been turned into NVMe commands.
+   */
+  Member_timeout<Nvme_device, &Nvme_device::batch_done> _unplug_timeout;
+  /// Number of commands at which to report the doorbell statistics next
+  unsigned long long _report_at;
+
+  /// Request rate limit
+  Token_bucket _iops;
+  /// Bandwidth limit
+  Token_bucket _bps;
+  /**
+   * Timeout that resumes the deferred requests once the token buckets have
+   * been refilled
+   */
+  Member_timeout<Nvme_device, &Nvme_device::resume_deferred> _throttle_timeout;
+  bool _throttle_armed;
+  /// Ring of deferred requests, allocated when limits are set
+  std::vector<Deferred_request> _deferred;
+  unsigned _deferred_head;
+  unsigned _deferred_count;
+
+  Client_stats _stats;
+  /// Timeout that prints the statistics periodically
+  Member_timeout<Nvme_device, &Nvme_device::stats_expired> _stats_timeout;
+
+  static L4::Ipc_svr::Server_iface *_sif;
+
+public:
+  /// Interval of the periodic statistics reports [s], 0 to disable them
+  static unsigned stats_interval;
 };
 
 
@@ -26,22 +26,51 @@ enum
 enum Acs
 {
   Create_iosq = 1u, ///< Create I/O Submission Queue
+  Delete_iocq = 4u, ///< Delete I/O Completion Queue
   Create_iocq = 5u, ///< Create I/O Completion Queue
   Identify = 6u,
+  Set_features = 9u,
+  Doorbell_buffer_config = 0x7cu, ///< Doorbell Buffer Config
+};
+
+/// Feature Identifiers
+enum Fid
+{
+  Arbitration = 1u,
+  Volatile_write_cache = 6u,
+  Number_of_queues = 7u,
+  Interrupt_coalescing = 8u,
+  Interrupt_vector_configuration = 9u,
 };
 
 enum Cns
 {
   Identify_namespace = 0u,
   Identify_controller = 1u,
+  Active_nsid_list = 2u,         ///< Active Namespace ID list
+  Identify_iocs_controller = 6u, ///< I/O Command Set specific controller
+};
+
+/// Queue Priority of an I/O Submission Queue
+///
+/// Only used with weighted round robin arbitration.
+enum Qprio
+{
+  Qprio_urgent = 0u,
+  Qprio_high = 1u,
+  Qprio_medium = 2u,
+  Qprio_low = 3u,
+  Num_qprios = 4u,
 };
 
 /// I/O Command Set commands
 enum Iocs
 {
+  Flush = 0u,
   Write = 1u,
   Read = 2u,
   Write_zeroes = 8u,
+  Dataset_management = 9u,
 };
 
 /// Identify Namespace offsets
@@ -64,12 +93,37 @@ enum Cns_ic
   Sn = 4u,   ///< Serial Number
   Mn = 24u,  ///< Model Number
   Fr = 64u,  ///< Firmware Revision
+  Rab = 72u, ///< Recommended Arbitration Burst
   Mdts = 77u, ///< Maximum Data Transfer Size
   Cntlid = 78u, ///< Controller ID
+  Oacs = 256u, ///< Optional Admin Command Support
   Nn = 516u, ///< Number of Namespaces
+  Oncs = 520u, ///< Optional NVM Command Support
+  Vwc = 525u, ///< Volatile Write Cache
   Sgls = 536u, ///< SGL Support
 };
 
+/// Optional Admin Command Support flags
+enum Oacs_flags
+{
+  Oacs_dbbuf = 1u << 8, ///< Doorbell Buffer Config command supported
+};
+
+/// Optional NVM Command Support flags
+enum Oncs_flags
+{
+  Oncs_dsm = 1u << 2, ///< Dataset Management command supported
+};
+
+/// I/O Command Set specific Identify Controller offsets (NVM Command Set)
+enum Cns_iocs_ic
+{
+  Wzsl = 1u,  ///< Write Zeroes Size Limit
+  Dmrl = 3u,  ///< Dataset Management Ranges Limit
+  Dmrsl = 4u, ///< Dataset Management Range Size Limit
+  Dmsl = 8u,  ///< Dataset Management Size Limit
+};
+
 /** Deallocate Logical Block Features
  */
 struct Ns_dlfeat
@@ -120,6 +174,16 @@ struct Prp_list_entry
 static_assert(sizeof(Prp_list_entry) == 8, "Prp_list_entry is 8 bytes");
 static_assert(alignof(Prp_list_entry) == 8, "Prp_list_entru is qword aligned");
 
+/** Dataset Management range */
+struct Dsm_range
+{
+  l4_uint32_t cattr; ///< Context Attributes
+  l4_uint32_t nlb;   ///< Length in logical blocks
+  l4_uint64_t slba;  ///< Starting LBA
+} __attribute__ ((aligned(8)));
+
+static_assert(sizeof(Dsm_range) == 16, "Dsm_range is 16 bytes");
+
 /** Controller Capabilities register of a NVMe Controller
  */
 struct Ctl_cap
@@ -185,6 +249,37 @@ struct Ctl_csts
   explicit Ctl_csts(l4_uint32_t v) : raw(v) {}
 };
 
+/** Controller Memory Buffer Location register of a NVMe Controller
+ */
+struct Ctl_cmbloc
+{
+  l4_uint32_t raw;
+  CXX_BITFIELD_MEMBER_RO(12, 31, ofst, raw); ///< Offset (in CMBSZ.SZU units)
+  CXX_BITFIELD_MEMBER_RO(0, 2, bir, raw);    ///< Base Indicator Register
+
+  explicit Ctl_cmbloc(l4_uint32_t v) : raw(v) {}
+};
+
+/** Controller Memory Buffer Size register of a NVMe Controller
+ */
+struct Ctl_cmbsz
+{
+  l4_uint32_t raw;
+  CXX_BITFIELD_MEMBER_RO(12, 31, sz, raw);  ///< Size (in SZU units)
+  CXX_BITFIELD_MEMBER_RO(8, 11, szu, raw);  ///< Size Units (4 KiB << 4 * SZU)
+  CXX_BITFIELD_MEMBER_RO(4, 4, wds, raw);   ///< Write Data Support
+  CXX_BITFIELD_MEMBER_RO(3, 3, rds, raw);   ///< Read Data Support
+  CXX_BITFIELD_MEMBER_RO(2, 2, lists, raw); ///< PRP SGL List Support
+  CXX_BITFIELD_MEMBER_RO(1, 1, cqs, raw);   ///< Completion Queue Support
+  CXX_BITFIELD_MEMBER_RO(0, 0, sqs, raw);   ///< Submission Queue Support
+
+  explicit Ctl_cmbsz(l4_uint32_t v) : raw(v) {}
+
+  /// Size unit in bytes
+  l4_uint64_t unit() const
+  { return 4096ULL << (4 * szu()); }
+};
+
 /** Admin Queue Attributes of a NVMe Controller
  */
 struct Ctl_aqa
@@ -213,12 +308,24 @@ enum Regs
   Aqa = 0x24U,   ///< Admin Queue Attributes
   Asq = 0x28U,   ///< Amdin Submission Queue Base Address
   Acq = 0x30U,   ///< Admin Completion Queue Base Address
+  Cmbloc = 0x38U, ///< Controller Memory Buffer Location
+  Cmbsz = 0x3cU,  ///< Controller Memory Buffer Size
+  Cmbmsc = 0x50U, ///< Controller Memory Buffer Memory Space Control
   Sq0tdbl = 0x1000U ///< Submission Queue 0 Tail Doorbell
 };
 
+enum Cmbmsc
+{
+  Cmbmsc_cre = 1u << 0,  ///< Capabilities Registers Enabled
+  Cmbmsc_cmse = 1u << 1, ///< Controller Memory Space Enable
+};
+
 enum Cc
 {
   Ams_rr = 0u,  ///< Arbitration Mechanism Selected: Round Robin
+  /// Arbitration Mechanism Selected: Weighted Round Robin with Urgent Priority
+  /// Class, also the corresponding bit in CAP.AMS
+  Ams_wrr = 1u,
   Css_nvm = 0u, ///< I/O Command Set Selected: NVM Command Set
 };
 
@@ -239,6 +239,10 @@ public:
     return _vectors[msi];
   }
 
+  /// Number of controller-local vectors handed out so far
+  unsigned vectors_used() const
+  { return _last; }
+
   void enable_msix(int irq, l4_icu_msi_info_t msi_info)
   {
     if (!_msix_table.vaddr.get())
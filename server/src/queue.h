@@ -7,6 +7,7 @@
 #pragma once
 
 #include <l4/cxx/bitfield>
+#include <l4/cxx/minmax>
 #include <l4/re/util/shared_cap>
 #include <l4/drivers/hw_mmio_register_block>
 
@@ -14,6 +15,11 @@
 
 #include "nvme_types.h"
 #include "inout_buffer.h"
+#include "cmb.h"
+#include "cid_allocator.h"
+#include "alloc_stats.h"
+#include "io_stats.h"
+#include "trace_ring.h"
 
 namespace Nvme {
 
@@ -25,20 +31,37 @@ namespace Queue {
 // These are tunables
 enum
 {
-  Ioq_size = 32,      ///< Number of entries per I/O queue.
+  /// Number of entries per admin queue, unless limited by CAP.MQES.
+  Aq_size = 32,
+  /// Default number of entries per I/O queue, unless limited by CAP.MQES.
+  Ioq_size_default = 256,
+  /// Upper limit for the number of entries per I/O queue.
+  Ioq_size_max = 4096,
   Ioq_sgls = 32,      ///< Number of SGL entries per I/O queue entry.
-  Prp_list_pages = 2, ///< Number of PRP List pages per I/O queue entry.
+  /// Number of PRP List pages shared by the commands of an I/O queue.
+  Prp_pool_pages = 64,
+  /// Maximum number of Dataset Management ranges per I/O queue entry.
+  Dsm_ranges = L4_PAGESIZE / sizeof(Dsm_range),
+  /// Number of Dataset Management range buffers shared by the commands of an
+  /// I/O queue.
+  Dsm_pool_slots = 16,
+  /// Maximum number of segments of a write zeroes request.
+  Wz_segs = 4,
 
   /// Number of PRP entries available in the command.
   Prp_command_entries = 2,
   Prp_list_entries_per_page = L4_PAGESIZE / sizeof(Prp_list_entry),
-  /// Number of PRP entries available in the PRP list.
-  Prp_list_entries = Prp_list_pages * Prp_list_entries_per_page,
-  /// Number of PRP entries that map actual data in both the command and the PRP
-  /// list. Entries that point to a PRP list are not included.
-  Prp_data_entries = Prp_command_entries + Prp_list_entries - Prp_list_pages,
 };
 
+/**
+ * Number of PRP entries that map actual data in both the command and a PRP
+ * List of `list_pages` pages. Entries that point to a PRP List page are not
+ * included.
+ */
+constexpr unsigned
+prp_data_entries(unsigned list_pages)
+{ return Prp_command_entries + list_pages * (Prp_list_entries_per_page - 1); }
+
 /// Submission Queue Entry
 struct Sqe
 {
@@ -77,6 +100,37 @@ struct Sqe
   // Identify Namespace command
   CXX_BITFIELD_MEMBER(0, 15, nvmsetid, cdw11); ///< NVM Set Identifier
 
+  // Set Features command
+  CXX_BITFIELD_MEMBER(0, 7, fid, cdw10); ///< Feature Identifier
+
+  // Number of Queues feature
+  CXX_BITFIELD_MEMBER(0, 15, nsqr, cdw11);  ///< Number of I/O SQs Requested
+  CXX_BITFIELD_MEMBER(16, 31, ncqr, cdw11); ///< Number of I/O CQs Requested
+
+  // Volatile Write Cache feature
+  CXX_BITFIELD_MEMBER(0, 0, wce, cdw11); ///< Volatile Write Cache Enable
+
+  // Dataset Management command
+  CXX_BITFIELD_MEMBER(0, 7, nr, cdw10); ///< Number of Ranges
+  CXX_BITFIELD_MEMBER(2, 2, ad, cdw11); ///< Attribute - Deallocate
+
+  // Identify command (I/O Command Set specific structures)
+  CXX_BITFIELD_MEMBER(24, 31, csi, cdw11); ///< Command Set Identifier
+
+  // Interrupt Coalescing feature
+  CXX_BITFIELD_MEMBER(0, 7, thr, cdw11);   ///< Aggregation Threshold
+  CXX_BITFIELD_MEMBER(8, 15, time, cdw11); ///< Aggregation Time
+
+  // Arbitration feature
+  CXX_BITFIELD_MEMBER(0, 2, ab, cdw11);    ///< Arbitration Burst
+  CXX_BITFIELD_MEMBER(8, 15, lpw, cdw11);  ///< Low Priority Weight
+  CXX_BITFIELD_MEMBER(16, 23, mpw, cdw11); ///< Medium Priority Weight
+  CXX_BITFIELD_MEMBER(24, 31, hpw, cdw11); ///< High Priority Weight
+
+  // Interrupt Vector Configuration feature
+  CXX_BITFIELD_MEMBER(0, 15, ivc_iv, cdw11); ///< Interrupt Vector
+  CXX_BITFIELD_MEMBER(16, 16, cd, cdw11);    ///< Coalescing Disable
+
   // Create I/O Completion / Submission Queue commands
   CXX_BITFIELD_MEMBER(0, 0, pc, cdw11);  ///< Physically Contiguous
 
@@ -86,6 +140,7 @@ struct Sqe
 
   // Create I/O Completion Submission command
   CXX_BITFIELD_MEMBER(16, 31, cqid, cdw11); ///< Completion Queue Identifier
+  CXX_BITFIELD_MEMBER(1, 2, qprio, cdw11);  ///< Queue Priority
 
   // Read / Write / Write Zeroes commands
   CXX_BITFIELD_MEMBER(0, 15, nlb, cdw12); ///< Number of Logical Blocks
@@ -110,34 +165,166 @@ struct Cqe
   CXX_BITFIELD_MEMBER_RO(17, 31, sf, dw3); ///< Status Field
 };
 
+struct Request_group;
+
+/**
+ * Per-command context.
+ *
+ * A submission queue preallocates one request slot for each command
+ * identifier. I/O commands keep the client's completion callback and the size
+ * of the transfer directly in the slot, so that producing and completing an
+ * I/O command does not allocate heap memory. Admin commands, which are not
+ * performance critical, use a generic callback instead.
+ */
+struct Request
+{
+  /// Completion callback of an admin command
+  Callback cb;
+  /// Completion callback of an I/O command
+  Block_device::Inout_callback io_cb;
+  /// Number of bytes reported to `io_cb` on success
+  l4_size_t bytes = 0;
+  /// Group of an I/O command that is part of a larger client request
+  Request_group *group = nullptr;
+  /// Statistics of the client of an I/O command that is not part of a group
+  Client_stats *client = nullptr;
+  /// Time stamp of the production of an I/O command [cycles]
+  l4_uint64_t stamp = 0;
+
+  enum { No_prp_page = 0xffff, No_dsm_slot = 0xffff };
+  /// First PRP List page of the command in the pool of the queue
+  l4_uint16_t prp_page = No_prp_page;
+  /// Dataset Management range buffer of the command in the pool of the queue
+  l4_uint16_t dsm_slot = No_dsm_slot;
+
+  bool busy() const
+  { return cb || io_cb || group; }
+};
+
+/**
+ * Context of a client request that is split into several I/O commands.
+ *
+ * The client callback is invoked once, after the last command of the group
+ * completed. Groups are preallocated by the submission queue, like the
+ * request slots.
+ */
+struct Request_group
+{
+  /// Completion callback of the client request
+  Block_device::Inout_callback cb;
+  /// Number of bytes reported to `cb` on success
+  l4_size_t bytes = 0;
+  /// Number of commands of the group that have not completed yet
+  unsigned pending = 0;
+  /// Result of the first command that failed
+  int result = L4_EOK;
+  /// Statistics of the client of the request
+  Client_stats *client = nullptr;
+  /// Time stamp of the start of the request [cycles]
+  l4_uint64_t stamp = 0;
+};
+
 class Queue
 {
 public:
+  /**
+   * Create a queue.
+   *
+   * \param cmb  Controller Memory Buffer to place the queue in. If it is
+   *             nullptr or has no space left, the queue is placed in host
+   *             memory.
+   */
   Queue(l4_uint16_t size, unsigned y, unsigned dstrd,
         L4drivers::Register_block<32> &regs,
         L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma,
-        L4Re::Dma_space::Direction dir)
-  : _size(size), _y(y), _dstrd(dstrd), _regs(regs), _head(0)
+        L4Re::Dma_space::Direction dir, Cmb *cmb = nullptr)
+  : _size(size), _y(y), _dstrd(dstrd), _regs(regs), _head(0), _cmb(nullptr),
+    _cmb_offset(0), _shadow_db(nullptr), _shadow_ei(nullptr)
   {
     _entry_size = (dir == L4Re::Dma_space::Direction::From_device)
                     ? sizeof(Cqe)
                     : sizeof(Sqe);
-    _buf =
-      cxx::make_ref_obj<Inout_buffer>(l4_round_page(size * _entry_size), dma,
-                                      dir, L4Re::Rm::F::Cache_uncached);
-    memset(_buf->get<void *>(), 0, _buf->size());
+    l4_size_t sz = l4_round_page(size * _entry_size);
+    if (cmb && cmb->alloc(sz, &_cmb_offset))
+      {
+        _cmb = cmb;
+        _vaddr = cmb->vaddr(_cmb_offset);
+        _paddr = cmb->paddr(_cmb_offset);
+      }
+    else
+      {
+        _buf = cxx::make_ref_obj<Inout_buffer>(sz, dma, dir,
+                                               L4Re::Rm::F::Cache_uncached);
+        _vaddr = reinterpret_cast<l4_addr_t>(_buf->get<void>());
+        _paddr = _buf->pget();
+      }
+    memset(reinterpret_cast<void *>(_vaddr), 0, sz);
   }
 
-  l4_addr_t phys_base() const { return _buf->pget(); }
+  ~Queue()
+  {
+    if (_cmb)
+      _cmb->free(_cmb_offset, l4_round_page(_size * _entry_size));
+  }
+
+  l4_addr_t phys_base() const { return _paddr; }
 
   l4_uint16_t size() const { return _size; }
 
+  /// Whether the queue is placed in the Controller Memory Buffer
+  bool in_cmb() const { return _cmb; }
+
+  /**
+   * Use the shadow doorbell and EventIdx buffers configured with the Doorbell
+   * Buffer Config command for this queue.
+   *
+   * \param db      Shadow doorbell buffer.
+   * \param ei      EventIdx buffer.
+   * \param offset  Offset of the queue's doorbell register in the doorbell
+   *                register range, which is also the offset of its entries in
+   *                both buffers.
+   */
+  void set_shadow_doorbell(Inout_buffer const &db, Inout_buffer const &ei,
+                           unsigned offset)
+  {
+    _shadow_db = db.get<l4_uint32_t volatile>(offset);
+    _shadow_ei = ei.get<l4_uint32_t volatile>(offset);
+  }
+
 protected:
+    /**
+     * Publish a new doorbell value in the shadow doorbell buffer.
+     *
+     * \return True if the doorbell register must be written as well, i.e.
+     *         there is no shadow doorbell or the controller asked to be
+     *         notified by an EventIdx value between the previous and the new
+     *         doorbell value.
+     */
+    bool update_shadow_doorbell(l4_uint16_t value)
+    {
+      if (!_shadow_db)
+        return true;
+
+      // The queue entries must be visible before the new doorbell value and
+      // the new doorbell value before EventIdx is read.
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      l4_uint16_t old = *_shadow_db;
+      *_shadow_db = value;
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      l4_uint16_t ei = *_shadow_ei;
+
+      return (l4_uint16_t)(value - ei - 1) < (l4_uint16_t)(value - old);
+    }
+
     l4_uint16_t wrap_around(l4_uint16_t i) const
     {
       return i % _size;
     }
 
+    template <class T>
+    T volatile *entry(l4_uint16_t i) const
+    { return reinterpret_cast<T volatile *>(_vaddr + i * _entry_size); }
+
     l4_uint16_t _size;
     l4_size_t _entry_size;
 
@@ -149,6 +336,15 @@ protected:
     l4_uint16_t _head;
 
     cxx::Ref_ptr<Inout_buffer> _buf;
+    Cmb *_cmb;
+    l4_size_t _cmb_offset;
+    l4_addr_t _vaddr;
+    l4_uint64_t _paddr;
+
+    /// Shadow doorbell of the queue, nullptr if not used
+    l4_uint32_t volatile *_shadow_db;
+    /// EventIdx of the queue
+    l4_uint32_t volatile *_shadow_ei;
 };
 
 class Submission_queue : public Queue
@@ -158,11 +354,31 @@ public:
   Submission_queue(l4_uint16_t size, unsigned y, unsigned dstrd,
                    L4drivers::Register_block<32> &regs,
                    L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma,
-                   l4_size_t sgls = 0)
-  : Queue(size, y, dstrd, regs, dma, L4Re::Dma_space::Direction::To_device),
-    _tail(0), _in_flight(0), _free_hint(0)
+                   l4_size_t sgls = 0, l4_size_t dsm_ranges = 0,
+                   Cmb *cmb = nullptr)
+  : Queue(size, y, dstrd, regs, dma, L4Re::Dma_space::Direction::To_device,
+          cmb),
+    _cids(size), _tail(0), _db_tail(0), _plugged(false), _cmds(0),
+    _doorbells(0), _cmd_specific(0), _dsm_ranges(dsm_ranges), _gids(size),
+    _prp_free(sgls ? 0 : Prp_pool_pages),
+    _dsm_free(dsm_ranges ? Dsm_pool_slots : 0), _dsm_per_page(0), _stats(),
+    _trace(nullptr), _last_cid(0), _staged(false)
   {
-    _callbacks.resize(_size);
+    _reqs.resize(_size);
+    _groups.resize(_size);
+
+    if (dsm_ranges)
+      {
+        // The range buffer of a command is described by PRP1 only, so it
+        // must not cross a page boundary.
+        assert(dsm_ranges <= Dsm_ranges);
+        _dsm_per_page = L4_PAGESIZE / (dsm_ranges * sizeof(Dsm_range));
+        _dsm = cxx::make_ref_obj<Inout_buffer>(
+          l4_round_page((Dsm_pool_slots + _dsm_per_page - 1) / _dsm_per_page
+                        * L4_PAGESIZE),
+          dma, L4Re::Dma_space::Direction::To_device,
+          L4Re::Rm::F::Cache_uncached);
+      }
 
     if (sgls)
       {
@@ -170,55 +386,302 @@ public:
           l4_round_page(size * sgls * sizeof(Sgl_desc)), dma,
           L4Re::Dma_space::Direction::To_device, L4Re::Rm::F::Cache_uncached);
       }
-    else if (Prp_list_pages > 0)
+    else
       {
         _prps = cxx::make_ref_obj<Inout_buffer>(
-          size * Prp_list_pages * L4_PAGESIZE, dma,
+          Prp_pool_pages * L4_PAGESIZE, dma,
           L4Re::Dma_space::Direction::To_device, L4Re::Rm::F::Cache_uncached);
+        _prp_next.resize(Prp_pool_pages, Request::No_prp_page);
       }
   }
 
   bool is_full() const { return _head == wrap_around(_tail + 1); }
 
+  /**
+   * Produce a new admin command.
+   *
+   * \param cb  Callback invoked with the status field of the completion.
+   *
+   * \return Zeroed submission queue entry with the CID set or nullptr if the
+   *         queue is full.
+   */
   Sqe volatile *produce(Callback cb)
   {
-    if (is_full() || _in_flight >= _size)
-      return 0;
+    assert(cb);
+    Sqe volatile *sqe = produce_sqe();
+    if (sqe)
+      _reqs[sqe->cid()].cb = std::move(cb);
+    return sqe;
+  }
 
+  /**
+   * Produce a new I/O command.
+   *
+   * Does not allocate heap memory as long as `cb` fits into the small object
+   * buffer of std::function, i.e. captures at most two pointers with
+   * libstdc++.
+   *
+   * \param cb      Client callback invoked on completion.
+   * \param bytes   Number of bytes reported to `cb` on success.
+   * \param client  Statistics of the client, updated on completion.
+   *
+   * \return Zeroed submission queue entry with the CID set or nullptr if the
+   *         queue is full.
+   */
+  Sqe volatile *produce_io(Block_device::Inout_callback const &cb,
+                           l4_size_t bytes, Client_stats *client = nullptr)
+  {
     assert(cb);
-    _in_flight++;
-    l4_uint16_t cid = _free_hint;
-    while (_callbacks[cid])
-      cid = wrap_around(cid + 1);
-    _callbacks[cid] = std::move(cb);
+    Sqe volatile *sqe = produce_sqe();
+    if (sqe)
+      {
+        Request &req = _reqs[sqe->cid()];
+        req.io_cb = cb;
+        req.bytes = bytes;
+        req.client = client;
+        req.stamp = Cycle_clock::now();
+        _stats.started();
+        if (client)
+          client->started();
+      }
+    return sqe;
+  }
 
-    Sqe volatile *sqe = _buf->get<Sqe>(_tail * _entry_size);
-    _tail = wrap_around(_tail + 1);
+  /// Number of commands that can be produced before the queue is full.
+  unsigned free_entries() const
+  {
+    unsigned used = wrap_around(_tail + _size - _head);
+    return cxx::min<unsigned>(_size - 1 - used, _cids.available());
+  }
+
+  /**
+   * Start a request that is split into several I/O commands.
+   *
+   * Allocates a request group only if all commands of the request can be
+   * produced right away, so that a request is never submitted partially.
+   *
+   * \param cb      Client callback invoked once all commands completed.
+   * \param bytes   Number of bytes reported to `cb` on success.
+   * \param cmds    Number of commands the request consists of.
+   * \param client  Statistics of the client, updated on completion.
+   *
+   * \return Request group to pass to produce_grouped() or nullptr if the
+   *         queue does not have enough free entries.
+   */
+  Request_group *alloc_group(Block_device::Inout_callback const &cb,
+                             l4_size_t bytes, unsigned cmds,
+                             Client_stats *client = nullptr)
+  {
+    assert(cb);
+    if (_gids.empty() || free_entries() < cmds)
+      {
+        ++_stats.full;
+        return nullptr;
+      }
+
+    Request_group *g = &_groups[_gids.alloc()];
+    g->cb = cb;
+    g->bytes = bytes;
+    g->pending = 0;
+    g->result = L4_EOK;
+    g->client = client;
+    g->stamp = Cycle_clock::now();
+    if (client)
+      client->started();
+    return g;
+  }
 
-    memset((void *)sqe, 0, sizeof(*sqe));
-    sqe->cid() = cid;
+  /**
+   * Produce a new I/O command that is part of a request group.
+   *
+   * The caller must not produce more commands than announced to
+   * alloc_group().
+   *
+   * \return Zeroed submission queue entry with the CID set.
+   */
+  Sqe volatile *produce_grouped(Request_group *g)
+  {
+    Sqe volatile *sqe = produce_sqe();
+    assert(sqe);
+    Request &req = _reqs[sqe->cid()];
+    req.group = g;
+    req.stamp = g->stamp;
+    ++g->pending;
+    _stats.started();
     return sqe;
   }
 
+  /**
+   * Pass all produced entries to the controller.
+   *
+   * While the queue is plugged, the tail doorbell write is deferred until
+   * unplug().
+   */
   void submit()
   {
-    _regs.r<32>(tdbl()).write(_tail);
+    if (_staged)
+      commit_sqe();
+    if (!_plugged)
+      ring_doorbell();
   }
 
+  /**
+   * Pass the I/O command produced last to the controller.
+   *
+   * Records the command in the trace ring. The callers pass the fields they
+   * wrote into the submission queue entry, so that it is not read back, which
+   * is slow if the queue is placed in the Controller Memory Buffer.
+   *
+   * \param opc   NVMe opcode.
+   * \param slba  Starting LBA of reads, writes and write zeroes.
+   * \param len   Number of logical blocks, or of ranges for Dataset
+   *              Management.
+   */
+  void submit_io(l4_uint8_t opc, l4_uint64_t slba = 0, l4_uint32_t len = 0)
+  {
+    if (_trace)
+      {
+        Request const &req = _reqs[_last_cid];
+        l4_uint16_t group = req.group ? req.group - _groups.data() + 1 : 0;
+        _trace->produce(_last_cid, group, opc, slba, len, req.stamp);
+      }
+    submit();
+  }
+
+  /**
+   * Defer tail doorbell writes.
+   *
+   * Commands produced and submitted while the queue is plugged become visible
+   * to the controller with a single doorbell write in unplug().
+   */
+  void plug()
+  { _plugged = true; }
+
+  /// Write the tail doorbell if there are pending entries and stop deferring.
+  void unplug()
+  {
+    _plugged = false;
+    if (_tail != _db_tail)
+      ring_doorbell();
+  }
+
+  /// Number of commands produced on this queue.
+  unsigned long long cmds() const
+  { return _cmds; }
+
+  /// Number of tail doorbell register writes on this queue.
+  unsigned long long doorbells() const
+  { return _doorbells; }
+
+  /// Statistics of the I/O commands of this queue.
+  Queue_stats const &stats() const
+  { return _stats; }
+
+  Queue_stats &stats()
+  { return _stats; }
+
+  /// Record the life cycle of the I/O commands in `trace`, nullptr to stop.
+  void set_trace(Trace_ring *trace)
+  { _trace = trace; }
+
+  /// Offset of the tail doorbell register
+  unsigned tdbl() const { return 0x1000 + ((2 * _y) * (4 << _dstrd)); }
+
+  /// Number of commands that have been produced but not yet completed.
+  unsigned inflight() const
+  { return _cids.size() - _cids.available(); }
+
   void complete(Cqe volatile *cqe)
   {
     _head = cqe->sqhd();
-    _free_hint = cqe->cid();
-    assert(_in_flight);
-    _in_flight--;
 
-    auto cb = std::move(_callbacks[cqe->cid()]);
-    _callbacks[cqe->cid()] = nullptr;
-    assert(cb);
+    l4_uint16_t cid = cqe->cid();
+    Request &req = _reqs[cid];
+    assert(req.busy());
+
+    free_prp_pages(req);
+    free_dsm_slot(req);
+
+    l4_uint16_t sf = cqe->sf();
+    l4_uint64_t now = 0;
+    if (req.group || req.io_cb)
+      {
+        now = Cycle_clock::now();
+        --_stats.inflight;
+        _stats.latency.add(now - req.stamp);
+        if (sf)
+          _stats.failed(sf);
+      }
+
+    // Move the callback out of the slot first. The callback may produce a new
+    // command that reuses the slot.
+    if (req.group)
+      {
+        Request_group *g = req.group;
+        req.group = nullptr;
+        _cids.free(cid);
+
+        if (sf && g->result == L4_EOK)
+          g->result = -L4_EIO;
+
+        if (--g->pending)
+          return;
+
+        client_done(g->client, now - g->stamp, g->result);
+
+        Block_device::Inout_callback cb;
+        {
+          Alloc_probe probe;
+          cb = std::move(g->cb);
+          g->cb = nullptr;
+        }
+        int result = g->result;
+        l4_size_t bytes = g->bytes;
+        l4_uint16_t gid = g - _groups.data();
+        _gids.free(gid);
+
+        cb(result, result == L4_EOK ? bytes : 0);
+        if (_trace)
+          _trace->add(Trace_event::Callback, cid, gid + 1);
+        return;
+      }
+
+    if (req.io_cb)
+      {
+        client_done(req.client, now - req.stamp, sf ? -L4_EIO : L4_EOK);
+
+        Block_device::Inout_callback cb;
+        l4_size_t bytes;
+        {
+          Alloc_probe probe;
+          cb = std::move(req.io_cb);
+          req.io_cb = nullptr;
+          bytes = req.bytes;
+          _cids.free(cid);
+        }
+
+        cb(sf ? -L4_EIO : L4_EOK, sf ? 0 : bytes);
+        if (_trace)
+          _trace->add(Trace_event::Callback, cid);
+        return;
+      }
+
+    auto cb = std::move(req.cb);
+    req.cb = nullptr;
+    _cids.free(cid);
 
+    _cmd_specific = cqe->dw0;
     cb(cqe->sf());
   }
 
+  /**
+   * Command specific result (DW0) of the most recently completed command.
+   *
+   * Only meaningful when called from within a completion callback.
+   */
+  l4_uint32_t cmd_specific() const
+  { return _cmd_specific; }
+
   l4_addr_t sgls_paddr(l4_uint16_t cid)
   {
     return _sgls->pget((unsigned)cid * Ioq_sgls * sizeof(Sgl_desc));
@@ -229,16 +692,190 @@ public:
     return _sgls->get<Sgl_desc>((unsigned)cid * Ioq_sgls * sizeof(Sgl_desc));
   }
 
+  /// Number of free PRP List pages in the pool of the queue.
+  unsigned prp_pages_available() const
+  { return _prp_free.available(); }
+
+  /**
+   * Allocate PRP List pages for a command from the pool of the queue.
+   *
+   * The pages are returned to the pool when the command completes.
+   *
+   * \param      cid    Command the pages are used by.
+   * \param      n      Number of pages, at most prp_pages_available().
+   * \param[out] pages  Array receiving the `n` allocated pages.
+   */
+  void alloc_prp_pages(l4_uint16_t cid, unsigned n, l4_uint16_t *pages)
+  {
+    assert(n <= _prp_free.available());
+
+    l4_uint16_t *link = &_reqs[cid].prp_page;
+    for (unsigned i = 0; i < n; i++)
+      {
+        pages[i] = _prp_free.alloc();
+        *link = pages[i];
+        link = &_prp_next[pages[i]];
+      }
+    *link = Request::No_prp_page;
+  }
+
+  Prp_list_entry *prp_page(l4_uint16_t page)
+  { return _prps->get<Prp_list_entry>((unsigned)page * L4_PAGESIZE); }
+
+  l4_addr_t prp_page_paddr(l4_uint16_t page)
+  { return _prps->pget((unsigned)page * L4_PAGESIZE); }
+
+  /// Number of Dataset Management ranges available per command.
+  l4_size_t dsm_ranges() const
+  { return _dsm_ranges; }
+
+  /// Number of free Dataset Management range buffers in the pool of the queue.
+  unsigned dsm_slots_available() const
+  { return _dsm_free.available(); }
+
+  /**
+   * Allocate a Dataset Management range buffer for a command from the pool of
+   * the queue.
+   *
+   * The buffer is returned to the pool when the command completes.
+   *
+   * \param cid  Command the buffer is used by.
+   *
+   * \return Buffer to pass to dsm_paddr() and dsm_range().
+   */
+  l4_uint16_t alloc_dsm_slot(l4_uint16_t cid)
+  {
+    assert(!_dsm_free.empty());
+    return _reqs[cid].dsm_slot = _dsm_free.alloc();
+  }
+
+  l4_addr_t dsm_paddr(l4_uint16_t slot)
+  { return _dsm->pget(dsm_offset(slot)); }
+
+  Dsm_range *dsm_range(l4_uint16_t slot)
+  { return _dsm->get<Dsm_range>(dsm_offset(slot)); }
+
 private:
-  std::vector<std::function<void(l4_uint16_t)>> _callbacks;
+  /// Account a completed client request to the statistics of the client.
+  static void client_done(Client_stats *client, l4_uint64_t cycles,
+                          int result)
+  {
+    if (!client)
+      return;
+    --client->inflight;
+    client->latency.add(cycles);
+    if (result != L4_EOK)
+      ++client->errors;
+  }
+
+  void free_prp_pages(Request &req)
+  {
+    for (l4_uint16_t p = req.prp_page; p != Request::No_prp_page;
+         p = _prp_next[p])
+      _prp_free.free(p);
+    req.prp_page = Request::No_prp_page;
+  }
+
+  void free_dsm_slot(Request &req)
+  {
+    if (req.dsm_slot != Request::No_dsm_slot)
+      _dsm_free.free(req.dsm_slot);
+    req.dsm_slot = Request::No_dsm_slot;
+  }
+
+  /// Offset of a range buffer, the buffers are packed into whole pages.
+  l4_size_t dsm_offset(l4_uint16_t slot) const
+  {
+    return (l4_size_t)(slot / _dsm_per_page) * L4_PAGESIZE
+           + (slot % _dsm_per_page) * _dsm_ranges * sizeof(Dsm_range);
+  }
+
+  /**
+   * Start a new entry in the staging buffer.
+   *
+   * The entry is filled in host memory and only copied into the queue by
+   * submit(), so that filling it in never reads from the queue memory, which
+   * is a round trip over PCIe if the queue is placed in the Controller Memory
+   * Buffer. Each produced entry must be submitted before the next one is
+   * produced.
+   */
+  Sqe volatile *produce_sqe()
+  {
+    if (is_full() || _cids.empty())
+      return 0;
+
+    assert(!_staged);
+    l4_uint16_t cid = _cids.alloc();
+    assert(!_reqs[cid].busy());
+    ++_cmds;
+    _last_cid = cid;
+    _staged = true;
+
+    memset(&_stage, 0, sizeof(_stage));
+    _stage.cid() = cid;
+    return &_stage;
+  }
+
+  /// Copy the staged entry into the queue with write accesses only.
+  void commit_sqe()
+  {
+    auto const *src = reinterpret_cast<l4_uint64_t const *>(&_stage);
+    auto volatile *dst =
+      reinterpret_cast<l4_uint64_t volatile *>(entry<Sqe>(_tail));
+    for (unsigned i = 0; i < sizeof(Sqe) / sizeof(l4_uint64_t); ++i)
+      dst[i] = src[i];
+
+    _tail = wrap_around(_tail + 1);
+    _staged = false;
+  }
+
+  void ring_doorbell()
+  {
+    _db_tail = _tail;
+    if (update_shadow_doorbell(_tail))
+      {
+        _regs.r<32>(tdbl()).write(_tail);
+        ++_doorbells;
+      }
+    if (_trace)
+      _trace->add(Trace_event::Doorbell, 0, 0, _tail);
+  }
+
+  std::vector<Request> _reqs;
   cxx::Ref_ptr<Inout_buffer> _sgls;
   cxx::Ref_ptr<Inout_buffer> _prps;
+  cxx::Ref_ptr<Inout_buffer> _dsm;
 
-  unsigned tdbl() const { return 0x1000 + ((2 * _y) * (4 << _dstrd)); }
-
+  Cid_allocator _cids;
   l4_uint16_t _tail;
-  l4_uint16_t _in_flight;
-  l4_uint16_t _free_hint;
+  /// Tail value last written to the doorbell
+  l4_uint16_t _db_tail;
+  bool _plugged;
+  unsigned long long _cmds;
+  unsigned long long _doorbells;
+  l4_uint32_t _cmd_specific;
+  l4_size_t _dsm_ranges;
+  std::vector<Request_group> _groups;
+  /// Free request groups
+  Cid_allocator _gids;
+  /// Free PRP List pages
+  Cid_allocator _prp_free;
+  /// Next PRP List page of the same command
+  std::vector<l4_uint16_t> _prp_next;
+  /// Free Dataset Management range buffers
+  Cid_allocator _dsm_free;
+  /// Number of range buffers per page
+  unsigned _dsm_per_page;
+  /// Statistics of the I/O commands
+  Queue_stats _stats;
+  /// Trace ring, nullptr if tracing is disabled
+  Trace_ring *_trace;
+  /// Command identifier of the command produced last
+  l4_uint16_t _last_cid;
+  /// Entry being filled in before it is copied into the queue
+  Sqe _stage;
+  /// Whether `_stage` holds an entry not yet copied into the queue
+  bool _staged;
 };
 
 
@@ -249,29 +886,62 @@ public:
                    L4drivers::Register_block<32> &regs,
                    L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma)
   : Queue(size, y, dstrd, regs, dma, L4Re::Dma_space::Direction::From_device),
-    _p(true)
+    _p(true), _db_head(0), _doorbells(0), _trace(nullptr)
   {
   }
 
   Cqe volatile *consume()
   {
-    Cqe volatile *cqe = _buf->get<Cqe>(_head * _entry_size);
+    Cqe volatile *cqe = entry<Cqe>(_head);
     if (cqe->p() == _p)
       {
         _head = wrap_around(_head + 1);
         if (!_head)
           _p = !_p;
+        if (_trace)
+          _trace->cqe(cqe->cid(), cqe->sf());
         return cqe;
       }
     return 0;
   }
 
-  void complete() { _regs.r<32>(hdbl()).write(_head); }
+  /**
+   * Release all consumed entries to the controller.
+   *
+   * Writes the head doorbell only if entries were consumed since the last
+   * call, so that a whole drain of the queue costs a single MMIO write.
+   */
+  void complete()
+  {
+    if (_head == _db_head)
+      return;
 
-private:
+    _db_head = _head;
+    if (update_shadow_doorbell(_head))
+      {
+        _regs.r<32>(hdbl()).write(_head);
+        ++_doorbells;
+      }
+  }
+
+  /// Number of head doorbell register writes on this queue.
+  unsigned long long doorbells() const
+  { return _doorbells; }
+
+  /// Offset of the head doorbell register
   unsigned hdbl() const { return 0x1000 + ((2 * _y + 1) * (4 << _dstrd)); }
 
+  /// Record the observed completions in `trace`, nullptr to stop.
+  void set_trace(Trace_ring *trace)
+  { _trace = trace; }
+
+private:
   bool _p;
+  /// Head value last written to the doorbell
+  l4_uint16_t _db_head;
+  unsigned long long _doorbells;
+  /// Trace ring, nullptr if tracing is disabled
+  Trace_ring *_trace;
 };
 
 }
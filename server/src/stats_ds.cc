@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <cstring>
+
+#include <l4/re/error_helper>
+#include <l4/sys/kip>
+
+#include "stats_ds.h"
+#include "debug.h"
+
+static Dbg warn(Dbg::Warn, "stats");
+
+Nvme::Stats_ds::Stats_ds(L4::Ipc_svr::Server_iface *sif)
+: _sif(sif), _timeout(this), _used(0), _warned(false)
+{
+  _ds = L4Re::chkcap(L4Re::Util::make_unique_cap<L4Re::Dataspace>(),
+                     "Allocate dataspace capability for statistics.");
+
+  auto *e = L4Re::Env::env();
+  L4Re::chksys(e->mem_alloc()->alloc(Size, _ds.get()),
+               "Allocate statistics memory.");
+
+  L4Re::chksys(e->rm()->attach(&_region, Size,
+                               L4Re::Rm::F::Search_addr | L4Re::Rm::F::RW,
+                               L4::Ipc::make_cap_rw(_ds.get()), 0,
+                               L4_PAGESHIFT),
+               "Attach statistics memory.");
+
+  auto *hdr = reinterpret_cast<Stats_header *>(_region.get());
+  hdr->entry_size = sizeof(Stats_entry);
+  hdr->max_entries = (Size - sizeof(Stats_header)) / sizeof(Stats_entry);
+  hdr->version = Stats_header::Version;
+  // Readers check the magic first, write it last.
+  __atomic_store_n(&hdr->magic, Stats_header::Magic, __ATOMIC_RELEASE);
+
+  arm_timeout();
+}
+
+void
+Nvme::Stats_ds::arm_timeout()
+{
+  if (!_sif)
+    return;
+
+  _sif->add_timeout(&_timeout, l4_kip_clock(l4re_kip()) + Publish_us);
+}
+
+void
+Nvme::Stats_ds::publish_expired()
+{
+  publish();
+  arm_timeout();
+}
+
+Nvme::Stats_entry *
+Nvme::Stats_ds::entry(Nvme_device const *dev, Stats_entry::Kind kind)
+{
+  auto *hdr = reinterpret_cast<Stats_header *>(_region.get());
+  if (_used >= hdr->max_entries)
+    {
+      if (!_warned)
+        warn.printf("Statistics dataspace full, omitting entries.\n");
+      _warned = true;
+      return nullptr;
+    }
+
+  auto *e = reinterpret_cast<Stats_entry *>(hdr + 1) + _used++;
+  memset(e, 0, sizeof(*e));
+  e->kind = kind;
+  strncpy(e->name, dev->hid().c_str(), sizeof(e->name) - 1);
+  return e;
+}
+
+void
+Nvme::Stats_ds::publish()
+{
+  auto *hdr = reinterpret_cast<Stats_header *>(_region.get());
+
+  // Seqlock write side: make the sequence counter odd before touching the
+  // contents and even again once they are complete.
+  l4_uint64_t seq = hdr->seq;
+  __atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  _used = 0;
+  for (auto const &dev : _devs)
+    {
+      Stats_entry *e = entry(dev.get(), Stats_entry::Client);
+      if (e)
+        e->client = dev->stats();
+
+      e = entry(dev.get(), Stats_entry::Namespace);
+      if (e)
+        e->queue = dev->ns_stats();
+
+      for (auto const &qp : dev->ns().queue_pairs())
+        {
+          e = entry(dev.get(), Stats_entry::Queue);
+          if (!e)
+            break;
+          e->qid = qp->qid();
+          e->prio = qp->prio();
+          e->queue = qp->sq->stats();
+        }
+    }
+
+  hdr->num_entries = _used;
+  hdr->timestamp_us = l4_kip_clock(l4re_kip());
+  hdr->cycles_per_ms = 1000.0 / Cycle_clock::us_per_cycle();
+
+  __atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/re/env>
+#include <l4/re/rm>
+#include <l4/re/util/unique_cap>
+#include <l4/cxx/ref_ptr>
+
+#include <vector>
+
+#include <l4/nvme-driver/stats.h>
+
+#include "nvme_device.h"
+#include "timeout.h"
+
+namespace Nvme {
+
+/**
+ * Dataspace into which the statistics of all namespaces are published for
+ * monitoring tasks.
+ *
+ * The statistics are copied into the dataspace periodically from the server
+ * loop, so the I/O path only updates its own counters and monitoring does not
+ * need any IPC with the driver. See <l4/nvme-driver/stats.h> for the layout
+ * and the protocol readers follow.
+ */
+class Stats_ds
+{
+public:
+  enum
+  {
+    /// Size of the dataspace [bytes]
+    Size = 256 << 10,
+    /// Interval between two updates of the dataspace [us]
+    Publish_us = 100000,
+  };
+
+  /**
+   * Allocate the dataspace and start publishing.
+   *
+   * \param sif  Server interface used to queue the publish timeout.
+   */
+  explicit Stats_ds(L4::Ipc_svr::Server_iface *sif);
+
+  Stats_ds(Stats_ds const &) = delete;
+  Stats_ds &operator=(Stats_ds const &) = delete;
+
+  /// Include the statistics of the given device from the next update on.
+  void add(cxx::Ref_ptr<Nvme_device> const &dev)
+  { _devs.push_back(dev); }
+
+  /// Copy the current statistics of all devices into the dataspace.
+  void publish();
+
+  /// Dataspace to be handed out read-only to monitoring tasks.
+  L4::Cap<L4Re::Dataspace> ds() const
+  { return _ds.get(); }
+
+private:
+  void arm_timeout();
+  /// Publish the statistics and queue the next update.
+  void publish_expired();
+
+  /**
+   * Return the next free entry initialized for the given device or nullptr if
+   * the dataspace is full.
+   */
+  Stats_entry *entry(Nvme_device const *dev, Stats_entry::Kind kind);
+
+  L4::Ipc_svr::Server_iface *_sif;
+  L4Re::Util::Unique_cap<L4Re::Dataspace> _ds;
+  L4Re::Rm::Unique_region<char *> _region;
+  /// Timeout that publishes the statistics periodically
+  Member_timeout<Stats_ds, &Stats_ds::publish_expired> _timeout;
+  std::vector<cxx::Ref_ptr<Nvme_device>> _devs;
+  /// Number of entries filled by the current update
+  unsigned _used;
+  bool _warned;
+};
+
+}
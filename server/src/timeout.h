@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/sys/cxx/ipc_timeout_queue>
+
+namespace Nvme {
+
+/**
+ * Timeout of the server loop that calls a member function of its owner.
+ *
+ * \tparam T   Class of the owner.
+ * \tparam Fn  Member function called when the timeout expires. It may queue
+ *             the timeout again.
+ */
+template<typename T, void (T::*Fn)()>
+class Member_timeout : public L4::Ipc_svr::Timeout
+{
+public:
+  explicit Member_timeout(T *owner) : _owner(owner) {}
+
+  void expired() override
+  { (_owner->*Fn)(); }
+
+private:
+  T *_owner;
+};
+
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+#include <l4/cxx/minmax>
+
+namespace Nvme {
+
+/**
+ * Token bucket rate limiter.
+ *
+ * The bucket is refilled with `rate` tokens per second up to the amount of
+ * `Burst_us` microseconds worth of tokens. A request may start as long as the
+ * bucket is not empty and takes all the tokens it needs, leaving the bucket
+ * in debt if necessary. That way requests larger than the bucket still make
+ * progress while the average rate stays at the limit.
+ */
+class Token_bucket
+{
+public:
+  enum : l4_uint64_t
+  {
+    Burst_us = 100000, ///< Capacity of the bucket [us worth of tokens]
+    Us_per_s = 1000000,
+    /**
+     * Highest supported rate [tokens/s]. Leaves room for the scaled tokens of
+     * a full bucket, a refill and the debt of a request in `l4_int64_t`.
+     */
+    Max_rate = (1ULL << 61) / Burst_us,
+  };
+
+  Token_bucket() : _rate(0), _tokens(0), _last(0) {}
+
+  /**
+   * Set the rate of the bucket and fill it.
+   *
+   * \param rate  Tokens per second, 0 to disable the limit. Rates above
+   *              `Max_rate` are reduced to it.
+   * \param now   Current time [us].
+   */
+  void set_rate(l4_uint64_t rate, l4_cpu_time_t now)
+  {
+    _rate = cxx::min<l4_uint64_t>(rate, Max_rate);
+    _tokens = capacity();
+    _last = now;
+  }
+
+  /// Whether the bucket limits the rate at all
+  bool limited() const
+  { return _rate; }
+
+  /// Add the tokens accumulated since the last refill.
+  void refill(l4_cpu_time_t now)
+  {
+    if (!_rate || now <= _last)
+      return;
+
+    l4_uint64_t elapsed = now - _last;
+    _last = now;
+    // Only count the time it takes to pay off the debt and fill the bucket, so
+    // that a long idle period neither overflows nor forgives any debt.
+    l4_uint64_t debt = _tokens < 0 ? -_tokens : 0;
+    elapsed = cxx::min<l4_uint64_t>(elapsed, Burst_us + debt / _rate + 1);
+    if ((_tokens += (l4_int64_t)(_rate * elapsed)) > capacity())
+      _tokens = capacity();
+  }
+
+  /// Whether a request may start now
+  bool available() const
+  { return !_rate || _tokens > 0; }
+
+  /// Take `n` tokens out of the bucket.
+  void consume(l4_uint64_t n)
+  {
+    if (_rate)
+      _tokens -= (l4_int64_t)(n * Us_per_s);
+  }
+
+  /// Time until a request may start [us]
+  l4_uint64_t wait_us() const
+  { return available() ? 0 : (l4_uint64_t)(-_tokens) / _rate + 1; }
+
+private:
+  l4_int64_t capacity() const
+  { return _rate * Burst_us; }
+
+  /// Tokens per second
+  l4_uint64_t _rate;
+  /// Tokens in the bucket, scaled by `Us_per_s`
+  l4_int64_t _tokens;
+  /// Time of the last refill [us]
+  l4_cpu_time_t _last;
+};
+
+}
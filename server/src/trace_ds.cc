@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <cstring>
+#include <string>
+
+#include <l4/re/error_helper>
+#include <l4/sys/kip>
+
+#include "trace_ds.h"
+#include "ctl.h"
+#include "debug.h"
+
+static Dbg trace(Dbg::Trace, "trace");
+static Dbg warn(Dbg::Warn, "trace");
+
+Nvme::Trace_ds::Trace_ds(unsigned entries, L4::Ipc_svr::Server_iface *sif)
+: _sif(sif), _entries(entries),
+  _ring_size(sizeof(Trace_ring_header) + entries * sizeof(Trace_event)),
+  _timeout(this)
+{
+  assert(entries >= Min_entries && entries <= Max_entries);
+  assert(!(entries & (entries - 1)));
+
+  l4_size_t size = l4_round_page(sizeof(Trace_header)
+                                 + Max_rings * _ring_size);
+
+  _ds = L4Re::chkcap(L4Re::Util::make_unique_cap<L4Re::Dataspace>(),
+                     "Allocate dataspace capability for trace rings.");
+
+  auto *e = L4Re::Env::env();
+  L4Re::chksys(e->mem_alloc()->alloc(size, _ds.get()),
+               "Allocate trace ring memory.");
+
+  L4Re::chksys(e->rm()->attach(&_region, size,
+                               L4Re::Rm::F::Search_addr | L4Re::Rm::F::RW,
+                               L4::Ipc::make_cap_rw(_ds.get()), 0,
+                               L4_PAGESHIFT),
+               "Attach trace ring memory.");
+
+  Trace_header *hdr = header();
+  hdr->version = Trace_header::Version;
+  hdr->ring_entries = entries;
+  hdr->ring_size = _ring_size;
+  hdr->entry_size = sizeof(Trace_event);
+  // Readers check the magic first, write it last.
+  __atomic_store_n(&hdr->magic, Trace_header::Magic, __ATOMIC_RELEASE);
+
+  trace.printf("Tracing %u events per I/O queue pair.\n", entries);
+  arm_timeout();
+}
+
+void
+Nvme::Trace_ds::add(Namespace *ns)
+{
+  std::string name = ns->ctl().sn() + ":n" + std::to_string(ns->nsid());
+  for (auto const &qp : ns->queue_pairs())
+    {
+      if (_rings.size() >= Max_rings)
+        {
+          warn.printf("%s: No trace ring left for I/O queue %u.\n",
+                      name.c_str(), qp->qid());
+          continue;
+        }
+
+      auto *r = reinterpret_cast<Trace_ring_header *>(
+        _region.get() + sizeof(Trace_header) + _rings.size() * _ring_size);
+      r->nsid = ns->nsid();
+      r->qid = qp->qid();
+      r->prio = qp->prio();
+      strncpy(r->name, name.c_str(), sizeof(r->name) - 1);
+
+      _rings.push_back(cxx::make_unique<Trace_ring>(r, _entries));
+      qp->set_trace(_rings.back().get());
+      __atomic_store_n(&header()->num_rings, _rings.size(), __ATOMIC_RELEASE);
+    }
+}
+
+void
+Nvme::Trace_ds::update_rate()
+{
+  header()->cycles_per_ms = 1000.0 / Cycle_clock::us_per_cycle();
+}
+
+void
+Nvme::Trace_ds::rate_expired()
+{
+  update_rate();
+  arm_timeout();
+}
+
+void
+Nvme::Trace_ds::arm_timeout()
+{
+  if (!_sif)
+    return;
+
+  _sif->add_timeout(&_timeout, l4_kip_clock(l4re_kip()) + Rate_update_us);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/re/env>
+#include <l4/re/rm>
+#include <l4/re/util/unique_cap>
+
+#include <vector>
+
+#include <l4/nvme-driver/trace.h>
+
+#include "ns.h"
+#include "timeout.h"
+#include "trace_ring.h"
+
+namespace Nvme {
+
+/**
+ * Dataspace holding the command trace rings of the I/O queue pairs.
+ *
+ * Each queue pair added gets a ring of its own, into which the queues write
+ * directly. See <l4/nvme-driver/trace.h> for the layout.
+ */
+class Trace_ds
+{
+public:
+  enum
+  {
+    /// Maximum number of traced queue pairs
+    Max_rings = 64,
+    /// Minimum number of events per ring
+    Min_entries = 16,
+    /// Maximum number of events per ring
+    Max_entries = 16384,
+    /// Interval between two updates of the cycle counter rate [us]
+    Rate_update_us = 1000000,
+  };
+
+  /**
+   * Allocate the dataspace.
+   *
+   * \param entries  Number of events per ring, a power of two between
+   *                 Min_entries and Max_entries.
+   * \param sif      Server interface used to queue the rate update timeout.
+   */
+  Trace_ds(unsigned entries, L4::Ipc_svr::Server_iface *sif);
+
+  Trace_ds(Trace_ds const &) = delete;
+  Trace_ds &operator=(Trace_ds const &) = delete;
+
+  /// Start tracing the commands of all I/O queue pairs of the namespace.
+  void add(Namespace *ns);
+
+  /// Dataspace to be handed out read-only to monitoring tasks.
+  L4::Cap<L4Re::Dataspace> ds() const
+  { return _ds.get(); }
+
+  /// Refresh the rate of the cycle counter in the header.
+  void update_rate();
+
+private:
+  void arm_timeout();
+  /// Refresh the rate and queue the next update.
+  void rate_expired();
+
+  Trace_header *header() const
+  { return reinterpret_cast<Trace_header *>(_region.get()); }
+
+  L4::Ipc_svr::Server_iface *_sif;
+  unsigned _entries;
+  l4_size_t _ring_size;
+  L4Re::Util::Unique_cap<L4Re::Dataspace> _ds;
+  L4Re::Rm::Unique_region<char *> _region;
+  /// Timeout that refreshes the rate of the cycle counter in the header
+  Member_timeout<Trace_ds, &Trace_ds::rate_expired> _timeout;
+  std::vector<cxx::unique_ptr<Trace_ring>> _rings;
+};
+
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+#include <l4/nvme-driver/trace.h>
+
+#include "io_stats.h"
+
+namespace Nvme {
+
+/**
+ * Writer of the trace ring of an I/O queue pair.
+ *
+ * The queues hold a pointer to the ring of their pair, which is nullptr unless
+ * tracing is enabled, so the disabled trace points cost a test of that
+ * pointer.
+ */
+class Trace_ring
+{
+public:
+  /**
+   * \param hdr      Ring in the trace dataspace.
+   * \param entries  Number of events of the ring, a power of two.
+   */
+  Trace_ring(Trace_ring_header *hdr, unsigned entries)
+  : _hdr(hdr), _events(reinterpret_cast<Trace_event *>(hdr + 1)),
+    _mask(entries - 1), _pos(0)
+  {}
+
+  /// Record an event, overwriting the oldest one if the ring is full.
+  void add(Trace_event::Type type, l4_uint16_t cid, l4_uint16_t group = 0,
+           l4_uint32_t len = 0, l4_uint64_t stamp = Cycle_clock::now())
+  {
+    Trace_event *e = &_events[_pos & _mask];
+    e->stamp = stamp;
+    e->slba = 0;
+    e->len = len;
+    e->cid = cid;
+    e->group = group;
+    e->type = type;
+    e->opc = 0;
+    e->status = 0;
+    publish();
+  }
+
+  /// Record the production of a command.
+  void produce(l4_uint16_t cid, l4_uint16_t group, l4_uint8_t opc,
+               l4_uint64_t slba, l4_uint32_t len, l4_uint64_t stamp)
+  {
+    Trace_event *e = &_events[_pos & _mask];
+    e->stamp = stamp;
+    e->slba = slba;
+    e->len = len;
+    e->cid = cid;
+    e->group = group;
+    e->type = Trace_event::Produce;
+    e->opc = opc;
+    e->status = 0;
+    publish();
+  }
+
+  /// Record an observed completion queue entry.
+  void cqe(l4_uint16_t cid, l4_uint16_t sf)
+  {
+    Trace_event *e = &_events[_pos & _mask];
+    e->stamp = Cycle_clock::now();
+    e->slba = 0;
+    e->len = 0;
+    e->cid = cid;
+    e->group = 0;
+    e->type = Trace_event::Cqe;
+    e->opc = 0;
+    e->status = sf;
+    publish();
+  }
+
+private:
+  /// Make the event written last visible to readers.
+  void publish()
+  { __atomic_store_n(&_hdr->pos, ++_pos, __ATOMIC_RELEASE); }
+
+  Trace_ring_header *_hdr;
+  Trace_event *_events;
+  l4_uint64_t _mask;
+  /// Private copy of the position, readers cannot change it
+  l4_uint64_t _pos;
+};
+
+}
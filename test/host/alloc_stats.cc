@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+/*
+ * Heap allocation accounting of the driver, see alloc_stats.h. Only linked
+ * into the host tests, the driver itself keeps the default operator new.
+ */
+
+#include <cstdlib>
+#include <new>
+
+#include "alloc_stats.h"
+#include "debug.h"
+
+namespace Nvme {
+
+unsigned long long Alloc_stats::allocs = 0;
+unsigned long long Alloc_stats::io_path_allocs = 0;
+
+void
+Alloc_stats::io_path_alloc_detected(unsigned long long n)
+{
+  // Only report the first occurrence, the counter keeps track of the rest.
+  if (!io_path_allocs)
+    Dbg::warn().printf("Heap allocation on the I/O path detected.\n");
+  io_path_allocs += n;
+}
+
+}
+
+void *
+operator new(std::size_t size)
+{
+  ++Nvme::Alloc_stats::allocs;
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void
+operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void
+operator delete(void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
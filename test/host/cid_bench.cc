@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+/*
+ * Micro-benchmark of the command identifier allocation.
+ *
+ * Simulates a submission queue of a given depth that is kept close to full
+ * while the controller completes the outstanding commands in random order.
+ * Each iteration either produces a command (allocates a CID) or completes a
+ * random outstanding one (releases its CID). The benchmark compares the
+ * Cid_allocator used by Submission_queue with the linear scan it replaced
+ * and measures the whole submission queue path the allocator is part of:
+ * Submission_queue::produce_io(), submit() and complete(), with a register
+ * block that drops the doorbell writes.
+ *
+ * Output is one line per allocator and depth:
+ *   cid-bench alloc=<stack|linear|queue> depth=<n> ops=<n> ns/op=<x>
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "cid_allocator.h"
+#include "queue.h"
+
+namespace {
+
+/// The allocator Submission_queue::produce used before, for reference.
+class Linear_scan_allocator
+{
+public:
+  explicit Linear_scan_allocator(l4_uint16_t size)
+  : _used(size, false), _hint(0), _avail(size)
+  {}
+
+  bool empty() const
+  { return _avail == 0; }
+
+  l4_uint16_t alloc()
+  {
+    l4_uint16_t cid = _hint;
+    while (_used[cid])
+      cid = (cid + 1) % _used.size();
+    _used[cid] = true;
+    --_avail;
+    return cid;
+  }
+
+  void free(l4_uint16_t cid)
+  {
+    _used[cid] = false;
+    _hint = cid;
+    ++_avail;
+  }
+
+private:
+  std::vector<bool> _used;
+  l4_uint16_t _hint;
+  unsigned _avail;
+};
+
+/// Register block that ignores writes, standing in for the doorbells.
+class Null_regs : public L4drivers::Register_block_base<32>
+{
+public:
+  l4_uint32_t read32(l4_addr_t) const override { return 0; }
+  void write32(l4_addr_t, l4_uint32_t) const override {}
+};
+
+/**
+ * Submission queue used like an allocator: alloc() produces and submits a
+ * read command, free() completes it the way the completion queue handler
+ * does.
+ */
+class Queue_path
+{
+public:
+  explicit Queue_path(l4_uint16_t size)
+  : _blk(&_regs), _sq(size, 1, 0, _blk,
+                      L4Re::Util::make_shared_cap<L4Re::Dma_space>()),
+    _size(size), _tail(0), _done(0)
+  {}
+
+  bool empty() const
+  { return !_sq.free_entries(); }
+
+  l4_uint16_t alloc()
+  {
+    unsigned long *done = &_done;
+    auto *sqe = _sq.produce_io(
+      [done](int, l4_size_t) { ++*done; }, 4096);
+    sqe->opc() = Nvme::Iocs::Read;
+    sqe->nsid = 1;
+    sqe->cdw10 = _tail;
+    sqe->nlb() = 7;
+    _sq.submit();
+    _tail = (_tail + 1) % _size;
+    return sqe->cid();
+  }
+
+  void free(l4_uint16_t cid)
+  {
+    // The controller fetched all produced commands.
+    Nvme::Queue::Cqe cqe;
+    cqe.dw0 = 0;
+    cqe.dw1 = 0;
+    cqe.dw2 = _tail | 1U << 16;
+    cqe.dw3 = cid;
+    _sq.complete(&cqe);
+  }
+
+private:
+  Null_regs _regs;
+  L4drivers::Register_block<32> _blk;
+  Nvme::Queue::Submission_queue _sq;
+  l4_uint16_t _size;
+  l4_uint16_t _tail;
+  unsigned long _done;
+};
+
+template <typename ALLOC>
+double
+run(unsigned depth, unsigned long ops, unsigned seed, bool *ok)
+{
+  ALLOC cids(depth);
+  std::vector<l4_uint16_t> outstanding;
+  std::vector<bool> in_use(depth, false);
+  std::mt19937 rng(seed);
+
+  outstanding.reserve(depth);
+
+  // Pre-generate the random decisions so they do not show up in the timing.
+  std::vector<l4_uint32_t> rnd(ops);
+  for (auto &r : rnd)
+    r = rng();
+
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < ops; i++)
+    {
+      // Keep the queue between half full and full, so that completions
+      // happen far away from the allocation hint.
+      bool produce = !cids.empty()
+                     && (outstanding.size() < depth / 2 || (rnd[i] & 1));
+      if (produce)
+        {
+          l4_uint16_t cid = cids.alloc();
+          if (cid >= depth || in_use[cid])
+            *ok = false;
+          in_use[cid] = true;
+          outstanding.push_back(cid);
+        }
+      else
+        {
+          unsigned idx = (rnd[i] >> 1) % outstanding.size();
+          l4_uint16_t cid = outstanding[idx];
+          outstanding[idx] = outstanding.back();
+          outstanding.pop_back();
+          in_use[cid] = false;
+          cids.free(cid);
+        }
+    }
+  auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned long ops = 2000000;
+  bool linear = true;
+
+  for (int i = 1; i < argc; i++)
+    {
+      if (!strcmp(argv[i], "--quick"))
+        ops = 100000;
+      else if (!strcmp(argv[i], "--no-linear"))
+        linear = false;
+      else
+        {
+          fprintf(stderr, "Usage: %s [--quick] [--no-linear]\n", argv[0]);
+          return 2;
+        }
+    }
+
+  bool ok = true;
+  for (unsigned depth = 32; depth <= 4096; depth *= 2)
+    {
+      double ns = run<Nvme::Queue::Cid_allocator>(depth, ops, depth, &ok);
+      printf("cid-bench alloc=stack depth=%u ops=%lu ns/op=%.2f\n",
+             depth, ops, ns);
+
+      ns = run<Queue_path>(depth, ops, depth, &ok);
+      printf("cid-bench alloc=queue depth=%u ops=%lu ns/op=%.2f\n",
+             depth, ops, ns);
+
+      if (linear)
+        {
+          ns = run<Linear_scan_allocator>(depth, ops, depth, &ok);
+          printf("cid-bench alloc=linear depth=%u ops=%lu ns/op=%.2f\n",
+                 depth, ops, ns);
+        }
+    }
+
+  if (!ok)
+    {
+      printf("cid-bench: FAILED, duplicate or out-of-range CID handed out\n");
+      return 1;
+    }
+
+  return 0;
+}
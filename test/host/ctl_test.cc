@@ -0,0 +1,1274 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+/*
+ * Tests of the driver against simulated NVMe controllers.
+ *
+ * Each test brings up one or more simulated controllers the way the driver's
+ * device discovery does and then issues block requests through Nvme_device.
+ * Data written is checked in the backing store of the simulated namespace
+ * and after reading it back. The simulated controller fails the test if the
+ * driver violates the specification, see nvme_sim.h.
+ *
+ * Output is one line per test:
+ *   ctl-test <name>: ok|FAILED
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ctl.h"
+#include "ns.h"
+#include "nvme_device.h"
+#include "stats_ds.h"
+#include "trace_ds.h"
+#include "alloc_stats.h"
+
+#include "host_env.h"
+#include "nvme_sim.h"
+
+namespace {
+
+unsigned failed_checks;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+bool
+check(bool ok, char const *what, char const *file, int line)
+{
+  if (!ok)
+    {
+      ++failed_checks;
+      fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    }
+  return ok;
+}
+
+/// Driver options changed by the tests, restored after each test.
+struct Options
+{
+  unsigned ioqs = Nvme::Ctl::ioqs;
+  unsigned ioq_size_cfg = Nvme::Ctl::ioq_size_cfg;
+  bool use_sgls = Nvme::Ctl::use_sgls;
+  bool use_dbbuf = Nvme::Ctl::use_dbbuf;
+  bool use_wrr = Nvme::Ctl::use_wrr;
+  unsigned poll_us = Nvme::Ctl::poll_us;
+
+  ~Options()
+  {
+    Nvme::Ctl::ioqs = ioqs;
+    Nvme::Ctl::ioq_size_cfg = ioq_size_cfg;
+    Nvme::Ctl::use_sgls = use_sgls;
+    Nvme::Ctl::use_dbbuf = use_dbbuf;
+    Nvme::Ctl::use_wrr = use_wrr;
+    Nvme::Ctl::poll_us = poll_us;
+    Nvme::Nvme_device::set_server_iface(nullptr);
+  }
+};
+
+/**
+ * Simulated controllers with the driver on top.
+ *
+ * Members are destroyed in reverse order: the devices before the namespaces
+ * and controllers they refer to, the controllers before the simulation.
+ */
+struct Env
+{
+  Host::Loop loop;
+  L4::Icu icu;
+  cxx::Ref_ptr<Nvme::Icu> nvme_icu;
+  L4Re::Util::Shared_cap<L4Re::Dma_space> dma;
+  std::vector<std::unique_ptr<Sim::Controller>> sims;
+  std::vector<std::unique_ptr<Nvme::Ctl>> ctls;
+  std::vector<cxx::Ref_ptr<Nvme::Nvme_device>> devs;
+
+  Env()
+  {
+    Block_device::Errand::set_server_iface(&loop);
+    nvme_icu = cxx::make_ref_obj<Nvme::Icu>(L4::Cap<L4::Icu>(&icu));
+    dma = L4Re::Util::make_shared_cap<L4Re::Dma_space>();
+  }
+
+  Sim::Controller *add(Sim::Config cfg)
+  {
+    unsigned i = sims.size();
+    cfg.irq += i;
+    cfg.bar += i * 0x100000;
+    if (cfg.serial == "SIM0")
+      cfg.serial = "SIM" + std::to_string(i);
+    sims.push_back(std::make_unique<Sim::Controller>(cfg, &icu));
+    loop.add_device(sims.back().get());
+    return sims.back().get();
+  }
+
+  /**
+   * Bring up all controllers concurrently like the driver's device discovery.
+   *
+   * \return Number of controllers that became ready.
+   */
+  unsigned bring_up()
+  {
+    unsigned pending = 0;
+    unsigned ready = 0;
+
+    for (auto &sim : sims)
+      {
+        ctls.push_back(std::make_unique<Nvme::Ctl>(sim->pci_dev(), nvme_icu,
+                                                   loop.registry(), dma));
+        Nvme::Ctl *ct = ctls.back().get();
+
+        ++pending;
+        ct->enable([=, &pending, &ready](bool ok) {
+          if (!ok)
+            {
+              --pending;
+              return;
+            }
+
+          ++ready;
+          ct->register_interrupt_handler();
+          ct->identify(
+            [=](cxx::unique_ptr<Nvme::Namespace> ns) {
+              devs.push_back(cxx::make_ref_obj<Nvme::Nvme_device>(ns.get()));
+              ct->add_ns(cxx::move(ns));
+            },
+            [&pending]() { --pending; });
+        });
+      }
+
+    loop.run_until([&]() { return !pending; });
+    CHECK(!pending);
+    return ready;
+  }
+
+  unsigned long long violations() const
+  {
+    unsigned long long n = 0;
+    for (auto const &sim : sims)
+      n += sim->stats().violations;
+    return n;
+  }
+};
+
+/// Client memory, mapped for DMA by a device
+struct Client_buf
+{
+  L4Re::Dataspace ds;
+  Block_device::Mem_region region;
+  L4Re::Dma_space::Dma_addr phys = 0;
+
+  Client_buf(Nvme::Nvme_device *dev, l4_size_t size)
+  : region(L4::Cap<L4Re::Dataspace>(&ds))
+  {
+    ds.alloc(size);
+    CHECK(dev->dma_map(&region, 0, size / dev->sector_size(),
+                       L4Re::Dma_space::Direction::Bidirectional, &phys)
+          == L4_EOK);
+  }
+
+  char *mem() const
+  { return ds.mem(); }
+};
+
+/// Segment of a request: offset into the client buffer and size
+struct Seg
+{
+  l4_size_t offset;
+  unsigned sectors;
+};
+
+Block_device::Inout_block
+chain(Client_buf const &buf, std::vector<Seg> const &segs)
+{
+  Block_device::Inout_block head;
+  Block_device::Inout_block *b = &head;
+  l4_uint64_t sector = 0;
+  for (unsigned i = 0; i < segs.size(); ++i)
+    {
+      if (i)
+        {
+          b->next = cxx::make_unique<Block_device::Inout_block>();
+          b = b->next.get();
+        }
+      b->dma_addr = buf.phys + segs[i].offset;
+      b->virt_addr = buf.mem() + segs[i].offset;
+      b->num_sectors = segs[i].sectors;
+      b->sector = sector;
+      sector += segs[i].sectors;
+    }
+  return head;
+}
+
+/// Result of a request
+struct Completion
+{
+  bool done = false;
+  int error = -1;
+  l4_size_t size = 0;
+
+  /// Callback small enough not to allocate when copied
+  Block_device::Inout_callback cb()
+  {
+    Completion *c = this;
+    return [c](int error, l4_size_t size) {
+      c->done = true;
+      c->error = error;
+      c->size = size;
+    };
+  }
+};
+
+int
+wait(Env &env, Completion &c)
+{
+  env.loop.run_until([&]() { return c.done; });
+  return c.done ? c.error : -L4_ETIMEDOUT;
+}
+
+int
+rw(Env &env, Nvme::Nvme_device *dev, l4_uint64_t sector,
+   Block_device::Inout_block const &blocks, bool write)
+{
+  Completion c;
+  int ret = dev->inout_data(sector, blocks, c.cb(),
+                            write ? L4Re::Dma_space::Direction::To_device
+                                  : L4Re::Dma_space::Direction::From_device);
+  if (ret < 0)
+    return ret;
+  return wait(env, c);
+}
+
+void
+fill(char *p, l4_size_t len, unsigned seed)
+{
+  for (l4_size_t i = 0; i < len; ++i)
+    p[i] = (char)(seed * 131 + i * 7 + (i >> 9));
+}
+
+/**
+ * Write a request with the given layout, check the backing store, read it
+ * back into a clean buffer with the same layout and compare.
+ */
+bool
+round_trip(Env &env, Nvme::Nvme_device *dev, Sim::Controller *sim,
+           l4_uint64_t sector, std::vector<Seg> const &segs, unsigned seed)
+{
+  l4_size_t ss = dev->sector_size();
+  l4_size_t end = 0;
+  for (auto const &s : segs)
+    end = std::max<l4_size_t>(end, s.offset + s.sectors * ss);
+
+  Client_buf src(dev, l4_round_page(end));
+  Client_buf dst(dev, l4_round_page(end));
+  fill(src.mem(), end, seed);
+
+  bool ok = true;
+  ok &= CHECK(rw(env, dev, sector, chain(src, segs), true) == L4_EOK);
+
+  char const *disk = sim->data(1).data() + sector * ss;
+  for (auto const &s : segs)
+    {
+      ok &= CHECK(!memcmp(disk, src.mem() + s.offset, s.sectors * ss));
+      disk += s.sectors * ss;
+    }
+
+  ok &= CHECK(rw(env, dev, sector, chain(dst, segs), false) == L4_EOK);
+  for (auto const &s : segs)
+    ok &= CHECK(!memcmp(dst.mem() + s.offset, src.mem() + s.offset,
+                        s.sectors * ss));
+  return ok;
+}
+
+/// Request layouts exercising the PRP and SGL construction
+void
+layouts(Env &env, Nvme::Nvme_device *dev, Sim::Controller *sim)
+{
+  unsigned seed = 0;
+  l4_size_t max = dev->max_size() / 512;
+
+  // One page, PRP1 only
+  round_trip(env, dev, sim, 0, {{0, 8}}, ++seed);
+  // Two pages, PRP2 is the second data page
+  round_trip(env, dev, sim, 8, {{0, 16}}, ++seed);
+  // Starting in the middle of a page, PRP List
+  round_trip(env, dev, sim, 100, {{512, 63}}, ++seed);
+  // Single sector at a page offset that crosses no page boundary
+  round_trip(env, dev, sim, 300, {{3584, 1}}, ++seed);
+  // Sector crossing a page boundary
+  round_trip(env, dev, sim, 301, {{3840, 1}}, ++seed);
+  // Segments meeting at page boundaries form a single PRP List
+  round_trip(env, dev, sim, 400, {{0, 8}, {8192, 16}, {4096, 8}}, ++seed);
+  // Segments not meeting at page boundaries need several commands
+  round_trip(env, dev, sim, 500, {{512, 3}, {8192 + 1024, 5}, {20480, 2}},
+             ++seed);
+  // Largest request in a single segment
+  round_trip(env, dev, sim, 1000, {{0, (unsigned)max}}, ++seed);
+  // Many small segments
+  std::vector<Seg> segs;
+  for (unsigned i = 0; i < std::min(dev->max_segments(), 32U); ++i)
+    segs.push_back(Seg{i * 8192 + (i % 8) * 512, 1 + i % 3});
+  round_trip(env, dev, sim, 2000, segs, ++seed);
+  // PRP List spanning more than one list page
+  if (max > 2 * 512)
+    round_trip(env, dev, sim, 3000, {{0, 512 * 8 + 8}}, ++seed);
+}
+
+void
+test_bring_up()
+{
+  Options opts;
+  Env env;
+  Sim::Config cfg;
+
+  env.add(cfg);
+  cfg.nn = 3;
+  env.add(cfg);
+  cfg.nn = 1;
+  cfg.enabled = true; // The driver must disable it first.
+  env.add(cfg);
+
+  l4_cpu_time_t start = Host::now();
+  CHECK(env.bring_up() == 3);
+  CHECK(env.devs.size() == 5);
+  CHECK(!env.violations());
+
+  // Brought up concurrently: the controllers' ready delays and the default
+  // quirk delays overlap instead of adding up.
+  CHECK(Host::now() - start < 3 * (60000 + cfg.ready_us));
+
+  CHECK(env.devs[0]->match_hid(cxx::String("SIM0:n1")));
+  for (auto const &dev : env.devs)
+    CHECK(dev->capacity() == cfg.ns_blocks * 512);
+
+  // Each controller's interrupt reaches its handler.
+  Client_buf buf(env.devs.back().get(), 4096);
+  for (auto const &dev : env.devs)
+    CHECK(rw(env, dev.get(), 0, chain(buf, {{0, 8}}), false) == L4_EOK);
+  for (auto const &sim : env.sims)
+    CHECK(sim->stats().irqs > 0);
+}
+
+void
+test_not_ready()
+{
+  Options opts;
+  Env env;
+  Sim::Config cfg;
+  cfg.never_ready = true;
+  cfg.to = 2;
+  env.add(cfg);
+  env.add(Sim::Config());
+
+  // The stuck controller times out after CAP.TO, the other one is not held up.
+  l4_cpu_time_t start = Host::now();
+  CHECK(env.bring_up() == 1);
+  CHECK(Host::now() - start >= 1000000);
+  CHECK(env.devs.size() == 1);
+}
+
+void
+test_queue_failure()
+{
+  Options opts;
+  Nvme::Ctl::ioqs = 3;
+  Nvme::Ctl::use_wrr = false;
+  Env env;
+  Sim::Config cfg;
+  cfg.fail_sq = 2;
+  auto *sim = env.add(cfg);
+
+  // Creating the second submission queue fails: its completion queue is
+  // deleted before its memory is freed and the queue identifier is reused.
+  CHECK(env.bring_up() == 1);
+  CHECK(env.devs.size() == 1);
+  CHECK(env.devs[0]->ns().queue_pairs().size() == 1);
+  CHECK(sim->cq_valid(1));
+  CHECK(!sim->cq_valid(2));
+  CHECK(env.ctls[0]->alloc_qid() == 2);
+  CHECK(!env.violations());
+
+  Client_buf buf(env.devs[0].get(), 4096);
+  CHECK(rw(env, env.devs[0].get(), 0, chain(buf, {{0, 8}}), false) == L4_EOK);
+}
+
+void
+test_prp()
+{
+  Options opts;
+  Nvme::Ctl::use_sgls = false;
+  Env env;
+  Sim::Config cfg;
+  cfg.ns_blocks = 65536;
+  cfg.mdts = 0; // Large enough for PRP Lists of several pages
+  auto *sim = env.add(cfg);
+  CHECK(env.bring_up() == 1);
+
+  layouts(env, env.devs[0].get(), sim);
+  CHECK(env.devs[0]->max_size() > 512 * L4_PAGESIZE);
+  CHECK(sim->stats().prp_lists > 0);
+
+  // Segments meeting at page boundaries form a single command up to MDTS,
+  // its PRP List spans more pages than a single segment may use.
+  auto *dev = env.devs[0].get();
+  std::vector<Seg> segs;
+  for (unsigned i = 0; i < 8; ++i)
+    segs.push_back(Seg{i * 4096 * 512, 4096});
+  sim->reset_stats();
+  round_trip(env, dev, sim, 0, segs, 99);
+  CHECK(sim->stats().writes == 1);
+  CHECK(sim->stats().prp_lists >= 2 * 8);
+
+  // A segment larger than advertised fails instead of being cut short.
+  l4_size_t max = dev->max_size();
+  Client_buf buf(dev, max + L4_PAGESIZE);
+  CHECK(rw(env, dev, 0, chain(buf, {{0, (unsigned)(max / 512 + 1)}}), true)
+        == -L4_EINVAL);
+  CHECK(!sim->stats().sgl_cmds);
+  CHECK(!env.violations());
+}
+
+void
+test_prp_pool()
+{
+  Options opts;
+  Nvme::Ctl::use_sgls = false;
+  Nvme::Ctl::ioqs = 2;
+  Env env;
+  Sim::Config cfg;
+  cfg.ns_blocks = 65536;
+  cfg.mdts = 0;
+  auto *sim = env.add(cfg);
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+  Client_buf buf(dev, 16 << 20);
+  std::vector<Seg> segs;
+  for (unsigned i = 0; i < 8; ++i)
+    segs.push_back(Seg{i * 4096 * 512, 4096});
+  auto big = chain(buf, segs);
+  auto tiny = chain(buf, {{0, 1}});
+
+  // Requests of 16 MiB need 9 PRP List pages each. Interleaved with requests
+  // without a PRP List, the round-robin choice sends all of them to the same
+  // queue. Once its pool is exhausted, the other queue takes them.
+  sim->pause(true);
+  std::vector<Completion> c(16);
+  for (unsigned i = 0; i < c.size(); ++i)
+    CHECK(dev->inout_data(0, i % 2 ? tiny : big, c[i].cb(),
+                          L4Re::Dma_space::Direction::From_device)
+          == L4_EOK);
+  CHECK(dev->ns_stats().full == 0);
+
+  // Without a queue that has enough PRP List pages, the request is rejected
+  // and counted once.
+  unsigned accepted = 0;
+  std::vector<Completion> more(8);
+  for (auto &m : more)
+    if (dev->inout_data(0, big, m.cb(), L4Re::Dma_space::Direction::From_device)
+        == L4_EOK)
+      ++accepted;
+  CHECK(accepted == 6);
+  CHECK(dev->ns_stats().full == 2);
+
+  sim->pause(false);
+  env.loop.run_until([&]() { return !dev->stats().inflight; });
+  for (auto const &cmp : c)
+    CHECK(cmp.done && cmp.error == L4_EOK);
+  CHECK(!env.violations());
+}
+
+void
+test_sgl()
+{
+  Options opts;
+  Nvme::Ctl::use_sgls = true;
+  Env env;
+  Sim::Config cfg;
+  cfg.sgls = true;
+  // Without MDTS, a single SGL command carries up to 65536 logical blocks.
+  cfg.ns_blocks = 2 * 65536;
+  cfg.mdts = 0;
+  auto *sim = env.add(cfg);
+  CHECK(env.bring_up() == 1);
+
+  layouts(env, env.devs[0].get(), sim);
+  CHECK(sim->stats().sgl_cmds > 0);
+  CHECK(!sim->stats().prp_lists);
+
+  // A segment exceeding the transfer limit of a command fails.
+  auto *dev = env.devs[0].get();
+  l4_size_t max = dev->max_size();
+  Client_buf buf(dev, max + L4_PAGESIZE);
+  CHECK(rw(env, dev, 0, chain(buf, {{0, (unsigned)(max / 512 + 1)}}), true)
+        == -L4_EINVAL);
+  CHECK(!env.violations());
+}
+
+void
+test_phase_wrap()
+{
+  Options opts;
+  Nvme::Ctl::ioq_size_cfg = 8;
+  Nvme::Ctl::ioqs = 1;
+  Nvme::Ctl::use_wrr = false;
+  Env env;
+  auto *sim = env.add(Sim::Config());
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+
+  Client_buf buf(dev, 4096);
+  fill(buf.mem(), 4096, 1);
+  for (unsigned i = 0; i < 100; ++i)
+    CHECK(rw(env, dev, i, chain(buf, {{(i % 8) * 512, 1}}), true) == L4_EOK);
+  CHECK(sim->stats().phase_wraps >= 100 / 8);
+
+  // Fill the queue while the controller does not fetch commands: requests
+  // beyond its capacity are rejected, the others complete later.
+  sim->pause(true);
+  std::vector<Completion> c(16);
+  unsigned accepted = 0;
+  int busy = L4_EOK;
+  for (auto &cmp : c)
+    {
+      int ret = dev->inout_data(0, chain(buf, {{0, 1}}), cmp.cb(),
+                                L4Re::Dma_space::Direction::From_device);
+      if (ret == L4_EOK)
+        ++accepted;
+      else
+        busy = ret;
+    }
+  CHECK(accepted == 7);
+  CHECK(busy == -L4_EBUSY);
+
+  sim->pause(false);
+  env.loop.run_until([&]() {
+    for (unsigned i = 0; i < accepted; ++i)
+      if (!c[i].done)
+        return false;
+    return true;
+  });
+  for (unsigned i = 0; i < accepted; ++i)
+    CHECK(c[i].done && c[i].error == L4_EOK && c[i].size == 512);
+  CHECK(!env.violations());
+}
+
+void
+test_flush_discard()
+{
+  Options opts;
+  Env env;
+  Sim::Config cfg;
+  cfg.dmrsl = 64;
+  auto *sim = env.add(cfg);
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+
+  Completion c;
+  CHECK(dev->flush(c.cb()) == L4_EOK);
+  CHECK(wait(env, c) == L4_EOK);
+  CHECK(sim->stats().flushes == 1);
+
+  auto di = dev->discard_info();
+  CHECK(di.max_discard_sectors == 64);
+  CHECK(di.max_discard_seg > 0);
+  CHECK(di.write_zeroes_may_unmap);
+
+  Client_buf buf(dev, 64 * 512);
+  fill(buf.mem(), 64 * 512, 7);
+  CHECK(rw(env, dev, 0, chain(buf, {{0, 64}}), true) == L4_EOK);
+
+  auto const &disk = sim->data(1);
+  auto zero = [&](l4_uint64_t sector, unsigned n) {
+    for (l4_size_t i = sector * 512; i < (sector + n) * 512; ++i)
+      if (disk[i])
+        return false;
+    return true;
+  };
+
+  // Discard sectors 4-11 and 20-21
+  Block_device::Inout_block b;
+  b.sector = 4;
+  b.num_sectors = 8;
+  b.next = cxx::make_unique<Block_device::Inout_block>();
+  b.next->sector = 20;
+  b.next->num_sectors = 2;
+  Completion d;
+  CHECK(dev->discard(0, b, d.cb(), true) == L4_EOK);
+  CHECK(wait(env, d) == L4_EOK);
+  CHECK(sim->stats().dsms == 1);
+  CHECK(zero(4, 8) && zero(20, 2));
+  CHECK(!zero(3, 1) && !zero(12, 1) && !zero(22, 1));
+
+  // Write zeroes to sectors 40-49
+  Block_device::Inout_block w;
+  w.sector = 40;
+  w.num_sectors = 10;
+  Completion z;
+  CHECK(dev->discard(0, w, z.cb(), false) == L4_EOK);
+  CHECK(wait(env, z) == L4_EOK);
+  CHECK(sim->stats().write_zeroes >= 1);
+  CHECK(zero(40, 10) && !zero(39, 1) && !zero(50, 1));
+  CHECK(!env.violations());
+}
+
+/// Discard request of `n` single-sector segments starting at `sector`
+Block_device::Inout_block
+discard_segs(l4_uint64_t sector, unsigned n)
+{
+  Block_device::Inout_block head;
+  Block_device::Inout_block *b = &head;
+  for (unsigned i = 0; i < n; ++i)
+    {
+      if (i)
+        {
+          b->next = cxx::make_unique<Block_device::Inout_block>();
+          b = b->next.get();
+        }
+      b->sector = sector + 2 * i;
+      b->num_sectors = 1;
+    }
+  return head;
+}
+
+void
+test_discard_ranges()
+{
+  Options opts;
+  Nvme::Ctl::ioqs = 1;
+  Nvme::Ctl::use_wrr = false;
+  Env env;
+  Sim::Config cfg;
+  cfg.dmrl = 100;
+  cfg.dmrsl = 64;
+  auto *sim = env.add(cfg);
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+  auto di = dev->discard_info();
+  CHECK(di.max_discard_seg == 100);
+  CHECK(di.max_discard_sectors == 64);
+
+  // More or larger segments than advertised are rejected, as are write
+  // zeroes requests beyond their limits.
+  Completion inval;
+  CHECK(dev->discard(0, discard_segs(0, 101), inval.cb(), true)
+        == -L4_EINVAL);
+  auto large = discard_segs(0, 1);
+  large.num_sectors = 65;
+  CHECK(dev->discard(0, large, inval.cb(), true) == -L4_EINVAL);
+  CHECK(dev->discard(0, discard_segs(0, di.max_write_zeroes_seg + 1),
+                     inval.cb(), false) == -L4_EINVAL);
+  CHECK(di.max_write_zeroes_sectors < 0xffffffffU);
+  large.num_sectors = di.max_write_zeroes_sectors + 1;
+  CHECK(dev->discard(0, large, inval.cb(), false) == -L4_EINVAL);
+  CHECK(!inval.done);
+
+  // Range lists of 1600 bytes: several of them in flight must each stay
+  // within a page, the command describes them by PRP1 only.
+  unsigned const n = Nvme::Queue::Dsm_pool_slots;
+  std::vector<Block_device::Inout_block> reqs;
+  for (unsigned i = 0; i < n + 1; ++i)
+    reqs.push_back(discard_segs(i * 200, 100));
+
+  sim->pause(true);
+  std::vector<Completion> c(n);
+  for (unsigned i = 0; i < n; ++i)
+    CHECK(dev->discard(0, reqs[i], c[i].cb(), true) == L4_EOK);
+
+  // The range buffers of the queue are all in use.
+  Completion busy;
+  CHECK(dev->discard(0, reqs[n], busy.cb(), true) == -L4_EBUSY);
+
+  sim->pause(false);
+  for (auto &cmp : c)
+    CHECK(wait(env, cmp) == L4_EOK);
+  CHECK(sim->stats().dsms == n);
+
+  Completion again;
+  CHECK(dev->discard(0, reqs[n], again.cb(), true) == L4_EOK);
+  CHECK(wait(env, again) == L4_EOK);
+  CHECK(!env.violations());
+}
+
+void
+test_discard_queues()
+{
+  Options opts;
+  Nvme::Ctl::ioqs = 2;
+  Env env;
+  auto *sim = env.add(Sim::Config());
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+
+  // Interleaved with flushes, the round-robin choice sends all discards to
+  // the same queue. Once its range buffers are in use, the other queue takes
+  // them.
+  unsigned const n = Nvme::Queue::Dsm_pool_slots;
+  std::vector<Block_device::Inout_block> reqs;
+  for (unsigned i = 0; i < 2 * n + 1; ++i)
+    reqs.push_back(discard_segs(i * 4, 1));
+
+  sim->pause(true);
+  std::vector<Completion> c(2 * n), f(2 * n);
+  for (unsigned i = 0; i < 2 * n; ++i)
+    {
+      CHECK(dev->discard(0, reqs[i], c[i].cb(), true) == L4_EOK);
+      CHECK(dev->flush(f[i].cb()) == L4_EOK);
+    }
+  CHECK(dev->ns_stats().full == 0);
+
+  // Without any free range buffer, the request is rejected and counted once.
+  Completion busy;
+  CHECK(dev->discard(0, reqs[2 * n], busy.cb(), true) == -L4_EBUSY);
+  CHECK(dev->ns_stats().full == 1);
+
+  sim->pause(false);
+  for (auto &cmp : c)
+    CHECK(wait(env, cmp) == L4_EOK);
+  for (auto &cmp : f)
+    CHECK(wait(env, cmp) == L4_EOK);
+  CHECK(!env.violations());
+}
+
+void
+test_no_dsm()
+{
+  Options opts;
+  Env env;
+  Sim::Config cfg;
+  cfg.dsm = false;
+  cfg.vwc = false;
+  auto *sim = env.add(cfg);
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+
+  CHECK(dev->discard_info().max_discard_sectors == 0);
+
+  // Without a volatile write cache, flush completes right away.
+  Completion c;
+  CHECK(dev->flush(c.cb()) == L4_EOK);
+  CHECK(c.done && c.error == L4_EOK);
+  CHECK(sim->stats().flushes == 0);
+}
+
+void
+test_errors()
+{
+  Options opts;
+  Env env;
+  auto *sim = env.add(Sim::Config());
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+
+  Client_buf buf(dev, 4096);
+
+  // Media error: Unrecovered Read Error
+  sim->inject_error(0x02, 0x281);
+  Completion c;
+  CHECK(dev->inout_data(0, chain(buf, {{0, 8}}), c.cb(),
+                        L4Re::Dma_space::Direction::From_device)
+        == L4_EOK);
+  CHECK(wait(env, c) == -L4_EIO);
+  CHECK(c.size == 0);
+
+  // The queue keeps working afterwards.
+  CHECK(rw(env, dev, 0, chain(buf, {{0, 8}}), false) == L4_EOK);
+  CHECK(!env.violations());
+}
+
+/// Run `n` single-sector reads, submitted back to back, to completion.
+void
+burst(Env &env, Nvme::Nvme_device *dev, Client_buf const &buf, unsigned n)
+{
+  std::vector<Completion> c(n);
+  for (unsigned i = 0; i < n; ++i)
+    CHECK(dev->inout_data(i, chain(buf, {{(i % 8) * 512, 1}}), c[i].cb(),
+                          L4Re::Dma_space::Direction::From_device)
+          == L4_EOK);
+  env.loop.run_until([&]() {
+    for (auto const &cmp : c)
+      if (!cmp.done)
+        return false;
+    return true;
+  });
+  for (auto const &cmp : c)
+    CHECK(cmp.done && cmp.error == L4_EOK);
+}
+
+void
+test_doorbell_batching()
+{
+  Options opts;
+  Nvme::Ctl::use_wrr = false;
+  Env env;
+  auto *sim = env.add(Sim::Config());
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+  Client_buf buf(dev, 4096);
+
+  // Without a server interface, each command rings its doorbell.
+  sim->reset_stats();
+  burst(env, dev, buf, 16);
+  CHECK(sim->stats().sq_doorbells == 16);
+
+  // Commands submitted while handling one IPC share the doorbell writes.
+  Nvme::Nvme_device::set_server_iface(&env.loop);
+  sim->reset_stats();
+  burst(env, dev, buf, 16);
+  CHECK(sim->stats().sq_doorbells >= 1);
+  CHECK(sim->stats().sq_doorbells <= Nvme::Ctl::ioqs);
+
+  // Explicit plugging
+  sim->reset_stats();
+  dev->plug();
+  std::vector<Completion> c(4);
+  for (unsigned i = 0; i < c.size(); ++i)
+    CHECK(dev->inout_data(i, chain(buf, {{0, 1}}), c[i].cb(),
+                          L4Re::Dma_space::Direction::From_device)
+          == L4_EOK);
+  env.loop.run_until([&]() { return c[0].done; });
+  CHECK(!c[0].done);
+  CHECK(sim->stats().sq_doorbells == 0);
+  dev->unplug();
+  env.loop.run_until([&]() { return c[3].done; });
+  CHECK(c[3].done);
+  CHECK(!env.violations());
+}
+
+void
+test_poll()
+{
+  Options opts;
+  Nvme::Ctl::use_wrr = false;
+  Env env;
+  Sim::Config cfg;
+  cfg.sync_io = true;
+  env.add(cfg);
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+  // Polling is a setting of the device, not of the whole server.
+  unsigned const poll_us = 2000000;
+  CHECK(Nvme::Ctl::poll_us == 0);
+  CHECK(dev->set_poll(poll_us));
+  Nvme::Nvme_device::set_server_iface(&env.loop);
+  Client_buf buf(dev, 4096);
+  auto blocks = chain(buf, {{0, 8}});
+
+  // The callback of the first read, which runs while polling, submits a
+  // second read. Its doorbell is written at once, so polling sees it
+  // complete instead of spinning until the polling period ends.
+  struct
+  {
+    Nvme::Nvme_device *dev;
+    Block_device::Inout_block const *blocks;
+    Completion first, second;
+  } ctx{dev, &blocks, {}, {}};
+  auto *x = &ctx;
+  Completion &first = ctx.first;
+  Completion &second = ctx.second;
+  Block_device::Inout_callback resubmit = [x](int error, l4_size_t) {
+    x->first.done = true;
+    x->first.error = error;
+    CHECK(x->dev->inout_data(8, *x->blocks, x->second.cb(),
+                             L4Re::Dma_space::Direction::From_device)
+          == L4_EOK);
+  };
+
+  l4_cpu_time_t start = Host::now();
+  CHECK(dev->inout_data(0, blocks, resubmit,
+                        L4Re::Dma_space::Direction::From_device) == L4_EOK);
+  CHECK(wait(env, second) == L4_EOK);
+  CHECK(first.done && first.error == L4_EOK);
+  CHECK(Host::now() - start < poll_us / 2);
+  CHECK(!env.violations());
+}
+
+void
+test_throttle_reset()
+{
+  Options opts;
+  Env env;
+  env.add(Sim::Config());
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+  Nvme::Nvme_device::set_server_iface(&env.loop);
+  Client_buf buf(dev, 4096);
+  auto blocks = chain(buf, {{0, 8}});
+
+  // The first request leaves the bucket in debt for 300 ms, the others are
+  // deferred.
+  CHECK(dev->set_limits(0, 10240));
+  std::vector<Completion> c(3);
+  for (unsigned i = 0; i < c.size(); ++i)
+    CHECK(dev->inout_data(i * 8, blocks, c[i].cb(),
+                          L4Re::Dma_space::Direction::From_device)
+          == L4_EOK);
+  CHECK(!c[1].done && !c[2].done);
+
+  // A reset fails the deferred requests at once and cancels their timeout.
+  dev->reset();
+  CHECK(c[1].done && c[1].error == -L4_EIO);
+  CHECK(c[2].done && c[2].error == -L4_EIO);
+  CHECK(wait(env, c[0]) == L4_EOK);
+  l4_cpu_time_t start = Host::now();
+  env.loop.run();
+  CHECK(Host::now() - start < 50000);
+
+  // Requests passed after the reset are limited as before.
+  Completion after;
+  CHECK(dev->inout_data(0, blocks, after.cb(),
+                        L4Re::Dma_space::Direction::From_device) == L4_EOK);
+  CHECK(!after.done);
+  CHECK(wait(env, after) == L4_EOK);
+  CHECK(!env.violations());
+}
+
+void
+test_shadow_doorbells()
+{
+  Options opts;
+  Nvme::Ctl::use_dbbuf = true;
+  Env env;
+  Sim::Config cfg;
+  cfg.dbbuf = true;
+  auto *polling = env.add(cfg);
+  cfg.dbbuf_poll = false;
+  auto *sleeping = env.add(cfg);
+  CHECK(env.bring_up() == 2);
+
+  // A controller that keeps polling needs no doorbell register writes.
+  Client_buf buf(env.devs[0].get(), 4096);
+  polling->reset_stats();
+  burst(env, env.devs[0].get(), buf, 64);
+  CHECK(polling->stats().reads == 64);
+  CHECK(polling->stats().sq_doorbells == 0);
+  CHECK(polling->stats().cq_doorbells == 0);
+
+  // One that stopped polling asks for them through EventIdx.
+  Client_buf buf2(env.devs[1].get(), 4096);
+  sleeping->reset_stats();
+  burst(env, env.devs[1].get(), buf2, 64);
+  CHECK(sleeping->stats().reads == 64);
+  CHECK(sleeping->stats().sq_doorbells > 0);
+
+  round_trip(env, env.devs[0].get(), polling, 10, {{0, 16}}, 3);
+  CHECK(!env.violations());
+}
+
+void
+test_priorities()
+{
+  Options opts;
+  Nvme::Ctl::use_wrr = true;
+  Env env;
+  auto *sim = env.add(Sim::Config());
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+  Client_buf buf(dev, 4096);
+
+  sim->reset_stats();
+  burst(env, dev, buf, 8);
+  CHECK(sim->stats().prio_cmds[Nvme::Qprio_medium] == 8);
+
+  CHECK(dev->set_priority(Nvme::Qprio_urgent));
+  burst(env, dev, buf, 8);
+  CHECK(sim->stats().prio_cmds[Nvme::Qprio_urgent] == 8);
+  CHECK(!env.violations());
+}
+
+void
+test_stats()
+{
+  Options opts;
+  Nvme::Ctl::ioqs = 2;
+  Nvme::Ctl::ioq_size_cfg = 8;
+  Nvme::Ctl::use_wrr = false;
+  Env env;
+  auto *sim = env.add(Sim::Config());
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+  Client_buf buf(dev, 4 * 4096);
+
+  // Four sectors in two segments not meeting at a page boundary: one request
+  // of two commands
+  CHECK(rw(env, dev, 0, chain(buf, {{0, 2}, {8192 + 512, 2}}), true)
+        == L4_EOK);
+  CHECK(rw(env, dev, 0, chain(buf, {{0, 8}}), false) == L4_EOK);
+  Completion f;
+  CHECK(dev->flush(f.cb()) == L4_EOK);
+  CHECK(wait(env, f) == L4_EOK);
+  sim->inject_error(0x02, 0x281);
+  CHECK(rw(env, dev, 0, chain(buf, {{0, 8}}), false) == -L4_EIO);
+
+  auto const &cs = dev->stats();
+  CHECK(cs.writes == 1 && cs.write_bytes == 4 * 512);
+  CHECK(cs.reads == 2 && cs.read_bytes == 2 * 4096);
+  CHECK(cs.flushes == 1);
+  CHECK(cs.errors == 1);
+  CHECK(cs.inflight == 0 && cs.max_inflight == 1);
+  CHECK(cs.latency.total() == 4);
+
+  auto ns = dev->ns_stats();
+  CHECK(ns.writes == 2 && ns.write_bytes == 4 * 512);
+  CHECK(ns.reads == 2 && ns.flushes == 1);
+  CHECK(ns.errors == 1 && ns.last_error == 0x281 && ns.sct_errors[2] == 1);
+  CHECK(ns.inflight == 0 && ns.max_inflight == 2);
+  CHECK(ns.latency.total() == 5);
+  CHECK(ns.latency.quantile(1, 2) <= ns.latency.quantile(999, 1000));
+
+  // Requests beyond the capacity of the queues are rejected and counted once
+  // each, although both queues were tried.
+  sim->pause(true);
+  std::vector<Completion> c(17);
+  for (auto &cmp : c)
+    dev->inout_data(0, chain(buf, {{0, 1}}), cmp.cb(),
+                    L4Re::Dma_space::Direction::From_device);
+  CHECK(dev->stats().busy == 3);
+  CHECK(dev->stats().inflight == 14);
+  CHECK(dev->ns_stats().full == 3);
+  // The maximum of the namespace is the largest one of its queues.
+  CHECK(dev->ns_stats().max_inflight == 7);
+  sim->pause(false);
+  env.loop.run_until([&]() { return !dev->stats().inflight; });
+  CHECK(dev->stats().max_inflight == 14);
+
+  dev->report_stats();
+  CHECK(!env.violations());
+}
+
+void
+test_stats_ds()
+{
+  Options opts;
+  Nvme::Ctl::ioqs = 2;
+  Nvme::Ctl::use_wrr = false;
+  Env env;
+  env.add(Sim::Config());
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+  Client_buf buf(dev, 4096);
+
+  Nvme::Stats_ds sds(&env.loop);
+  sds.add(env.devs[0]);
+  char const *mem = sds.ds()->mem();
+  auto const *hdr = reinterpret_cast<Nvme::Stats_header const *>(mem);
+  CHECK(hdr->magic == Nvme::Stats_header::Magic);
+  CHECK(hdr->entry_size == sizeof(Nvme::Stats_entry));
+  CHECK(hdr->num_entries == 0 && hdr->seq == 0);
+
+  CHECK(rw(env, dev, 0, chain(buf, {{0, 8}}), true) == L4_EOK);
+  CHECK(rw(env, dev, 0, chain(buf, {{0, 8}}), false) == L4_EOK);
+
+  // The server loop publishes the statistics periodically.
+  env.loop.run_until([&]() { return hdr->seq != 0; });
+  CHECK(hdr->seq == 2);
+
+  std::vector<char> snap(Nvme::Stats_ds::Size);
+  CHECK(Nvme::stats_snapshot(mem, snap.data(), snap.size()));
+  auto const *sh = reinterpret_cast<Nvme::Stats_header const *>(snap.data());
+  auto const *e = reinterpret_cast<Nvme::Stats_entry const *>(sh + 1);
+  // Client, namespace and one entry per I/O queue
+  CHECK(sh->num_entries == 2 + dev->ns().queue_pairs().size());
+  CHECK(sh->num_entries == 4);
+  CHECK(sh->cycles_per_ms > 0);
+
+  CHECK(e[0].kind == Nvme::Stats_entry::Client);
+  CHECK(!strcmp(e[0].name, "SIM0:n1"));
+  CHECK(e[0].client.reads == 1 && e[0].client.writes == 1);
+  CHECK(e[0].client.latency.total() == 2);
+  CHECK(e[1].kind == Nvme::Stats_entry::Namespace);
+  CHECK(e[1].queue.reads == 1 && e[1].queue.write_bytes == 4096);
+
+  l4_uint64_t reads = 0;
+  for (unsigned i = 2; i < sh->num_entries; ++i)
+    {
+      CHECK(e[i].kind == Nvme::Stats_entry::Queue);
+      CHECK(e[i].qid == i - 1);
+      reads += e[i].queue.reads;
+    }
+  CHECK(reads == 1);
+
+  // A snapshot is never taken while an update is in progress.
+  CHECK(hdr->seq % 2 == 0);
+  std::vector<char> junk(64);
+  CHECK(!Nvme::stats_snapshot(junk.data(), snap.data(), junk.size()));
+
+  // A reader gives up if the driver never finishes an update.
+  std::vector<char> stuck(mem, mem + snap.size());
+  ++reinterpret_cast<Nvme::Stats_header *>(stuck.data())->seq;
+  CHECK(!Nvme::stats_snapshot(stuck.data(), snap.data(), stuck.size()));
+  CHECK(!env.violations());
+}
+
+void
+test_trace()
+{
+  using Ev = Nvme::Trace_event;
+
+  Options opts;
+  Nvme::Ctl::ioqs = 1;
+  Nvme::Ctl::use_wrr = false;
+  Env env;
+  env.add(Sim::Config());
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+  Client_buf buf(dev, 4 * 4096);
+
+  // Without a trace ring, nothing is recorded.
+  Nvme::Trace_ds tds(Nvme::Trace_ds::Min_entries, &env.loop);
+  char const *mem = tds.ds()->mem();
+  auto const *hdr = reinterpret_cast<Nvme::Trace_header const *>(mem);
+  CHECK(hdr->magic == Nvme::Trace_header::Magic && hdr->num_rings == 0);
+  CHECK(rw(env, dev, 0, chain(buf, {{0, 8}}), true) == L4_EOK);
+
+  tds.add(&dev->ns());
+  CHECK(hdr->num_rings == 1);
+  auto const *ring = reinterpret_cast<Nvme::Trace_ring_header const *>(
+    mem + sizeof(*hdr));
+  CHECK(ring->qid == 1 && ring->nsid == 1 && !strcmp(ring->name, "SIM0:n1"));
+
+  // A request of one command, then one split into two commands, which the
+  // simulated controller completes one by one
+  CHECK(rw(env, dev, 16, chain(buf, {{0, 8}}), true) == L4_EOK);
+  CHECK(rw(env, dev, 32, chain(buf, {{0, 2}, {8192 + 512, 2}}), false)
+        == L4_EOK);
+
+  std::vector<Ev> ev(hdr->ring_entries);
+  ev.resize(Nvme::trace_ring_events(ring, hdr->ring_entries, ev.data()));
+  std::vector<l4_uint8_t> types;
+  for (auto const &e : ev)
+    types.push_back(e.type);
+  CHECK(types == std::vector<l4_uint8_t>({
+    Ev::Produce, Ev::Doorbell, Ev::Cqe, Ev::Callback, Ev::Notify,
+    Ev::Produce, Ev::Doorbell, Ev::Produce, Ev::Doorbell,
+    Ev::Cqe, Ev::Notify, Ev::Cqe, Ev::Callback, Ev::Notify }));
+  if (ev.size() == 14)
+    {
+      CHECK(ev[0].opc == Nvme::Iocs::Write && ev[0].slba == 16
+            && ev[0].len == 8 && ev[0].group);
+      CHECK(ev[2].cid == ev[0].cid && !ev[2].status);
+      CHECK(ev[3].cid == ev[0].cid && ev[3].group == ev[0].group);
+      CHECK(ev[4].len == 1);
+      CHECK(ev[5].opc == Nvme::Iocs::Read && ev[5].slba == 32
+            && ev[5].len == 2 && ev[5].group);
+      CHECK(ev[7].slba == 34 && ev[7].group == ev[5].group);
+      CHECK(ev[9].cid == ev[5].cid && ev[11].cid == ev[7].cid);
+      CHECK(ev[12].group == ev[5].group);
+      for (unsigned i = 1; i < ev.size(); ++i)
+        CHECK(ev[i].stamp >= ev[i - 1].stamp || ev[i].type == Ev::Produce);
+    }
+
+  // The oldest events are overwritten.
+  for (unsigned i = 0; i < 4; ++i)
+    CHECK(rw(env, dev, 0, chain(buf, {{0, 8}}), true) == L4_EOK);
+  CHECK(ring->pos == 14 + 4 * 5);
+  ev.resize(hdr->ring_entries);
+  CHECK(Nvme::trace_ring_events(ring, hdr->ring_entries, ev.data())
+        == Nvme::Trace_ds::Min_entries - 1);
+  CHECK(ev.back().type == Ev::Notify);
+  CHECK(!env.violations());
+}
+
+void
+test_callback_copy()
+{
+  Options opts;
+  Env env;
+  env.add(Sim::Config());
+  CHECK(env.bring_up() == 1);
+  auto *dev = env.devs[0].get();
+  Client_buf buf(dev, 4096);
+  auto blocks = chain(buf, {{0, 8}});
+  unsigned long long io_path_allocs = Nvme::Alloc_stats::io_path_allocs;
+
+  // A callback capturing two pointers is copied into the request slot
+  // without allocating.
+  Completion c;
+  int *p = nullptr;
+  Block_device::Inout_callback small = [&c, p](int error, l4_size_t) {
+    c.done = true;
+    c.error = error + (p ? 1 : 0);
+  };
+  CHECK(dev->inout_data(0, blocks, small,
+                        L4Re::Dma_space::Direction::From_device) == L4_EOK);
+  CHECK(wait(env, c) == L4_EOK);
+  CHECK(Nvme::Alloc_stats::io_path_allocs == io_path_allocs);
+
+  // A larger one is not, which the I/O path accounting detects.
+  c = Completion();
+  long pad[3] = { 0, 0, 0 };
+  Block_device::Inout_callback large = [&c, pad](int error, l4_size_t) {
+    c.done = true;
+    c.error = error + (int)(pad[0] + pad[1] + pad[2]);
+  };
+  CHECK(dev->inout_data(0, blocks, large,
+                        L4Re::Dma_space::Direction::From_device) == L4_EOK);
+  CHECK(wait(env, c) == L4_EOK);
+  CHECK(Nvme::Alloc_stats::io_path_allocs > io_path_allocs);
+  Nvme::Alloc_stats::io_path_allocs = io_path_allocs;
+  CHECK(!env.violations());
+}
+
+struct Test
+{
+  char const *name;
+  void (*fn)();
+};
+
+Test const tests[] = {
+  { "bring-up", test_bring_up },
+  { "not-ready", test_not_ready },
+  { "queue-failure", test_queue_failure },
+  { "prp", test_prp },
+  { "prp-pool", test_prp_pool },
+  { "sgl", test_sgl },
+  { "phase-wrap", test_phase_wrap },
+  { "flush-discard", test_flush_discard },
+  { "discard-ranges", test_discard_ranges },
+  { "discard-queues", test_discard_queues },
+  { "no-dsm", test_no_dsm },
+  { "errors", test_errors },
+  { "doorbell-batching", test_doorbell_batching },
+  { "poll", test_poll },
+  { "throttle-reset", test_throttle_reset },
+  { "shadow-doorbells", test_shadow_doorbells },
+  { "priorities", test_priorities },
+  { "stats", test_stats },
+  { "stats-ds", test_stats_ds },
+  { "trace", test_trace },
+  { "callback-copy", test_callback_copy },
+};
+
+}
+
+int
+main(int argc, char **argv)
+{
+  char const *only = argc > 1 ? argv[1] : nullptr;
+  unsigned failed = 0;
+
+  for (auto const &t : tests)
+    {
+      if (only && strcmp(only, t.name))
+        continue;
+
+      unsigned before = failed_checks;
+      t.fn();
+      bool ok = failed_checks == before;
+      printf("ctl-test %s: %s\n", t.name, ok ? "ok" : "FAILED");
+      failed += !ok;
+    }
+
+  // None of the requests above may have allocated on the submission path.
+  bool allocs_ok = !Nvme::Alloc_stats::io_path_allocs;
+  printf("ctl-test io-path-allocs: %s (%llu)\n", allocs_ok ? "ok" : "FAILED",
+         Nvme::Alloc_stats::io_path_allocs);
+  failed += !allocs_ok;
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <l4/sys/kip>
+#include <l4/re/dataspace>
+#include <l4/re/dma_space>
+#include <l4/drivers/hw_mmio_register_block>
+#include <l4/libblock-device/errand.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+#include "host_env.h"
+
+namespace {
+
+/// Time the clock has been advanced by the event loop [us]
+l4_cpu_time_t skipped_us = 0;
+
+/// DMA-mapped ranges by start address
+std::multimap<l4_uint64_t, l4_size_t> &dma_ranges()
+{
+  static std::multimap<l4_uint64_t, l4_size_t> ranges;
+  return ranges;
+}
+
+struct Mmio_range
+{
+  L4drivers::Mmio_hook *hook;
+  l4_addr_t base;
+  l4_size_t size;
+};
+
+std::vector<Mmio_range> &mmio_ranges()
+{
+  static std::vector<Mmio_range> ranges;
+  return ranges;
+}
+
+}
+
+l4_cpu_time_t
+l4_kip_clock(l4_kernel_info_t const *)
+{ return Host::now(); }
+
+namespace Host {
+
+l4_cpu_time_t
+now()
+{
+  using namespace std::chrono;
+  static auto const start = steady_clock::now();
+  auto real = duration_cast<microseconds>(steady_clock::now() - start);
+  return real.count() + skipped_us;
+}
+
+bool
+dma_mapped(l4_uint64_t addr, l4_size_t size)
+{
+  auto &ranges = dma_ranges();
+  // Ranges may overlap, check all that start at or below `addr`.
+  for (auto it = ranges.upper_bound(addr); it != ranges.begin();)
+    {
+      --it;
+      if (addr + size <= it->first + it->second)
+        return true;
+    }
+  return false;
+}
+
+int
+Loop::add_timeout(L4::Ipc_svr::Timeout *t, l4_kernel_clock_t time)
+{
+  t->timeout(time);
+
+  // Behind all timeouts expiring at the same time or earlier
+  L4::Ipc_svr::Timeout **p = &_timeouts;
+  while (*p && (*p)->timeout() <= time)
+    p = &(*p)->next();
+  t->next() = *p;
+  *p = t;
+  return 0;
+}
+
+int
+Loop::remove_timeout(L4::Ipc_svr::Timeout *t)
+{
+  for (L4::Ipc_svr::Timeout **p = &_timeouts; *p; p = &(*p)->next())
+    if (*p == t)
+      {
+        *p = t->next();
+        t->next() = nullptr;
+        return 0;
+      }
+  return -L4_ENOENT;
+}
+
+bool
+Loop::run_timeouts()
+{
+  bool any = false;
+  l4_kernel_clock_t t = now();
+  while (_timeouts && _timeouts->timeout() <= t)
+    {
+      auto *to = _timeouts;
+      _timeouts = to->next();
+      to->next() = nullptr;
+      to->expired();
+      any = true;
+    }
+  return any;
+}
+
+bool
+Loop::run_once()
+{
+  bool any = false;
+  for (auto *d : _devs)
+    any |= d->poll();
+  any |= _registry.dispatch_irqs();
+  any |= run_timeouts();
+
+  if (any)
+    return true;
+
+  if (!_timeouts)
+    return false;
+
+  // Nothing to do until the next timeout, let time pass.
+  l4_kernel_clock_t next = _timeouts->timeout();
+  l4_kernel_clock_t t = now();
+  if (next > t)
+    skipped_us += next - t;
+  return true;
+}
+
+bool
+Loop::run_until(std::function<bool()> const &done)
+{
+  while (!done())
+    if (!run_once())
+      return done();
+  return true;
+}
+
+}
+
+L4Re::Dataspace::~Dataspace()
+{ free(_mem); }
+
+long
+L4Re::Dataspace::alloc(l4_size_t size)
+{
+  if (_mem)
+    return -L4_EEXIST;
+
+  l4_size_t sz = l4_round_page(size ? size : 1);
+  _mem = static_cast<char *>(aligned_alloc(L4_PAGESIZE, sz));
+  if (!_mem)
+    return -L4_ENOMEM;
+  memset(_mem, 0, sz);
+  _size = sz;
+  return L4_EOK;
+}
+
+long
+L4Re::Dma_space::map(L4::Cap<Dataspace> const &src, l4_addr_t offset,
+                     l4_size_t *size, unsigned, Direction, Dma_addr *dma_addr)
+{
+  if (!src.is_valid() || !src->mem() || offset >= src->size())
+    return -L4_EINVAL;
+
+  *size = std::min<l4_size_t>(*size, src->size() - offset);
+  *dma_addr = (l4_addr_t)src->mem() + offset;
+  dma_ranges().emplace(*dma_addr, *size);
+  return L4_EOK;
+}
+
+long
+L4Re::Dma_space::unmap(Dma_addr dma_addr, l4_size_t, unsigned, Direction)
+{
+  auto it = dma_ranges().find(dma_addr);
+  if (it == dma_ranges().end())
+    return -L4_ENOENT;
+  dma_ranges().erase(it);
+  return L4_EOK;
+}
+
+void
+L4drivers::Mmio_hook::add(Mmio_hook *hook, l4_addr_t base, l4_size_t size)
+{ mmio_ranges().push_back(Mmio_range{hook, base, size}); }
+
+void
+L4drivers::Mmio_hook::remove(Mmio_hook *hook)
+{
+  auto &r = mmio_ranges();
+  for (auto it = r.begin(); it != r.end();)
+    if (it->hook == hook)
+      it = r.erase(it);
+    else
+      ++it;
+}
+
+L4drivers::Mmio_hook *
+L4drivers::Mmio_hook::find(l4_addr_t addr, l4_addr_t *offset)
+{
+  for (auto const &r : mmio_ranges())
+    if (addr >= r.base && addr - r.base < r.size)
+      {
+        *offset = addr - r.base;
+        return r.hook;
+      }
+  return nullptr;
+}
+
+namespace Block_device { namespace Errand {
+
+namespace {
+
+L4::Ipc_svr::Server_iface *server_iface;
+
+/// One-shot timeout running a callback
+class Errand : public L4::Ipc_svr::Timeout
+{
+public:
+  explicit Errand(Callback const &cb) : _cb(cb) {}
+
+  void expired() override
+  {
+    Callback cb = std::move(_cb);
+    delete this;
+    cb();
+  }
+
+private:
+  Callback _cb;
+};
+
+}
+
+void
+set_server_iface(L4::Ipc_svr::Server_iface *sif)
+{ server_iface = sif; }
+
+void
+schedule(Callback const &callback, int timeout_ms)
+{
+  server_iface->add_timeout(new Errand(callback),
+                            l4_kip_clock(l4re_kip()) + timeout_ms * 1000ULL);
+}
+
+void
+poll(int retries, int interval_ms, Poll_callback const &poll_func,
+     std::function<void(bool)> const &callback)
+{
+  if (poll_func())
+    callback(true);
+  else if (retries <= 0)
+    callback(false);
+  else
+    schedule([=]() { poll(retries - 1, interval_ms, poll_func, callback); },
+             interval_ms);
+}
+
+}}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+/*
+ * Host environment of the NVMe driver.
+ *
+ * Replaces the L4Re server loop with an event loop that polls the device
+ * models, dispatches their interrupts and runs the timeouts of the driver.
+ * While there is nothing else to do, the clock jumps ahead to the next
+ * timeout, so that waiting for a device never takes real time.
+ */
+
+#include <l4/sys/cxx/ipc_epiface>
+#include <l4/re/util/object_registry>
+
+#include <functional>
+#include <vector>
+
+namespace Host {
+
+/// Current time [us], also returned by l4_kip_clock()
+l4_cpu_time_t now();
+
+/**
+ * Whether `size` bytes at `addr` are mapped into a DMA space.
+ *
+ * Device models use this to check that they only access memory the driver
+ * made available to them.
+ */
+bool dma_mapped(l4_uint64_t addr, l4_size_t size);
+
+/// Model of a device that works in the background of the driver.
+class Device_model
+{
+public:
+  virtual ~Device_model() = default;
+
+  /// Make progress, return whether there was anything to do.
+  virtual bool poll() = 0;
+};
+
+class Loop : public L4::Ipc_svr::Server_iface
+{
+public:
+  Loop() = default;
+  Loop(Loop const &) = delete;
+  Loop &operator=(Loop const &) = delete;
+
+  int add_timeout(L4::Ipc_svr::Timeout *t, l4_kernel_clock_t time) override;
+  int remove_timeout(L4::Ipc_svr::Timeout *t) override;
+
+  L4Re::Util::Object_registry *registry()
+  { return &_registry; }
+
+  void add_device(Device_model *dev)
+  { _devs.push_back(dev); }
+
+  /**
+   * Poll the device models, dispatch pending interrupts and run the expired
+   * timeouts.
+   *
+   * If none of them had anything to do, the clock is advanced to the next
+   * timeout.
+   *
+   * \retval true   Something happened or time advanced.
+   * \retval false  The loop is idle and there is no timeout to wait for.
+   */
+  bool run_once();
+
+  /**
+   * Run the loop until `done` returns true or the loop becomes idle.
+   *
+   * \return The final result of `done`.
+   */
+  bool run_until(std::function<bool()> const &done);
+
+  /// Run the loop until it becomes idle.
+  void run()
+  { run_until([]() { return false; }); }
+
+private:
+  bool run_timeouts();
+
+  L4Re::Util::Object_registry _registry;
+  std::vector<Device_model *> _devs;
+  /// Queued timeouts, sorted by expiry time
+  L4::Ipc_svr::Timeout *_timeouts = nullptr;
+};
+
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/cxx/ref_ptr>
+#include <l4/cxx/string>
+#include <l4/re/dma_space>
+#include <l4/libblock-device/types.h>
+#include <l4/libblock-device/errand.h>
+
+namespace Block_device {
+
+/// Devices sharing a notification domain are notified together.
+struct Notification_domain
+{};
+
+class Device : public cxx::Ref_obj
+{
+public:
+  virtual bool is_read_only() const = 0;
+  virtual bool match_hid(cxx::String const &hid) const = 0;
+  virtual l4_uint64_t capacity() const = 0;
+  virtual l4_size_t sector_size() const = 0;
+  virtual l4_size_t max_size() const = 0;
+  virtual unsigned max_segments() const = 0;
+  virtual void reset() = 0;
+  virtual int dma_map(Mem_region *region, l4_addr_t offset,
+                      l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+                      L4Re::Dma_space::Dma_addr *phys) = 0;
+  virtual int dma_unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                        L4Re::Dma_space::Direction dir) = 0;
+  virtual int inout_data(l4_uint64_t sector, Inout_block const &blocks,
+                         Inout_callback const &cb,
+                         L4Re::Dma_space::Direction dir) = 0;
+  virtual int flush(Inout_callback const &cb) = 0;
+  virtual void start_device_scan(Errand::Callback const &callback) = 0;
+  virtual Notification_domain const *notification_domain() const = 0;
+};
+
+class Device_discard_feature
+{
+public:
+  struct Discard_info
+  {
+    unsigned max_discard_sectors = 0;
+    unsigned max_discard_seg = 0;
+    unsigned discard_sector_alignment = 1;
+    unsigned max_write_zeroes_sectors = 0;
+    unsigned max_write_zeroes_seg = 0;
+    bool write_zeroes_may_unmap = false;
+  };
+
+  virtual ~Device_discard_feature() = default;
+
+  virtual Discard_info discard_info() const = 0;
+  virtual int discard(l4_uint64_t offset, Inout_block const &blocks,
+                      Inout_callback const &cb, bool discard) = 0;
+};
+
+template <typename BASE_DEV>
+class Device_with_notification_domain : public BASE_DEV
+{
+public:
+  Notification_domain const *notification_domain() const override
+  { return &_domain; }
+
+private:
+  Notification_domain _domain;
+};
+
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/sys/cxx/ipc_epiface>
+
+#include <functional>
+
+namespace Block_device { namespace Errand {
+
+typedef std::function<void()> Callback;
+typedef std::function<bool()> Poll_callback;
+
+/// Set the server loop whose timeouts run the errands.
+void set_server_iface(L4::Ipc_svr::Server_iface *sif);
+
+/// Run `callback` from the server loop after `timeout_ms` milliseconds.
+void schedule(Callback const &callback, int timeout_ms);
+
+/**
+ * Call `poll_func` until it returns true, at most `retries` more times with
+ * `interval_ms` milliseconds in between. Then invoke `callback` with the
+ * last result.
+ */
+void poll(int retries, int interval_ms, Poll_callback const &poll_func,
+          std::function<void(bool)> const &callback);
+
+}}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+#include <l4/cxx/unique_ptr>
+#include <l4/re/dataspace>
+#include <l4/re/dma_space>
+
+#include <functional>
+
+namespace Block_device {
+
+enum Inout_flags
+{
+  Inout_f_wb = 1,
+  Inout_f_unmap = 2,
+};
+
+/// Segment of a block request, the segments of a request form a list.
+struct Inout_block
+{
+  Inout_block() = default;
+
+  L4Re::Dma_space::Dma_addr dma_addr = 0;
+  void *virt_addr = nullptr;
+  l4_uint32_t num_sectors = 0;
+  l4_uint64_t sector = 0;
+  l4_uint32_t flags = 0;
+  cxx::unique_ptr<Inout_block> next;
+};
+
+typedef std::function<void(int error, l4_size_t size)> Inout_callback;
+
+/// Client memory region
+class Mem_region
+{
+public:
+  explicit Mem_region(L4::Cap<L4Re::Dataspace> ds = L4::Cap<L4Re::Dataspace>())
+  : _ds(ds)
+  {}
+
+  L4::Cap<L4Re::Dataspace> ds() const { return _ds; }
+
+private:
+  L4::Cap<L4Re::Dataspace> _ds;
+};
+
+}
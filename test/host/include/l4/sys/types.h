@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+/*
+ * Minimal host replacement for the L4 type definitions used by the parts of
+ * the NVMe driver that are built and run on the host.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+
+typedef uint8_t  l4_uint8_t;
+typedef uint16_t l4_uint16_t;
+typedef uint32_t l4_uint32_t;
+typedef unsigned long long l4_uint64_t;
+typedef int8_t   l4_int8_t;
+typedef int16_t  l4_int16_t;
+typedef int32_t  l4_int32_t;
+typedef long long l4_int64_t;
+
+typedef unsigned long l4_addr_t;
+typedef unsigned long l4_size_t;
+typedef unsigned long l4_umword_t;
+typedef long l4_mword_t;
+
+typedef unsigned long l4_cap_idx_t;
+typedef l4_uint64_t l4_cpu_time_t;
+typedef l4_uint64_t l4_kernel_clock_t;
+
+enum L4_error_code
+{
+  L4_EOK    = 0,
+  L4_EPERM  = 1,
+  L4_ENOENT = 2,
+  L4_EIO    = 5,
+  L4_EAGAIN = 11,
+  L4_ENOMEM = 12,
+  L4_EBUSY  = 16,
+  L4_EEXIST = 17,
+  L4_ENODEV = 19,
+  L4_EINVAL = 22,
+  L4_ERANGE = 34,
+  L4_ENOSYS = 38,
+  L4_ETIMEDOUT = 110,
+};
+
+#define L4_PAGESHIFT 12
+#define L4_PAGESIZE  (1UL << L4_PAGESHIFT)
+#define L4_PAGEMASK  (~(L4_PAGESIZE - 1))
+
+inline l4_addr_t l4_trunc_page(l4_addr_t a)
+{ return a & L4_PAGEMASK; }
+
+inline l4_addr_t l4_round_page(l4_addr_t a)
+{ return (a + L4_PAGESIZE - 1) & L4_PAGEMASK; }
+
+#define l4_assert(x) assert(x)
+
+/// Result of an IPC, a negative `raw` value is an error code.
+struct l4_msgtag_t
+{
+  long raw;
+};
+
+inline long l4_error(l4_msgtag_t tag)
+{ return tag.raw < 0 ? tag.raw : 0; }
+
+inline long l4_ipc_error(l4_msgtag_t, void *)
+{ return 0; }
+
+inline void *l4_utcb()
+{ return nullptr; }
+
+struct l4_fpage_t
+{
+  l4_umword_t raw;
+};
+
+enum
+{
+  L4_FP_ALL_SPACES = 0x80000000U,
+  L4_FP_DELETE_OBJ = 0xc0000000U,
+};
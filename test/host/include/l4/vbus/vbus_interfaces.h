@@ -0,0 +1,12 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#define L4VBUS_INTERFACE_PCIDEV 3
+
+inline bool l4vbus_subinterface_supported(unsigned type, unsigned iface)
+{ return type & (1U << iface); }
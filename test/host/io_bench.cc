@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+/*
+ * Micro-benchmark of the I/O path of the driver.
+ *
+ * Keeps a given number of 4 KiB reads in flight on a simulated controller
+ * and measures the time per request, which includes the submission through
+ * Nvme_device, the doorbell writes, the simulated controller fetching and
+ * completing the command and the interrupt handling. The simulated
+ * controller does not check DMA mappings here to keep its share small.
+ *
+ * Output is one line per data pointer type and queue depth:
+ *   io-bench dptr=<prp|sgl> depth=<n> ios=<n> ns/io=<x> sqdb/io=<x> irqs/io=<x>
+ *
+ * With `--trace FILE`, the commands are also recorded in the trace rings and
+ * the trace dataspace of the last run is written to FILE for trace_decode.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "ctl.h"
+#include "ns.h"
+#include "nvme_device.h"
+#include "trace_ds.h"
+#include "alloc_stats.h"
+
+#include "host_env.h"
+#include "nvme_sim.h"
+
+namespace {
+
+struct Result
+{
+  double ns_per_io;
+  double doorbells_per_io;
+  double irqs_per_io;
+  bool ok;
+};
+
+bool
+dump(Nvme::Trace_ds *tds, char const *path)
+{
+  tds->update_rate();
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return false;
+
+  auto ds = tds->ds();
+  bool ok = fwrite(ds->mem(), 1, ds->size(), f) == ds->size();
+  return fclose(f) == 0 && ok;
+}
+
+Result
+run(bool sgl, unsigned depth, unsigned long ios, char const *trace)
+{
+  Nvme::Ctl::use_sgls = sgl;
+
+  Host::Loop loop;
+  Block_device::Errand::set_server_iface(&loop);
+  Nvme::Nvme_device::set_server_iface(&loop);
+
+  L4::Icu icu;
+  auto nvme_icu = cxx::make_ref_obj<Nvme::Icu>(L4::Cap<L4::Icu>(&icu));
+  auto dma = L4Re::Util::make_shared_cap<L4Re::Dma_space>();
+
+  Sim::Config cfg;
+  cfg.sgls = sgl;
+  cfg.check_dma = false;
+  Sim::Controller sim(cfg, &icu);
+  loop.add_device(&sim);
+
+  // Trace events per I/O queue pair, enough for the whole quick run
+  cxx::unique_ptr<Nvme::Trace_ds> tds;
+  if (trace)
+    tds = cxx::make_unique<Nvme::Trace_ds>(Nvme::Trace_ds::Max_entries,
+                                           &loop);
+
+  Nvme::Ctl ctl(sim.pci_dev(), nvme_icu, loop.registry(), dma);
+  cxx::Ref_ptr<Nvme::Nvme_device> dev;
+  bool ready = false;
+  bool done = false;
+  ctl.enable([&](bool ok) {
+    ready = ok;
+    if (!ok)
+      {
+        done = true;
+        return;
+      }
+    ctl.register_interrupt_handler();
+    ctl.identify(
+      [&](cxx::unique_ptr<Nvme::Namespace> ns) {
+        dev = cxx::make_ref_obj<Nvme::Nvme_device>(ns.get());
+        if (tds)
+          tds->add(ns.get());
+        ctl.add_ns(cxx::move(ns));
+      },
+      [&]() { done = true; });
+  });
+  loop.run_until([&]() { return done; });
+  if (!ready || !dev)
+    return Result{0, 0, 0, false};
+
+  // One 4 KiB buffer per request in flight
+  L4Re::Dataspace ds;
+  ds.alloc(depth * L4_PAGESIZE);
+  Block_device::Mem_region region{L4::Cap<L4Re::Dataspace>(&ds)};
+  L4Re::Dma_space::Dma_addr phys;
+  dev->dma_map(&region, 0, depth * L4_PAGESIZE / dev->sector_size(),
+               L4Re::Dma_space::Direction::From_device, &phys);
+
+  std::vector<Block_device::Inout_block> blocks(depth);
+  for (unsigned i = 0; i < depth; ++i)
+    {
+      blocks[i].dma_addr = phys + i * L4_PAGESIZE;
+      blocks[i].virt_addr = ds.mem() + i * L4_PAGESIZE;
+      blocks[i].num_sectors = L4_PAGESIZE / dev->sector_size();
+    }
+
+  // Slots whose request completed and can be reused
+  std::vector<unsigned> free_slots;
+  free_slots.reserve(depth);
+  for (unsigned i = 0; i < depth; ++i)
+    free_slots.push_back(depth - 1 - i);
+
+  unsigned long submitted = 0;
+  unsigned long completed = 0;
+  bool ok = true;
+
+  struct Slot
+  {
+    std::vector<unsigned> *free_slots;
+    unsigned long *completed;
+    bool *ok;
+    unsigned idx;
+  };
+  std::vector<Slot> slots(depth);
+
+  sim.reset_stats();
+  auto start = std::chrono::steady_clock::now();
+  while (completed < ios)
+    {
+      while (!free_slots.empty() && submitted < ios)
+        {
+          unsigned i = free_slots.back();
+          slots[i] = Slot{&free_slots, &completed, &ok, i};
+          Slot *s = &slots[i];
+          int ret = dev->inout_data(
+            submitted % (cfg.ns_blocks / 8) * 8, blocks[i],
+            [s](int error, l4_size_t) {
+              if (error)
+                *s->ok = false;
+              ++*s->completed;
+              s->free_slots->push_back(s->idx);
+            },
+            L4Re::Dma_space::Direction::From_device);
+          if (ret == -L4_EBUSY)
+            break;
+          if (ret < 0)
+            return Result{0, 0, 0, false};
+          free_slots.pop_back();
+          ++submitted;
+        }
+
+      if (!loop.run_once())
+        break;
+    }
+  auto end = std::chrono::steady_clock::now();
+
+  auto const &st = sim.stats();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  Nvme::Nvme_device::set_server_iface(nullptr);
+  if (tds && !dump(tds.get(), trace))
+    {
+      fprintf(stderr, "io-bench: cannot write %s\n", trace);
+      ok = false;
+    }
+  return Result{ns / ios, (double)st.sq_doorbells / ios,
+                (double)st.irqs / ios,
+                ok && completed == ios && !st.violations};
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned long ios = 200000;
+  char const *trace = nullptr;
+
+  for (int i = 1; i < argc; i++)
+    {
+      if (!strcmp(argv[i], "--quick"))
+        ios = 10000;
+      else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+        trace = argv[++i];
+      else
+        {
+          fprintf(stderr, "Usage: %s [--quick] [--trace FILE]\n", argv[0]);
+          return 2;
+        }
+    }
+
+  bool ok = true;
+  for (bool sgl : { false, true })
+    for (unsigned depth = 1; depth <= 64; depth *= 4)
+      {
+        Result r = run(sgl, depth, ios, trace);
+        printf("io-bench dptr=%s depth=%u ios=%lu ns/io=%.1f sqdb/io=%.2f "
+               "irqs/io=%.2f\n", sgl ? "sgl" : "prp", depth, ios,
+               r.ns_per_io, r.doorbells_per_io, r.irqs_per_io);
+        ok &= r.ok;
+      }
+
+  if (Nvme::Alloc_stats::io_path_allocs)
+    {
+      printf("io-bench: FAILED, %llu heap allocations on the I/O path\n",
+             Nvme::Alloc_stats::io_path_allocs);
+      return 1;
+    }
+
+  if (!ok)
+    {
+      printf("io-bench: FAILED, requests failed\n");
+      return 1;
+    }
+
+  return 0;
+}
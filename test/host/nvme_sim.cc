@@ -0,0 +1,1074 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#include "nvme_sim.h"
+
+namespace {
+
+enum Reg
+{
+  Cap = 0x00,
+  Vs = 0x08,
+  Intms = 0x0c,
+  Intmc = 0x10,
+  Cc = 0x14,
+  Csts = 0x1c,
+  Aqa = 0x24,
+  Asq = 0x28,
+  Acq = 0x30,
+  Doorbells = 0x1000,
+  Regs_size = 0x2000,
+};
+
+enum Opcode
+{
+  Create_iosq = 0x01,
+  Delete_iocq = 0x04,
+  Create_iocq = 0x05,
+  Identify = 0x06,
+  Set_features = 0x09,
+  Doorbell_buffer_config = 0x7c,
+
+  Flush = 0x00,
+  Write = 0x01,
+  Read = 0x02,
+  Write_zeroes = 0x08,
+  Dataset_management = 0x09,
+};
+
+/// Decoded SGL descriptor
+struct Sgl_desc
+{
+  l4_uint64_t addr;
+  l4_uint32_t len;
+  unsigned type;
+  unsigned subtype;
+
+  explicit Sgl_desc(void const *p)
+  {
+    l4_uint8_t raw[16];
+    memcpy(raw, p, sizeof(raw));
+    memcpy(&addr, raw, 8);
+    memcpy(&len, raw + 8, 4);
+    type = raw[15] >> 4;
+    subtype = raw[15] & 0xf;
+  }
+};
+
+enum Sgl_type
+{
+  Sgl_data = 0,
+  Sgl_segment = 2,
+  Sgl_last_segment = 3,
+};
+
+template <typename T>
+void
+put(char *buf, unsigned offset, T value)
+{ memcpy(buf + offset, &value, sizeof(value)); }
+
+void
+put_str(char *buf, unsigned offset, unsigned len, std::string const &s)
+{
+  memset(buf + offset, ' ', len);
+  memcpy(buf + offset, s.data(), std::min<size_t>(len, s.size()));
+}
+
+}
+
+namespace Sim {
+
+Controller::Controller(Config const &cfg, L4::Icu *icu)
+: _cfg(cfg), _icu(icu), _stats(),
+  _ns(cfg.nn, std::vector<char>(cfg.ns_blocks << cfg.lba_shift)),
+  _cc(0), _aqa(0), _asq(0), _acq(0), _intm(0), _cfs(false), _rdy(false),
+  _rdy_at(0), _pci_cmd(0), _irq_enabled(false), _irq_pending(false),
+  _sqs(cfg.max_ioqs + 1), _cqs(cfg.max_ioqs + 1), _arb(0), _wce(false),
+  _nioqs(0), _dbbuf(0), _eibuf(0), _inject_opc(0), _inject_sf(0),
+  _paused(false)
+{
+  _cap = cfg.mqes               // MQES
+         | 1ULL << 16           // CQR: contiguous queues required
+         | (cfg.wrr ? 1ULL << 17 : 0) // AMS: weighted round robin
+         | (l4_uint64_t)cfg.to << 24
+         | 1ULL << 37;          // CSS: NVM command set
+  // DSTRD, MPSMIN and MPSMAX are 0: 4-byte doorbell stride, 4 KiB pages
+
+  // 64-bit memory BAR
+  _pci_bar[0] = (cfg.bar & 0xfffff000U) | 0x4;
+  _pci_bar[1] = (l4_uint64_t)cfg.bar >> 32;
+
+  if (cfg.enabled)
+    {
+      // Left enabled by the firmware, without usable admin queues
+      _cc = 1 | 6 << 16 | 4 << 20;
+      _rdy = true;
+    }
+
+  L4drivers::Mmio_hook::add(this, cfg.bar, Regs_size);
+}
+
+Controller::~Controller()
+{ L4drivers::Mmio_hook::remove(this); }
+
+void
+Controller::violation(char const *fmt, ...)
+{
+  char buf[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+
+  ++_stats.violations;
+  _last_violation = buf;
+  fprintf(stderr, "%s: driver error: %s\n", _cfg.serial.c_str(), buf);
+}
+
+bool
+Controller::ready()
+{
+  bool en = _cc & 1;
+  if (_rdy != en && !_cfs && Host::now() >= _rdy_at
+      && !(en && _cfg.never_ready))
+    _rdy = en;
+  return _rdy && en;
+}
+
+void
+Controller::enable()
+{
+  unsigned mps = (_cc >> 7) & 0xf;
+  unsigned css = (_cc >> 4) & 0x7;
+  unsigned ams = (_cc >> 11) & 0x7;
+  unsigned iosqes = (_cc >> 16) & 0xf;
+  unsigned iocqes = (_cc >> 20) & 0xf;
+  unsigned asqs = (_aqa & 0xfff) + 1;
+  unsigned acqs = ((_aqa >> 16) & 0xfff) + 1;
+
+  if (mps != 0 || css != 0 || (ams != 0 && !(ams == 1 && _cfg.wrr)))
+    violation("invalid CC value %#x", _cc);
+  else if (iosqes != 6 || iocqes != 4)
+    violation("invalid I/O queue entry sizes in CC %#x", _cc);
+  else if (asqs < 2 || acqs < 2 || asqs > _cfg.mqes + 1U
+           || acqs > _cfg.mqes + 1U)
+    violation("invalid admin queue sizes in AQA %#x", _aqa);
+  else if ((_asq & (Page_size - 1)) || (_acq & (Page_size - 1))
+           || !mapped(_asq, asqs * 64) || !mapped(_acq, acqs * 16))
+    violation("invalid admin queues ASQ=%#llx ACQ=%#llx",
+              (unsigned long long)_asq, (unsigned long long)_acq);
+  else
+    {
+      _sqs[0] = Sq{true, _asq, (l4_uint16_t)asqs, 0, 0, 0, 0};
+      _cqs[0] = Cq{true, _acq, (l4_uint16_t)acqs, 0, 0, true, true};
+      _rdy_at = Host::now() + _cfg.ready_us;
+      return;
+    }
+
+  _cfs = true;
+}
+
+void
+Controller::disable()
+{
+  for (auto &sq : _sqs)
+    sq.valid = false;
+  for (auto &cq : _cqs)
+    cq.valid = false;
+
+  _cfs = false;
+  _arb = 0;
+  _nioqs = 0;
+  _dbbuf = 0;
+  _eibuf = 0;
+  _irq_pending = false;
+  _rdy_at = Host::now() + _cfg.ready_us / 2;
+}
+
+l4_uint32_t
+Controller::mmio_read32(l4_addr_t offset)
+{
+  switch (offset)
+    {
+    case Cap: return _cap;
+    case Cap + 4: return _cap >> 32;
+    case Vs: return 0x10400; // 1.4
+    case Intms:
+    case Intmc: return _intm;
+    case Cc: return _cc;
+    case Csts: ready(); return (_rdy ? 1 : 0) | (_cfs ? 2 : 0);
+    case Aqa: return _aqa;
+    case Asq: return _asq;
+    case Asq + 4: return _asq >> 32;
+    case Acq: return _acq;
+    case Acq + 4: return _acq >> 32;
+    default: return 0;
+    }
+}
+
+void
+Controller::mmio_write32(l4_addr_t offset, l4_uint32_t value)
+{
+  if (offset >= Doorbells)
+    {
+      unsigned idx = (offset - Doorbells) / 4;
+      l4_uint16_t qid = idx / 2;
+      bool cq_head = idx & 1;
+
+      if (cq_head)
+        ++_stats.cq_doorbells;
+      else
+        ++_stats.sq_doorbells;
+
+      if (!ready())
+        {
+          violation("doorbell write %#lx while not ready", offset);
+          return;
+        }
+
+      if (qid >= _sqs.size()
+          || !(cq_head ? _cqs[qid].valid : _sqs[qid].valid))
+        {
+          violation("doorbell write %#lx for invalid queue %u", offset, qid);
+          return;
+        }
+
+      if (cq_head)
+        {
+          Cq &cq = _cqs[qid];
+          // The head must not pass entries that have not been posted yet.
+          unsigned posted = (cq.tail + cq.size - cq.head) % cq.size;
+          unsigned released = (value + cq.size - cq.head) % cq.size;
+          if (value >= cq.size || released > posted)
+            violation("CQ%u head %u invalid (head %u, tail %u)", qid, value,
+                      cq.head, cq.tail);
+          else
+            cq.head = value;
+        }
+      else
+        {
+          Sq &sq = _sqs[qid];
+          // The tail must not move backwards past entries not fetched yet.
+          unsigned pending = (sq.tail + sq.size - sq.head) % sq.size;
+          unsigned now_pending = (value + sq.size - sq.head) % sq.size;
+          if (value >= sq.size || now_pending < pending)
+            violation("SQ%u tail %u invalid (head %u, tail %u)", qid, value,
+                      sq.head, sq.tail);
+          else
+            sq.tail = value;
+          if (_cfg.sync_io && qid)
+            process_sq(qid, ~0U);
+        }
+      return;
+    }
+
+  switch (offset)
+    {
+    case Intms: _intm |= value; break;
+    case Intmc: _intm &= ~value; break;
+    case Cc:
+      {
+        bool was_en = _cc & 1;
+        _cc = value;
+        if (!was_en && (value & 1))
+          enable();
+        else if (was_en && !(value & 1))
+          disable();
+        break;
+      }
+    case Aqa: _aqa = value; break;
+    case Asq: _asq = (_asq & ~0xffffffffULL) | value; break;
+    case Asq + 4: _asq = (_asq & 0xffffffffULL) | (l4_uint64_t)value << 32; break;
+    case Acq: _acq = (_acq & ~0xffffffffULL) | value; break;
+    case Acq + 4: _acq = (_acq & 0xffffffffULL) | (l4_uint64_t)value << 32; break;
+    default: break;
+    }
+}
+
+int
+Controller::cfg_read(l4_uint32_t reg, l4_uint32_t *value, l4_uint32_t width)
+{
+  l4_uint32_t v;
+  switch (reg & ~3U)
+    {
+    case 0x00: v = _cfg.vendor_id | (l4_uint32_t)_cfg.device_id << 16; break;
+    case 0x04: v = _pci_cmd; break; // no capabilities list
+    case 0x08: v = 0x01080200; break; // NVMe controller
+    case 0x10: v = _pci_bar[0]; break;
+    case 0x14: v = _pci_bar[1]; break;
+    case 0x2c: v = _cfg.vendor_id | (l4_uint32_t)_cfg.device_id << 16; break;
+    case 0x3c: v = _cfg.irq | 1 << 8; break; // INTA#
+    default: v = 0; break;
+    }
+
+  v >>= (reg & 3) * 8;
+  if (width < 32)
+    v &= (1U << width) - 1;
+  *value = v;
+  return L4_EOK;
+}
+
+int
+Controller::cfg_write(l4_uint32_t reg, l4_uint32_t value, l4_uint32_t)
+{
+  if (reg == 0x04)
+    _pci_cmd = value;
+  return L4_EOK;
+}
+
+int
+Controller::irq_enable(unsigned char *trigger, unsigned char *polarity)
+{
+  // Level triggered, active low
+  *trigger = 0;
+  *polarity = 1;
+  _irq_enabled = true;
+  return _cfg.irq;
+}
+
+void
+Controller::sync_shadow_doorbells()
+{
+  if (!_dbbuf)
+    return;
+
+  // The admin queues are not covered by the shadow doorbells.
+  l4_uint32_t const *db = reinterpret_cast<l4_uint32_t const *>(_dbbuf);
+  for (unsigned qid = 1; qid < _sqs.size(); ++qid)
+    {
+      l4_uint32_t v;
+      if (_sqs[qid].valid)
+        {
+          v = __atomic_load_n(&db[2 * qid], __ATOMIC_ACQUIRE);
+          if (v < _sqs[qid].size)
+            _sqs[qid].tail = v;
+          else
+            violation("shadow SQ%u tail %u invalid", qid, v);
+        }
+      if (_cqs[qid].valid)
+        {
+          v = __atomic_load_n(&db[2 * qid + 1], __ATOMIC_ACQUIRE);
+          if (v < _cqs[qid].size)
+            _cqs[qid].head = v;
+          else
+            violation("shadow CQ%u head %u invalid", qid, v);
+        }
+    }
+}
+
+void
+Controller::update_event_indexes()
+{
+  if (!_eibuf)
+    return;
+
+  // A polling controller asks for doorbell register writes only once the
+  // doorbell value wraps all the way around, a sleeping one for the next one.
+  l4_uint16_t lag = _cfg.dbbuf_poll ? 1 : 0;
+  l4_uint32_t *ei = reinterpret_cast<l4_uint32_t *>(_eibuf);
+  for (unsigned qid = 1; qid < _sqs.size(); ++qid)
+    {
+      if (_sqs[qid].valid)
+        __atomic_store_n(&ei[2 * qid], (l4_uint16_t)(_sqs[qid].tail - lag),
+                         __ATOMIC_RELEASE);
+      if (_cqs[qid].valid)
+        __atomic_store_n(&ei[2 * qid + 1],
+                         (l4_uint16_t)(_cqs[qid].head - lag),
+                         __ATOMIC_RELEASE);
+    }
+}
+
+bool
+Controller::poll()
+{
+  if (_paused || !ready())
+    return false;
+
+  sync_shadow_doorbells();
+
+  unsigned done = process_sq(0, ~0U);
+
+  // Weighted round robin: the urgent class first, then high, medium and low
+  // with bursts according to their weights. Round robin: all alike.
+  bool wrr = ((_cc >> 11) & 0x7) == 1;
+  unsigned ab = _arb & 0x7;
+  unsigned burst = ab == 7 ? ~0U : 1U << ab;
+  for (unsigned prio = 0; prio < (wrr ? 4U : 1U); ++prio)
+    for (unsigned qid = 1; qid < _sqs.size(); ++qid)
+      {
+        if (!_sqs[qid].valid || (wrr && _sqs[qid].prio != prio))
+          continue;
+
+        unsigned budget = burst;
+        if (wrr && prio)
+          budget = burst * (((_arb >> (8 * (4 - prio))) & 0xff) + 1);
+        else if (wrr)
+          budget = ~0U;
+        done += process_sq(qid, budget);
+      }
+
+  update_event_indexes();
+
+  if (_irq_pending && _irq_enabled && !(_intm & 1))
+    {
+      _irq_pending = false;
+      ++_stats.irqs;
+      _icu->trigger(_cfg.irq);
+    }
+
+  return done;
+}
+
+unsigned
+Controller::process_sq(l4_uint16_t qid, unsigned budget)
+{
+  Sq &sq = _sqs[qid];
+  unsigned n = 0;
+
+  while (n < budget && sq.valid && sq.head != sq.tail)
+    {
+      Cq const &cq = _cqs[sq.cqid];
+      if ((cq.tail + 1) % cq.size == cq.head)
+        break; // CQ full, wait for the host to consume entries
+
+      l4_uint64_t addr = sq.base + sq.head * 64ULL;
+      if (!mapped(addr, 64))
+        {
+          violation("SQ%u entry %u at %#llx not mapped", qid, sq.head,
+                    (unsigned long long)addr);
+          sq.head = sq.tail;
+          break;
+        }
+
+      Sqe sqe;
+      memcpy(&sqe, reinterpret_cast<void const *>(addr), sizeof(sqe));
+      sq.head = (sq.head + 1) % sq.size;
+
+      l4_uint32_t dw0 = 0;
+      l4_uint16_t sf;
+      if (qid == 0)
+        sf = admin(sqe, &dw0);
+      else
+        {
+          ++_stats.prio_cmds[sq.prio];
+          sf = io(sqe);
+        }
+
+      if (sf)
+        ++_stats.errors;
+
+      post(qid, sqe.cid(), sf, dw0);
+      ++n;
+    }
+
+  return n;
+}
+
+bool
+Controller::post(l4_uint16_t sqid, l4_uint16_t cid, l4_uint16_t sf,
+                 l4_uint32_t dw0)
+{
+  Sq const &sq = _sqs[sqid];
+  Cq &cq = _cqs[sq.cqid];
+
+  l4_uint64_t addr = cq.base + cq.tail * 16ULL;
+  if (!mapped(addr, 16))
+    {
+      violation("CQ%u entry %u at %#llx not mapped", sq.cqid, cq.tail,
+                (unsigned long long)addr);
+      return false;
+    }
+
+  l4_uint32_t *cqe = reinterpret_cast<l4_uint32_t *>(addr);
+  cqe[0] = dw0;
+  cqe[1] = 0;
+  cqe[2] = sq.head | (l4_uint32_t)sqid << 16;
+  // The phase tag must become visible last.
+  __atomic_store_n(&cqe[3],
+                   cid | (cq.phase ? 1U : 0U) << 16 | (l4_uint32_t)sf << 17,
+                   __ATOMIC_RELEASE);
+
+  cq.tail = (cq.tail + 1) % cq.size;
+  if (!cq.tail)
+    {
+      cq.phase = !cq.phase;
+      if (sq.cqid)
+        ++_stats.phase_wraps;
+    }
+
+  if (cq.ien)
+    _irq_pending = true;
+  return true;
+}
+
+l4_uint16_t
+Controller::admin(Sqe const &sqe, l4_uint32_t *dw0)
+{
+  ++_stats.admin_cmds;
+
+  if (sqe.psdt())
+    {
+      violation("admin command %#x uses SGLs", sqe.opc());
+      return Status_invalid_field;
+    }
+
+  switch (sqe.opc())
+    {
+    case Identify: return identify(sqe);
+    case Set_features: return set_features(sqe, dw0);
+    case Create_iocq: return create_cq(sqe);
+    case Create_iosq: return create_sq(sqe);
+    case Delete_iocq: return delete_cq(sqe);
+    case Doorbell_buffer_config:
+      if (_cfg.dbbuf)
+        return doorbell_buffer_config(sqe);
+      return Status_invalid_opcode;
+    default: return Status_invalid_opcode;
+    }
+}
+
+l4_uint16_t
+Controller::identify(Sqe const &sqe)
+{
+  char buf[Page_size];
+  memset(buf, 0, sizeof(buf));
+
+  switch (sqe.dw[10] & 0xff)
+    {
+    case 0: // Identify Namespace
+      {
+        if (!sqe.nsid() || sqe.nsid() > _cfg.nn)
+          return Status_invalid_ns;
+        put<l4_uint64_t>(buf, 0, _cfg.ns_blocks);  // NSZE
+        put<l4_uint64_t>(buf, 8, _cfg.ns_blocks);  // NCAP
+        put<l4_uint64_t>(buf, 16, _cfg.ns_blocks); // NUSE
+        put<l4_uint8_t>(buf, 25, 0);               // NLBAF: one format
+        put<l4_uint8_t>(buf, 26, 0);               // FLBAS: format 0
+        put<l4_uint8_t>(buf, 33, _cfg.dlfeat);
+        put<l4_uint32_t>(buf, 128, _cfg.lba_shift << 16); // LBAF0
+        break;
+      }
+    case 1: // Identify Controller
+      {
+        put<l4_uint16_t>(buf, 0, _cfg.vendor_id);
+        put<l4_uint16_t>(buf, 2, _cfg.vendor_id);
+        put_str(buf, 4, 20, _cfg.serial);
+        put_str(buf, 24, 40, "Simulated NVMe Controller");
+        put_str(buf, 64, 8, "1.0");
+        put<l4_uint8_t>(buf, 72, _cfg.rab);
+        put<l4_uint8_t>(buf, 77, _cfg.mdts);
+        put<l4_uint16_t>(buf, 78, 1);              // CNTLID
+        put<l4_uint32_t>(buf, 80, 0x10400);        // VER
+        put<l4_uint16_t>(buf, 256, _cfg.dbbuf ? 1 << 8 : 0); // OACS
+        put<l4_uint8_t>(buf, 512, 0x66);           // SQES
+        put<l4_uint8_t>(buf, 513, 0x44);           // CQES
+        put<l4_uint32_t>(buf, 516, _cfg.nn);
+        put<l4_uint16_t>(buf, 520, (_cfg.dsm ? 1 << 2 : 0) | 1 << 3); // ONCS
+        put<l4_uint8_t>(buf, 525, _cfg.vwc ? 1 : 0);
+        put<l4_uint32_t>(buf, 536, _cfg.sgls ? 1 : 0);
+        break;
+      }
+    case 2: // Active Namespace ID list
+      {
+        unsigned i = 0;
+        for (l4_uint32_t n = sqe.nsid() + 1; n <= _cfg.nn && i < 1024; ++n)
+          put<l4_uint32_t>(buf, 4 * i++, n);
+        break;
+      }
+    case 6: // I/O Command Set specific Identify Controller
+      {
+        if (sqe.dw[11] >> 24)
+          return Status_invalid_field;
+        put<l4_uint8_t>(buf, 1, _cfg.wzsl);
+        put<l4_uint8_t>(buf, 3, _cfg.dmrl);
+        put<l4_uint32_t>(buf, 4, _cfg.dmrsl);
+        put<l4_uint64_t>(buf, 8, _cfg.dmsl);
+        break;
+      }
+    default:
+      return Status_invalid_field;
+    }
+
+  return xfer(sqe, buf, sizeof(buf), true);
+}
+
+l4_uint16_t
+Controller::set_features(Sqe const &sqe, l4_uint32_t *dw0)
+{
+  l4_uint32_t dw11 = sqe.dw[11];
+
+  switch (sqe.dw[10] & 0xff)
+    {
+    case 1: // Arbitration
+      _arb = dw11;
+      return 0;
+    case 6: // Volatile Write Cache
+      if (!_cfg.vwc)
+        return Status_invalid_field;
+      _wce = dw11 & 1;
+      return 0;
+    case 7: // Number of Queues
+      {
+        for (unsigned qid = 1; qid < _sqs.size(); ++qid)
+          if (_sqs[qid].valid || _cqs[qid].valid)
+            return Status_cmd_seq_error;
+        unsigned nsqr = dw11 & 0xffff;
+        unsigned ncqr = dw11 >> 16;
+        if (nsqr == 0xffff || ncqr == 0xffff)
+          return Status_invalid_field;
+        _nioqs = std::min(std::min(nsqr, ncqr) + 1, _cfg.max_ioqs);
+        *dw0 = (_nioqs - 1) | (_nioqs - 1) << 16;
+        return 0;
+      }
+    case 8: // Interrupt Coalescing
+      return 0;
+    case 9: // Interrupt Vector Configuration
+      // Only the legacy interrupt, i.e. vector 0
+      return (dw11 & 0xffff) ? Status_invalid_field : 0;
+    default:
+      return Status_invalid_field;
+    }
+}
+
+l4_uint16_t
+Controller::create_cq(Sqe const &sqe)
+{
+  unsigned qid = sqe.dw[10] & 0xffff;
+  unsigned size = (sqe.dw[10] >> 16) + 1;
+  bool pc = sqe.dw[11] & 1;
+  bool ien = sqe.dw[11] & 2;
+  unsigned iv = sqe.dw[11] >> 16;
+  unsigned max = _nioqs ? _nioqs : _cfg.max_ioqs;
+
+  if (!qid || qid > max || _cqs[qid].valid)
+    return Status_qid_invalid;
+  if (size < 2 || size > _cfg.mqes + 1U)
+    return Status_qsize_invalid;
+  if (!pc)
+    return Status_invalid_field;
+  if (iv)
+    return Status_iv_invalid;
+
+  l4_uint64_t base = sqe.dptr1();
+  if ((base & (Page_size - 1)) || !mapped(base, size * 16))
+    {
+      violation("CQ%u base %#llx invalid", qid, (unsigned long long)base);
+      return Status_invalid_field;
+    }
+
+  _cqs[qid] = Cq{true, base, (l4_uint16_t)size, 0, 0, true, ien};
+  return 0;
+}
+
+l4_uint16_t
+Controller::create_sq(Sqe const &sqe)
+{
+  unsigned qid = sqe.dw[10] & 0xffff;
+  unsigned size = (sqe.dw[10] >> 16) + 1;
+  bool pc = sqe.dw[11] & 1;
+  unsigned prio = (sqe.dw[11] >> 1) & 0x3;
+  unsigned cqid = sqe.dw[11] >> 16;
+  unsigned max = _nioqs ? _nioqs : _cfg.max_ioqs;
+
+  if (!cqid || cqid >= _cqs.size() || !_cqs[cqid].valid)
+    return Status_cq_invalid;
+  if (!qid || qid > max || _sqs[qid].valid)
+    return Status_qid_invalid;
+  if (size < 2 || size > _cfg.mqes + 1U)
+    return Status_qsize_invalid;
+  if (!pc)
+    return Status_invalid_field;
+  if (qid == _cfg.fail_sq)
+    {
+      _cfg.fail_sq = 0;
+      return Status_invalid_field;
+    }
+
+  l4_uint64_t base = sqe.dptr1();
+  if ((base & (Page_size - 1)) || !mapped(base, size * 64))
+    {
+      violation("SQ%u base %#llx invalid", qid, (unsigned long long)base);
+      return Status_invalid_field;
+    }
+
+  _sqs[qid] = Sq{true, base, (l4_uint16_t)size, 0, 0, (l4_uint16_t)cqid, prio};
+  return 0;
+}
+
+l4_uint16_t
+Controller::delete_cq(Sqe const &sqe)
+{
+  unsigned qid = sqe.dw[10] & 0xffff;
+
+  if (!qid || qid >= _cqs.size() || !_cqs[qid].valid)
+    return Status_qid_invalid;
+  for (auto const &sq : _sqs)
+    if (sq.valid && sq.cqid == qid)
+      return Status_invalid_queue_deletion;
+
+  _cqs[qid].valid = false;
+  return 0;
+}
+
+l4_uint16_t
+Controller::doorbell_buffer_config(Sqe const &sqe)
+{
+  l4_uint64_t db = sqe.dptr1();
+  l4_uint64_t ei = sqe.dptr2();
+  l4_size_t size = _sqs.size() * 8;
+
+  if ((db & (Page_size - 1)) || (ei & (Page_size - 1)) || !mapped(db, size)
+      || !mapped(ei, size))
+    {
+      violation("doorbell buffers %#llx/%#llx invalid",
+                (unsigned long long)db, (unsigned long long)ei);
+      return Status_invalid_field;
+    }
+
+  _dbbuf = db;
+  _eibuf = ei;
+  return 0;
+}
+
+l4_uint16_t
+Controller::io(Sqe const &sqe)
+{
+  ++_stats.io_cmds;
+
+  if (_inject_sf && sqe.opc() == _inject_opc)
+    {
+      l4_uint16_t sf = _inject_sf;
+      _inject_sf = 0;
+      return sf;
+    }
+
+  if (sqe.psdt() > 1 || (sqe.psdt() == 1 && !_cfg.sgls))
+    {
+      violation("I/O command %#x with PSDT %u", sqe.opc(), sqe.psdt());
+      return Status_invalid_field;
+    }
+
+  if (sqe.opc() == Flush)
+    {
+      ++_stats.flushes;
+      return 0;
+    }
+
+  if (!sqe.nsid() || sqe.nsid() > _cfg.nn)
+    return Status_invalid_ns;
+
+  switch (sqe.opc())
+    {
+    case Write: return rw(sqe, true);
+    case Read: return rw(sqe, false);
+    case Write_zeroes: return write_zeroes(sqe);
+    case Dataset_management:
+      if (_cfg.dsm)
+        return dsm(sqe);
+      return Status_invalid_opcode;
+    default: return Status_invalid_opcode;
+    }
+}
+
+l4_uint16_t
+Controller::rw(Sqe const &sqe, bool write)
+{
+  l4_uint64_t slba = sqe.dw[10] | (l4_uint64_t)sqe.dw[11] << 32;
+  l4_uint64_t nlb = (sqe.dw[12] & 0xffff) + 1;
+  if (slba + nlb > _cfg.ns_blocks)
+    return Status_lba_out_of_range;
+
+  l4_size_t len = nlb << _cfg.lba_shift;
+  if (_cfg.mdts && len > (l4_size_t)Page_size << _cfg.mdts)
+    {
+      violation("transfer of %zu bytes exceeds MDTS", len);
+      return Status_invalid_field;
+    }
+
+  if (sqe.psdt())
+    ++_stats.sgl_cmds;
+
+  char *data = &_ns[sqe.nsid() - 1][slba << _cfg.lba_shift];
+  l4_uint16_t sf = xfer(sqe, data, len, !write);
+  if (!sf)
+    {
+      ++(write ? _stats.writes : _stats.reads);
+      _stats.bytes += len;
+    }
+  return sf;
+}
+
+l4_uint16_t
+Controller::write_zeroes(Sqe const &sqe)
+{
+  l4_uint64_t slba = sqe.dw[10] | (l4_uint64_t)sqe.dw[11] << 32;
+  l4_uint64_t nlb = (sqe.dw[12] & 0xffff) + 1;
+  if (slba + nlb > _cfg.ns_blocks)
+    return Status_lba_out_of_range;
+
+  l4_size_t len = nlb << _cfg.lba_shift;
+  if (_cfg.wzsl && len > (l4_size_t)Page_size << _cfg.wzsl)
+    {
+      violation("Write Zeroes of %zu bytes exceeds WZSL", len);
+      return Status_invalid_field;
+    }
+
+  memset(&_ns[sqe.nsid() - 1][slba << _cfg.lba_shift], 0, len);
+  ++_stats.write_zeroes;
+  return 0;
+}
+
+l4_uint16_t
+Controller::dsm(Sqe const &sqe)
+{
+  struct Range
+  {
+    l4_uint32_t cattr;
+    l4_uint32_t nlb;
+    l4_uint64_t slba;
+  } ranges[256];
+
+  unsigned nr = (sqe.dw[10] & 0xff) + 1;
+  bool deallocate = sqe.dw[11] & 4;
+
+  if (_cfg.dmrl && nr > _cfg.dmrl)
+    {
+      violation("%u Dataset Management ranges exceed DMRL", nr);
+      return Status_invalid_field;
+    }
+
+  l4_uint16_t sf = xfer(sqe, reinterpret_cast<char *>(ranges),
+                        nr * sizeof(Range), false);
+  if (sf)
+    return sf;
+
+  l4_uint64_t total = 0;
+  for (unsigned i = 0; i < nr; ++i)
+    {
+      Range const &r = ranges[i];
+      if (r.slba + r.nlb > _cfg.ns_blocks)
+        return Status_lba_out_of_range;
+      if (_cfg.dmrsl && r.nlb > _cfg.dmrsl)
+        {
+          violation("Dataset Management range of %u blocks exceeds DMRSL",
+                    r.nlb);
+          return Status_invalid_field;
+        }
+      total += r.nlb;
+    }
+
+  if (_cfg.dmsl && total > _cfg.dmsl)
+    {
+      violation("Dataset Management of %llu blocks exceeds DMSL",
+                (unsigned long long)total);
+      return Status_invalid_field;
+    }
+
+  // Deallocated blocks read as zeroes, see DLFEAT
+  if (deallocate)
+    for (unsigned i = 0; i < nr; ++i)
+      memset(&_ns[sqe.nsid() - 1][ranges[i].slba << _cfg.lba_shift], 0,
+             (l4_size_t)ranges[i].nlb << _cfg.lba_shift);
+
+  ++_stats.dsms;
+  return 0;
+}
+
+l4_uint16_t
+Controller::copy(l4_uint64_t addr, char *buf, l4_size_t len, bool to_host)
+{
+  if (!mapped(addr, len))
+    {
+      violation("data buffer %#llx+%zu not mapped", (unsigned long long)addr,
+                len);
+      return Status_data_xfer_error;
+    }
+
+  if (to_host)
+    memcpy(reinterpret_cast<void *>(addr), buf, len);
+  else
+    memcpy(buf, reinterpret_cast<void const *>(addr), len);
+  return 0;
+}
+
+l4_uint16_t
+Controller::xfer(Sqe const &sqe, char *buf, l4_size_t len, bool to_host)
+{
+  if (sqe.psdt())
+    return xfer_sgl(sqe, buf, len, to_host);
+  return xfer_prp(sqe, buf, len, to_host);
+}
+
+l4_uint16_t
+Controller::xfer_prp(Sqe const &sqe, char *buf, l4_size_t len, bool to_host)
+{
+  l4_uint64_t prp1 = sqe.dptr1();
+  if (prp1 & 3)
+    {
+      violation("PRP1 %#llx not dword aligned", (unsigned long long)prp1);
+      return Status_invalid_field;
+    }
+
+  // PRP1 may point into the middle of a page.
+  l4_size_t chunk = std::min<l4_size_t>(len, Page_size - (prp1 & (Page_size - 1)));
+  l4_uint16_t sf = copy(prp1, buf, chunk, to_host);
+  if (sf)
+    return sf;
+  buf += chunk;
+  len -= chunk;
+  if (!len)
+    return 0;
+
+  l4_uint64_t prp2 = sqe.dptr2();
+
+  // PRP2 is the second data page if that is the last one.
+  if (len <= Page_size)
+    {
+      if (prp2 & (Page_size - 1))
+        {
+          violation("PRP2 %#llx not page aligned", (unsigned long long)prp2);
+          return Status_invalid_field;
+        }
+      return copy(prp2, buf, len, to_host);
+    }
+
+  // Otherwise it points to a PRP List.
+  l4_uint64_t list = prp2;
+  if (list & 7)
+    {
+      violation("PRP List %#llx not qword aligned", (unsigned long long)list);
+      return Status_invalid_field;
+    }
+
+  ++_stats.prp_lists;
+  while (len)
+    {
+      if (!mapped(list, 8))
+        {
+          violation("PRP List entry %#llx not mapped",
+                    (unsigned long long)list);
+          return Status_data_xfer_error;
+        }
+
+      l4_uint64_t entry;
+      memcpy(&entry, reinterpret_cast<void const *>(list), sizeof(entry));
+
+      // The last entry of a list page points to the next list page unless
+      // it describes the last data page.
+      if (!((list + 8) & (Page_size - 1)) && len > Page_size)
+        {
+          if (entry & 7)
+            {
+              violation("chained PRP List %#llx not qword aligned",
+                        (unsigned long long)entry);
+              return Status_invalid_field;
+            }
+          list = entry;
+          ++_stats.prp_lists;
+          continue;
+        }
+
+      if (entry & (Page_size - 1))
+        {
+          violation("PRP entry %#llx not page aligned",
+                    (unsigned long long)entry);
+          return Status_invalid_field;
+        }
+
+      chunk = std::min<l4_size_t>(len, Page_size);
+      sf = copy(entry, buf, chunk, to_host);
+      if (sf)
+        return sf;
+      buf += chunk;
+      len -= chunk;
+      list += 8;
+    }
+
+  return 0;
+}
+
+l4_uint16_t
+Controller::xfer_sgl(Sqe const &sqe, char *buf, l4_size_t len, bool to_host)
+{
+  // The descriptor in the command forms a segment of its own that may end
+  // with a (Last) Segment descriptor.
+  char const *descs = reinterpret_cast<char const *>(&sqe.dw[6]);
+  unsigned n = 1;
+  bool last_segment = false;
+
+  for (;;)
+    {
+      l4_uint64_t next = 0;
+      l4_uint32_t next_len = 0;
+      unsigned next_type = 0;
+
+      for (unsigned i = 0; i < n; ++i)
+        {
+          Sgl_desc d(descs + 16 * i);
+          if (d.subtype)
+            {
+              violation("SGL descriptor subtype %u", d.subtype);
+              return Status_sgl_invalid_type;
+            }
+
+          if (d.type == Sgl_data)
+            {
+              if (d.len > len)
+                {
+                  violation("SGL describes more than %zu bytes", len);
+                  return Status_sgl_invalid_data;
+                }
+              l4_uint16_t sf = copy(d.addr, buf, d.len, to_host);
+              if (sf)
+                return sf;
+              buf += d.len;
+              len -= d.len;
+              continue;
+            }
+
+          if ((d.type == Sgl_segment || d.type == Sgl_last_segment)
+              && i == n - 1 && !last_segment)
+            {
+              next = d.addr;
+              next_len = d.len;
+              next_type = d.type;
+              break;
+            }
+
+          violation("SGL descriptor type %u at %u of %u", d.type, i, n);
+          return Status_sgl_invalid_type;
+        }
+
+      if (!next_len)
+        break;
+
+      if (next_len % 16 || !mapped(next, next_len))
+        {
+          violation("SGL segment %#llx+%u invalid", (unsigned long long)next,
+                    next_len);
+          return Status_sgl_invalid_seg;
+        }
+
+      descs = reinterpret_cast<char const *>(next);
+      n = next_len / 16;
+      last_segment = next_type == Sgl_last_segment;
+    }
+
+  if (len)
+    {
+      violation("SGL describes %zu bytes less than the transfer", len);
+      return Status_sgl_invalid_data;
+    }
+
+  return 0;
+}
+
+}
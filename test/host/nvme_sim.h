@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+/*
+ * Simulated NVMe controller.
+ *
+ * The model implements the controller registers, the admin commands used by
+ * the driver and the Flush, Read, Write, Write Zeroes and Dataset Management
+ * I/O commands on namespaces held in host memory. Commands are fetched and
+ * completed from the host event loop, data is transferred following the PRPs
+ * or SGLs of the commands.
+ *
+ * Everything the driver hands to the controller is checked against the
+ * specification: queue and data pointers must be aligned and DMA-mapped,
+ * PRP Lists and SGLs must describe exactly the length of the transfer and
+ * doorbell values must stay within the queues. Violations are counted and
+ * the affected commands fail.
+ *
+ * The controller only raises its legacy interrupt, neither MSI/MSI-X nor a
+ * Controller Memory Buffer are modelled.
+ */
+
+#include <l4/sys/icu>
+#include <l4/vbus/vbus>
+#include <l4/drivers/hw_mmio_register_block>
+
+#include <string>
+#include <vector>
+
+#include "host_env.h"
+
+namespace Sim {
+
+struct Config
+{
+  l4_uint16_t vendor_id = 0x1b36; ///< QEMU's NVMe controller
+  l4_uint16_t device_id = 0x0010;
+  std::string serial = "SIM0";
+
+  unsigned nn = 1;                   ///< Number of namespaces
+  l4_uint64_t ns_blocks = 8192;      ///< Logical blocks per namespace
+  unsigned lba_shift = 9;            ///< Logical block size as a power of two
+
+  l4_uint16_t mqes = 1023;           ///< Maximum Queue Entries, 0's based
+  unsigned max_ioqs = 64;            ///< I/O queue pairs granted
+  l4_uint8_t mdts = 5;               ///< Maximum Data Transfer Size
+  l4_uint8_t rab = 2;                ///< Recommended Arbitration Burst
+  l4_uint8_t to = 20;                ///< Ready timeout [500 ms]
+
+  bool sgls = false;                 ///< Support SGLs
+  bool vwc = true;                   ///< Volatile write cache present
+  bool dsm = true;                   ///< Support Dataset Management
+  bool wrr = true;                   ///< Support weighted round robin
+  bool dbbuf = false;                ///< Support Doorbell Buffer Config
+  /// With shadow doorbells, keep polling them instead of asking for doorbell
+  /// register writes through EventIdx.
+  bool dbbuf_poll = true;
+  /// Execute I/O commands as soon as the tail doorbell is written instead of
+  /// from the event loop, like a controller faster than the driver.
+  bool sync_io = false;
+
+  l4_uint8_t wzsl = 0;               ///< Write Zeroes Size Limit
+  l4_uint8_t dmrl = 0;               ///< Dataset Management Ranges Limit
+  l4_uint32_t dmrsl = 0;             ///< Dataset Management Range Size Limit
+  l4_uint64_t dmsl = 0;              ///< Dataset Management Size Limit
+  l4_uint8_t dlfeat = 0x9;           ///< Deallocate Logical Block Features
+
+  /// Fail the first Create I/O Submission Queue command for this queue
+  /// identifier, 0 for none
+  l4_uint16_t fail_sq = 0;
+
+  bool enabled = false;              ///< Controller initially enabled
+  unsigned ready_us = 2000;          ///< Time for CSTS.RDY to follow CC.EN
+  bool never_ready = false;          ///< CSTS.RDY never becomes 1
+
+  unsigned irq = 16;                 ///< Legacy interrupt line
+  l4_addr_t bar = 0xfe000000;        ///< Bus address of the registers
+  bool check_dma = true;             ///< Check that memory accesses are mapped
+};
+
+struct Stats
+{
+  unsigned long long admin_cmds;     ///< Admin commands processed
+  unsigned long long io_cmds;        ///< I/O commands processed
+  unsigned long long reads;
+  unsigned long long writes;
+  unsigned long long flushes;
+  unsigned long long write_zeroes;
+  unsigned long long dsms;
+  unsigned long long sgl_cmds;       ///< I/O commands with SGLs
+  unsigned long long prp_lists;      ///< PRP List pages walked
+  unsigned long long bytes;          ///< Bytes transferred by I/O commands
+  unsigned long long sq_doorbells;   ///< SQ tail doorbell register writes
+  unsigned long long cq_doorbells;   ///< CQ head doorbell register writes
+  unsigned long long irqs;           ///< Interrupts raised
+  unsigned long long errors;         ///< Commands completed with an error
+  unsigned long long violations;     ///< Driver errors detected
+  unsigned long long prio_cmds[4];   ///< I/O commands per priority class
+  unsigned long long phase_wraps;    ///< I/O CQ wrap-arounds
+};
+
+class Controller
+: public L4drivers::Mmio_hook,
+  public L4vbus::Pci_backend,
+  public Host::Device_model
+{
+public:
+  Controller(Config const &cfg, L4::Icu *icu);
+  ~Controller();
+
+  Controller(Controller const &) = delete;
+  Controller &operator=(Controller const &) = delete;
+
+  /// The vbus PCI device of the controller.
+  L4vbus::Pci_dev pci_dev()
+  { return L4vbus::Pci_dev(this); }
+
+  Config const &config() const
+  { return _cfg; }
+
+  Stats const &stats() const
+  { return _stats; }
+
+  void reset_stats()
+  { _stats = Stats(); }
+
+  /// Description of the last driver error detected, empty if none.
+  std::string const &last_violation() const
+  { return _last_violation; }
+
+  /// Whether the I/O completion queue `qid` exists.
+  bool cq_valid(unsigned qid) const
+  { return qid < _cqs.size() && _cqs[qid].valid; }
+
+  /// Backing store of namespace `nsid`.
+  std::vector<char> &data(unsigned nsid)
+  { return _ns[nsid - 1]; }
+
+  /**
+   * Complete the next I/O command with opcode `opc` with status `sf`
+   * (SC in bits 0-7, SCT in bits 8-10) without executing it.
+   */
+  void inject_error(l4_uint8_t opc, l4_uint16_t sf)
+  {
+    _inject_opc = opc;
+    _inject_sf = sf;
+  }
+
+  /// Stop or resume fetching commands, e.g. to let submissions pile up.
+  void pause(bool paused)
+  { _paused = paused; }
+
+  bool poll() override;
+
+  l4_uint32_t mmio_read32(l4_addr_t offset) override;
+  void mmio_write32(l4_addr_t offset, l4_uint32_t value) override;
+
+  int cfg_read(l4_uint32_t reg, l4_uint32_t *value,
+               l4_uint32_t width) override;
+  int cfg_write(l4_uint32_t reg, l4_uint32_t value,
+                l4_uint32_t width) override;
+  int irq_enable(unsigned char *trigger, unsigned char *polarity) override;
+
+private:
+  struct Sq
+  {
+    bool valid;
+    l4_uint64_t base;
+    l4_uint16_t size;
+    l4_uint16_t head;
+    l4_uint16_t tail;
+    l4_uint16_t cqid;
+    unsigned prio;
+  };
+
+  struct Cq
+  {
+    bool valid;
+    l4_uint64_t base;
+    l4_uint16_t size;
+    l4_uint16_t head;
+    l4_uint16_t tail;
+    bool phase;
+    bool ien;
+  };
+
+  /// Raw submission queue entry
+  struct Sqe
+  {
+    l4_uint32_t dw[16];
+
+    l4_uint8_t opc() const { return dw[0] & 0xff; }
+    unsigned psdt() const { return (dw[0] >> 14) & 0x3; }
+    l4_uint16_t cid() const { return dw[0] >> 16; }
+    l4_uint32_t nsid() const { return dw[1]; }
+    l4_uint64_t dptr1() const { return dw[6] | (l4_uint64_t)dw[7] << 32; }
+    l4_uint64_t dptr2() const { return dw[8] | (l4_uint64_t)dw[9] << 32; }
+  };
+
+  enum
+  {
+    Page_size = 4096,
+    Status_invalid_opcode = 0x01,
+    Status_invalid_field = 0x02,
+    Status_data_xfer_error = 0x04,
+    Status_invalid_ns = 0x0b,
+    Status_cmd_seq_error = 0x0c,
+    Status_sgl_invalid_seg = 0x0d,
+    Status_sgl_invalid_data = 0x0f,
+    Status_sgl_invalid_type = 0x11,
+    Status_lba_out_of_range = 0x80,
+    Status_cq_invalid = 0x100,
+    Status_qid_invalid = 0x101,
+    Status_qsize_invalid = 0x102,
+    Status_iv_invalid = 0x108,
+    Status_invalid_queue_deletion = 0x10c,
+  };
+
+  bool ready();
+  void enable();
+  void disable();
+  void violation(char const *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+  bool mapped(l4_uint64_t addr, l4_size_t size)
+  { return !_cfg.check_dma || Host::dma_mapped(addr, size); }
+
+  void sync_shadow_doorbells();
+  void update_event_indexes();
+  unsigned process_sq(l4_uint16_t qid, unsigned budget);
+  bool post(l4_uint16_t sqid, l4_uint16_t cid, l4_uint16_t sf,
+            l4_uint32_t dw0);
+
+  l4_uint16_t admin(Sqe const &sqe, l4_uint32_t *dw0);
+  l4_uint16_t identify(Sqe const &sqe);
+  l4_uint16_t set_features(Sqe const &sqe, l4_uint32_t *dw0);
+  l4_uint16_t create_cq(Sqe const &sqe);
+  l4_uint16_t create_sq(Sqe const &sqe);
+  l4_uint16_t delete_cq(Sqe const &sqe);
+  l4_uint16_t doorbell_buffer_config(Sqe const &sqe);
+
+  l4_uint16_t io(Sqe const &sqe);
+  l4_uint16_t rw(Sqe const &sqe, bool write);
+  l4_uint16_t write_zeroes(Sqe const &sqe);
+  l4_uint16_t dsm(Sqe const &sqe);
+
+  /**
+   * Copy `len` bytes between `buf` and the memory described by the data
+   * pointer of `sqe`, towards the host if `to_host`.
+   */
+  l4_uint16_t xfer(Sqe const &sqe, char *buf, l4_size_t len, bool to_host);
+  l4_uint16_t xfer_prp(Sqe const &sqe, char *buf, l4_size_t len,
+                       bool to_host);
+  l4_uint16_t xfer_sgl(Sqe const &sqe, char *buf, l4_size_t len,
+                       bool to_host);
+  l4_uint16_t copy(l4_uint64_t addr, char *buf, l4_size_t len, bool to_host);
+
+  Config _cfg;
+  L4::Icu *_icu;
+  Stats _stats;
+  std::string _last_violation;
+  std::vector<std::vector<char>> _ns;
+
+  // Registers
+  l4_uint64_t _cap;
+  l4_uint32_t _cc;
+  l4_uint32_t _aqa;
+  l4_uint64_t _asq;
+  l4_uint64_t _acq;
+  l4_uint32_t _intm;
+  bool _cfs;
+  bool _rdy;
+  /// Time at which CSTS.RDY follows CC.EN
+  l4_cpu_time_t _rdy_at;
+
+  // PCI configuration space
+  l4_uint16_t _pci_cmd;
+  l4_uint32_t _pci_bar[2];
+  bool _irq_enabled;
+  /// Completions were posted to a queue with interrupts enabled
+  bool _irq_pending;
+
+  std::vector<Sq> _sqs;
+  std::vector<Cq> _cqs;
+
+  // Features
+  l4_uint32_t _arb;
+  bool _wce;
+  unsigned _nioqs;
+
+  /// Shadow doorbell and EventIdx buffers, 0 if not configured
+  l4_uint64_t _dbbuf;
+  l4_uint64_t _eibuf;
+
+  l4_uint8_t _inject_opc;
+  l4_uint16_t _inject_sf;
+  bool _paused;
+};
+
+}
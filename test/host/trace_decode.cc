@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): Jakub Jermar <jakub.jermar@kernkonzept.com>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+/*
+ * Decoder of a dump of the command trace dataspace of the driver.
+ *
+ * Reconstructs the life cycle of each traced I/O command from the events of
+ * its ring and reports the latency of each stage:
+ *
+ *   queue     produce to tail doorbell update
+ *   device    tail doorbell update to completion queue entry observed
+ *   complete  completion queue entry to client callback returned
+ *   notify    client callback returned to end of the completion drain
+ *   total     produce to end of the completion drain
+ *
+ * Output is one line per ring and stage, followed by the stages over all
+ * rings:
+ *   trace-stage ring=<name>/q<qid>|all stage=<name> n=<n> mean_us=<x>
+ *               p50_us=<x> p99_us=<x> max_us=<x>
+ *
+ * Commands whose events were overwritten or that had not completed when the
+ * dump was taken only count for the stages they have both events of.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <l4/nvme-driver/trace.h>
+
+namespace {
+
+using Nvme::Trace_event;
+
+enum Stage { Queue, Device, Complete, Notify, Total, Num_stages };
+
+char const *const stage_names[Num_stages] =
+  { "queue", "device", "complete", "notify", "total" };
+
+/// Time stamps of a command, 0 for events not seen
+struct Command
+{
+  l4_uint16_t cid;
+  l4_uint16_t group;
+  l4_uint64_t produce, doorbell, cqe, callback;
+};
+
+/// Latencies of each stage [cycles]
+struct Stages
+{
+  std::vector<l4_uint64_t> lat[Num_stages];
+
+  void add(Stage s, l4_uint64_t from, l4_uint64_t to)
+  {
+    if (from && to >= from)
+      lat[s].push_back(to - from);
+  }
+
+  void add(Command const &c, l4_uint64_t notify)
+  {
+    add(Queue, c.produce, c.doorbell);
+    add(Device, c.doorbell, c.cqe);
+    add(Complete, c.cqe, c.callback);
+    add(Notify, c.callback, notify);
+    if (c.doorbell && c.cqe && c.callback)
+      add(Total, c.produce, notify);
+  }
+
+  void merge(Stages const &o)
+  {
+    for (unsigned s = 0; s < Num_stages; ++s)
+      lat[s].insert(lat[s].end(), o.lat[s].begin(), o.lat[s].end());
+  }
+
+  void print(char const *ring, double us_per_cycle)
+  {
+    for (unsigned s = 0; s < Num_stages; ++s)
+      {
+        auto &v = lat[s];
+        if (v.empty())
+          continue;
+
+        std::sort(v.begin(), v.end());
+        double sum = 0;
+        for (auto l : v)
+          sum += l;
+        auto pct = [&](unsigned p) { return v[(v.size() - 1) * p / 100]; };
+        printf("trace-stage ring=%s stage=%s n=%zu mean_us=%.2f p50_us=%.2f "
+               "p99_us=%.2f max_us=%.2f\n", ring, stage_names[s], v.size(),
+               sum / v.size() * us_per_cycle, pct(50) * us_per_cycle,
+               pct(99) * us_per_cycle, v.back() * us_per_cycle);
+      }
+  }
+};
+
+/**
+ * Replay the events of a ring.
+ *
+ * Command identifiers and request groups are reused as soon as a command
+ * completed, possibly by a command produced from within the callback of the
+ * previous one. So a completion event only matches a command that has seen
+ * the events before it.
+ */
+Stages
+decode(std::vector<Trace_event> const &events)
+{
+  Stages st;
+  std::vector<Command> open;
+  std::vector<Command> done;
+
+  for (auto const &e : events)
+    switch (e.type)
+      {
+      case Trace_event::Produce:
+        open.push_back(Command{e.cid, e.group, e.stamp, 0, 0, 0});
+        break;
+
+      case Trace_event::Doorbell:
+        for (auto &c : open)
+          if (!c.doorbell)
+            c.doorbell = e.stamp;
+        break;
+
+      case Trace_event::Cqe:
+        for (auto &c : open)
+          if (c.cid == e.cid && c.doorbell && !c.cqe)
+            {
+              c.cqe = e.stamp;
+              break;
+            }
+        break;
+
+      case Trace_event::Callback:
+        for (auto it = open.begin(); it != open.end();)
+          {
+            bool match = e.group ? it->group == e.group : it->cid == e.cid;
+            if (match && it->cqe)
+              {
+                it->callback = e.stamp;
+                done.push_back(*it);
+                it = open.erase(it);
+                if (!e.group)
+                  break;
+              }
+            else
+              ++it;
+          }
+        break;
+
+      case Trace_event::Notify:
+        for (auto const &c : done)
+          st.add(c, e.stamp);
+        done.clear();
+        break;
+      }
+
+  // Stages of commands that did not reach the end of a drain
+  for (auto const &c : done)
+    st.add(c, 0);
+  for (auto const &c : open)
+    st.add(c, 0);
+  return st;
+}
+
+bool
+read_file(char const *path, std::vector<char> *buf)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return false;
+
+  char chunk[65536];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    buf->insert(buf->end(), chunk, chunk + n);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc != 2)
+    {
+      fprintf(stderr, "Usage: %s DUMP\n", argv[0]);
+      return 2;
+    }
+
+  std::vector<char> buf;
+  if (!read_file(argv[1], &buf))
+    {
+      fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[1]);
+      return 1;
+    }
+
+  Nvme::Trace_header hdr;
+  if (buf.size() < sizeof(hdr))
+    {
+      fprintf(stderr, "%s: dump too short\n", argv[0]);
+      return 1;
+    }
+  memcpy(&hdr, buf.data(), sizeof(hdr));
+
+  unsigned entries = hdr.ring_entries;
+  if (hdr.magic != Nvme::Trace_header::Magic
+      || hdr.version != Nvme::Trace_header::Version
+      || hdr.entry_size != sizeof(Trace_event) || !entries
+      || (entries & (entries - 1))
+      || hdr.ring_size != sizeof(Nvme::Trace_ring_header)
+                          + entries * sizeof(Trace_event)
+      || buf.size() < sizeof(hdr) + (size_t)hdr.num_rings * hdr.ring_size)
+    {
+      fprintf(stderr, "%s: not a trace dump of a supported version\n",
+              argv[0]);
+      return 1;
+    }
+
+  double us_per_cycle = 1.0;
+  if (hdr.cycles_per_ms)
+    us_per_cycle = 1000.0 / hdr.cycles_per_ms;
+  else
+    fprintf(stderr, "%s: cycle counter rate unknown, reporting cycles\n",
+            argv[0]);
+
+  Stages all;
+  std::vector<Trace_event> events(entries);
+  for (unsigned i = 0; i < hdr.num_rings; ++i)
+    {
+      auto const *r = reinterpret_cast<Nvme::Trace_ring_header const *>(
+        buf.data() + sizeof(hdr) + (size_t)i * hdr.ring_size);
+      unsigned n = Nvme::trace_ring_events(r, entries, events.data());
+      events.resize(n);
+
+      Stages st = decode(events);
+      std::string name(r->name, strnlen(r->name, sizeof(r->name)));
+      name += "/q" + std::to_string(r->qid);
+      st.print(name.c_str(), us_per_cycle);
+      all.merge(st);
+      events.resize(entries);
+    }
+
+  all.print("all", us_per_cycle);
+  return 0;
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+
+# Create a sparse disk file with a GPT and a single partition covering it
+
+image=$1
+size=${NVME_BENCH_DISK_SIZE:-1G}
+
+EXIT_SKIP=69
+
+if which sgdisk; then
+  sgdisk=sgdisk
+elif [ -x /sbin/sgdisk ]; then
+  sgdisk=/sbin/sgdisk
+else
+  echo "Cannot find sgdisk tool for creating GPT."
+  exit $EXIT_SKIP
+fi
+
+rm -f $image
+truncate -s $size $image
+$sgdisk -o -N 1 -u 1:6A1F4C3E-2B8D-4E57-9C0A-5D7E31B2F406 $image
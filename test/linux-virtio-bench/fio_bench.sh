@@ -0,0 +1,88 @@
+#!/bin/sh
+
+# Run a fixed matrix of fio jobs against the NVMe driver and report one
+# machine-readable line per job and data direction:
+#
+#   nvme-bench cfg=<prp|sgl> job=<name> dir=<read|write> iops=<n> bw_kib=<n>
+#              lat_p50_us=<n> lat_p99_us=<n> lat_p99.9_us=<n>
+#
+# Latencies are fio's completion latencies. Each job is also a TAP test that
+# fails if fio fails or reports an error.
+#
+# Needs fio with the libaio engine in the L4Linux ramdisk.
+
+dev=/dev/vda
+runtime=${FIO_RUNTIME:-30}
+ramp=${FIO_RAMP:-5}
+
+# Configuration name passed by the ned script on the kernel command line
+cfg=$(sed -n 's/.*nvme_bench\.name=\([^ ]*\).*/\1/p' /proc/cmdline)
+cfg=${cfg:-unknown}
+
+# name rw bs iodepth [extra fio options]
+jobs="
+randread-4k-qd1    randread  4k   1
+randread-4k-qd32   randread  4k   32
+randwrite-4k-qd1   randwrite 4k   1
+randwrite-4k-qd32  randwrite 4k   32
+seqread-128k-qd8   read      128k 8
+seqwrite-128k-qd8  write     128k 8
+randrw70-4k-qd32   randrw    4k   32 --rwmixread=70
+"
+
+# Print the results of one data direction of a fio terse (version 3) line.
+# The status of each direction has 41 fields: I/O [KiB], bandwidth [KiB/s],
+# IOPS, runtime, 4 submission latency, 4 completion latency and 20 completion
+# latency percentile fields, 4 total latency and 5 bandwidth fields.
+report()
+{
+  echo "$2" | awk -F';' -v cfg="$cfg" -v dir="$1" '
+    {
+      base = dir == "read" ? 6 : 47
+      if ($(base + 2) == 0)
+        exit
+      for (i = base + 12; i < base + 32; i++)
+        {
+          split($i, p, "=")
+          pct[p[1]] = p[2]
+        }
+      printf "nvme-bench cfg=%s job=%s dir=%s iops=%s bw_kib=%s", \
+             cfg, $3, dir, $(base + 2), $(base + 1)
+      printf " lat_p50_us=%s lat_p99_us=%s lat_p99.9_us=%s\n", \
+             pct["50.000000%"], pct["99.000000%"], pct["99.900000%"]
+    }'
+}
+
+echo 'TAP TEST START'
+echo "1..$(echo "$jobs" | grep -c .)"
+
+if ! which fio > /dev/null; then
+  echo "$jobs" | grep . | while read name rest; do
+    echo "ok - $name # SKIP fio not available"
+  done
+  echo 'TAP TEST FINISH'
+  exit 0
+fi
+
+n=0
+echo "$jobs" | grep . | while read name rw bs qd extra; do
+  n=$((n + 1))
+  out=$(fio --name=$name --filename=$dev --rw=$rw --bs=$bs --iodepth=$qd \
+            --ioengine=libaio --direct=1 --time_based --runtime=$runtime \
+            --ramp_time=$ramp --randrepeat=0 --norandommap \
+            --percentile_list=50:99:99.9 \
+            --output-format=terse --terse-version=3 $extra 2>&1)
+  rc=$?
+  line=$(echo "$out" | grep "^3;")
+  err=$(echo "$line" | cut -d';' -f5)
+  if [ $rc -ne 0 -o -z "$line" -o "$err" != "0" ]; then
+    echo "not ok $n - $name"
+    echo "$out" | sed 's/^/# /'
+    continue
+  fi
+  report read "$line"
+  report write "$line"
+  echo "ok $n - $name"
+done
+
+echo 'TAP TEST FINISH'
@@ -0,0 +1,51 @@
+-- vim:set ft=lua:
+
+-- Common setup of the benchmark configurations: io, the NVMe driver with
+-- the given options and L4Linux with the benchmark partition as /dev/vda.
+-- The name of the configuration is passed to the benchmark script on the
+-- kernel command line.
+
+local L4 = require("L4");
+local t = require("rom/test_env")
+
+local loader = L4.default_loader;
+
+local function start(name, drv_opts)
+  local vbus_l4linux = loader:new_channel();
+  local vbus_nvme    = loader:new_channel();
+
+  loader:start(
+    {
+      caps = {
+        sigma0  = L4.cast(L4.Proto.Factory, L4.Env.sigma0):create(L4.Proto.Sigma0);
+        icu     = L4.Env.icu;
+        iommu   = L4.Env.iommu,
+        l4linux = vbus_l4linux:svr();
+        nvmedrv = vbus_nvme:svr();
+      },
+    },
+    "rom/io rom/l4linux-nvme.io");
+
+  local nvme = loader:new_channel();
+
+  loader:start(
+    {
+      caps = {
+        vbus = vbus_nvme,
+        svr = nvme:svr(),
+      },
+      log      = { "nvme", "g" },
+    },
+    "rom/nvme-drv " .. drv_opts);
+
+  loader:start(
+    { caps = {
+        vbus = vbus_l4linux;
+        qdrv = nvme:create(0, "ds-max=5", "device=6A1F4C3E-2B8D-4E57-9C0A-5D7E31B2F406");
+      },
+      log = L4.Env.log,
+    },
+    t.L4LX_EXEC_CMD .. " root=1:0 mem=256M virtio_l4.add=qdrv nvme_bench.name=" .. name);
+end
+
+return { start = start }